@@ -0,0 +1,362 @@
+#include <c4/std/string.hpp>
+#include <c4/conf/conf.hpp>
+#include <c4/fs/fs.hpp>
+#include <benchmark/benchmark.h>
+
+#include <string>
+#include <vector>
+
+C4_SUPPRESS_WARNING_GCC_CLANG_PUSH
+C4_SUPPRESS_WARNING_GCC_CLANG("-Wold-style-cast")
+
+namespace c4 {
+namespace conf {
+
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+/** the shape of a synthetic config */
+struct Shape
+{
+    size_t depth;  //!< the number of nested map levels
+    size_t width;  //!< the number of children of each map
+    size_t seqlen; //!< the length of the leaf seqs. When zero, the leaves are scalars
+};
+
+/** generate a block map with the given shape. Every layer has the
+ * same keys with different values, so merging layers overwrites. */
+void gen_map(std::string *out, size_t indent, Shape shape, size_t layer)
+{
+    for(size_t i = 0; i < shape.width; ++i)
+    {
+        out->append(indent, ' ');
+        out->append("key");
+        out->append(std::to_string(i));
+        out->append(":");
+        if(shape.depth > 1)
+        {
+            out->append("\n");
+            gen_map(out, indent + 2u, {shape.depth - 1u, shape.width, shape.seqlen}, layer);
+        }
+        else if(shape.seqlen)
+        {
+            out->append("\n");
+            for(size_t j = 0; j < shape.seqlen; ++j)
+            {
+                out->append(indent + 2u, ' ');
+                out->append("- value");
+                out->append(std::to_string(layer));
+                out->append("_");
+                out->append(std::to_string(j));
+                out->append("\n");
+            }
+        }
+        else
+        {
+            out->append(" value");
+            out->append(std::to_string(layer));
+            out->append("\n");
+        }
+    }
+}
+
+std::string gen_conf(Shape shape, size_t layer)
+{
+    std::string out;
+    gen_map(&out, 0u, shape, layer);
+    return out;
+}
+
+size_t count_nodes(csubstr conf)
+{
+    return yml::parse_in_arena(conf).size();
+}
+
+/** a scratch directory with synthetic config files, one per layer */
+struct ConfFiles
+{
+    std::string m_dir;
+    std::vector<std::string> m_files;
+    size_t m_num_bytes;
+    size_t m_num_nodes;
+    ConfFiles(const char *dirname, Shape shape, size_t num_files)
+        : m_dir(dirname)
+        , m_files()
+        , m_num_bytes(0)
+        , m_num_nodes(0)
+    {
+        if(fs::dir_exists(dirname))
+            C4_CHECK(fs::rmtree(dirname) == 0);
+        C4_CHECK(fs::mkdir(dirname) == 0);
+        for(size_t i = 0; i < num_files; ++i)
+        {
+            const std::string conf = gen_conf(shape, i);
+            // zero-pad the names, so that they sort in layer order
+            std::string num = std::to_string(i);
+            m_files.emplace_back(m_dir + "/layer" + std::string(6u - num.size(), '0') + num + ".yml");
+            fs::file_put_contents(m_files.back().c_str(), to_csubstr(conf));
+            m_num_bytes += conf.size();
+            m_num_nodes += count_nodes(to_csubstr(conf));
+        }
+    }
+    ~ConfFiles()
+    {
+        fs::rmtree(m_dir.c_str());
+    }
+};
+
+/** report the throughput in bytes/s and nodes/s */
+void set_counters(benchmark::State &st, size_t num_bytes, size_t num_nodes)
+{
+    st.SetBytesProcessed((int64_t)num_bytes * (int64_t)st.iterations());
+    st.counters["nodes"] = benchmark::Counter((double)num_nodes * (double)st.iterations(), benchmark::Counter::kIsRate);
+}
+
+Shape shape_arg(benchmark::State const& st)
+{
+    return {(size_t)st.range(0), (size_t)st.range(1), (size_t)st.range(2)};
+}
+
+constexpr const ConfigActionSpec specs[] = {
+    spec_for<ConfigAction::set_node>("-n", "--node"),
+    spec_for<ConfigAction::load_file>("-f", "--file"),
+    spec_for<ConfigAction::load_dir>("-d", "--dir"),
+};
+C4CONF_STATIC_CHECK_SPECS(specs);
+constexpr const auto spec_table = make_spec_table(specs);
+
+/** a command line, kept so that it can be parsed many times */
+struct Args
+{
+    std::vector<std::string> m_strings;
+    std::vector<char*> m_argv;
+    size_t m_num_bytes = 0;
+    void add(std::string s)
+    {
+        m_num_bytes += s.size();
+        m_strings.emplace_back(std::move(s));
+    }
+    /** reset the pointers, after a parse removed the options */
+    char** reset(int *argc)
+    {
+        m_argv.clear();
+        for(std::string &s : m_strings)
+            m_argv.push_back(&s[0]);
+        *argc = (int)m_argv.size();
+        return m_argv.data();
+    }
+};
+
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+// args: depth, width, seqlen, number of layers
+void bm_add_conf(benchmark::State &st)
+{
+    const Shape shape = shape_arg(st);
+    const size_t num_layers = (size_t)st.range(3);
+    std::vector<std::string> layers;
+    size_t num_bytes = 0, num_nodes = 0;
+    for(size_t i = 0; i < num_layers; ++i)
+    {
+        layers.emplace_back(gen_conf(shape, i));
+        num_bytes += layers.back().size();
+        num_nodes += count_nodes(to_csubstr(layers.back()));
+    }
+    for(auto _ : st)
+    {
+        yml::Tree output;
+        output.rootref() |= yml::MAP;
+        Workspace ws(&output);
+        for(std::string const& layer : layers)
+            ws.prepare_add_conf(csubstr{}, to_csubstr(layer));
+        for(std::string const& layer : layers)
+            ws.add_conf(csubstr{}, to_csubstr(layer));
+        benchmark::DoNotOptimize(output.size());
+    }
+    set_counters(st, num_bytes, num_nodes);
+}
+
+// args: depth, width, seqlen, number of layers
+// like bm_add_conf, but reusing the output tree and the workspace
+void bm_add_conf_reset(benchmark::State &st)
+{
+    const Shape shape = shape_arg(st);
+    const size_t num_layers = (size_t)st.range(3);
+    std::vector<std::string> layers;
+    size_t num_bytes = 0, num_nodes = 0;
+    for(size_t i = 0; i < num_layers; ++i)
+    {
+        layers.emplace_back(gen_conf(shape, i));
+        num_bytes += layers.back().size();
+        num_nodes += count_nodes(to_csubstr(layers.back()));
+    }
+    yml::Tree output;
+    Workspace ws(&output);
+    for(auto _ : st)
+    {
+        output.clear();
+        output.clear_arena();
+        output.rootref() |= yml::MAP;
+        ws.reset();
+        for(std::string const& layer : layers)
+            ws.prepare_add_conf(csubstr{}, to_csubstr(layer));
+        for(std::string const& layer : layers)
+            ws.add_conf(csubstr{}, to_csubstr(layer));
+        benchmark::DoNotOptimize(output.size());
+    }
+    set_counters(st, num_bytes, num_nodes);
+}
+
+// args: depth, width, seqlen, workspace flags
+void bm_add_file(benchmark::State &st)
+{
+    ConfFiles files("c4conf_bm_add_file", shape_arg(st), 1u);
+    const uint32_t flags = (uint32_t)st.range(3);
+    for(auto _ : st)
+    {
+        yml::Tree output;
+        output.rootref() |= yml::MAP;
+        Workspace ws(&output, nullptr, flags);
+        ws.prepare_add_file(files.m_files[0].c_str());
+        ws.add_file(files.m_files[0].c_str());
+        benchmark::DoNotOptimize(output.size());
+    }
+    set_counters(st, files.m_num_bytes, files.m_num_nodes);
+}
+
+// args: depth, width, seqlen, files in the directory, workspace flags
+void bm_add_dir(benchmark::State &st)
+{
+    ConfFiles files("c4conf_bm_add_dir", shape_arg(st), (size_t)st.range(3));
+    const uint32_t flags = (uint32_t)st.range(4);
+    for(auto _ : st)
+    {
+        yml::Tree output;
+        output.rootref() |= yml::MAP;
+        Workspace ws(&output, nullptr, flags);
+        ws.prepare_add_dir(files.m_dir.c_str());
+        ws.add_dir(files.m_dir.c_str());
+        benchmark::DoNotOptimize(output.size());
+    }
+    set_counters(st, files.m_num_bytes, files.m_num_nodes);
+}
+
+// args: number of options
+void bm_parse_opts(benchmark::State &st)
+{
+    const size_t num_opts = (size_t)st.range(0);
+    Args args;
+    for(size_t i = 0; i < num_opts; ++i)
+    {
+        // mix the options with arguments which are not options
+        args.add("-n");
+        args.add("key" + std::to_string(i % 16u) + ".key" + std::to_string(i) + "=value" + std::to_string(i));
+        args.add("--not-an-option" + std::to_string(i));
+    }
+    const OptionTable table(spec_table);
+    std::vector<ParsedOpt> parsed(num_opts);
+    for(auto _ : st)
+    {
+        int argc;
+        char **argv = args.reset(&argc);
+        size_t ret = parse_opts(&argc, &argv, table, parsed.data(), parsed.size());
+        C4_CHECK(ret == num_opts);
+        benchmark::DoNotOptimize(parsed.data());
+    }
+    st.SetBytesProcessed((int64_t)args.m_num_bytes * (int64_t)st.iterations());
+    st.counters["opts"] = benchmark::Counter((double)num_opts * (double)st.iterations(), benchmark::Counter::kIsRate);
+}
+
+// args: depth, width, seqlen, number of layers, workspace flags
+void bm_apply_opts(benchmark::State &st)
+{
+    ConfFiles files("c4conf_bm_apply_opts", shape_arg(st), (size_t)st.range(3));
+    const uint32_t flags = (uint32_t)st.range(4);
+    // each layer is a file, followed by an override of one of its nodes
+    Args args;
+    for(size_t i = 0; i < files.m_files.size(); ++i)
+    {
+        args.add("-f");
+        args.add(files.m_files[i]);
+        args.add("-n");
+        args.add("key0=overridden" + std::to_string(i));
+    }
+    const OptionTable table(spec_table);
+    std::vector<ParsedOpt> parsed;
+    for(auto _ : st)
+    {
+        int argc;
+        char **argv = args.reset(&argc);
+        C4_CHECK(parse_opts(&argc, &argv, table, &parsed));
+        yml::Tree output;
+        output.rootref() |= yml::MAP;
+        Workspace ws(&output, nullptr, flags);
+        ws.apply_opts(parsed);
+        benchmark::DoNotOptimize(output.size());
+    }
+    set_counters(st, files.m_num_bytes + args.m_num_bytes, files.m_num_nodes);
+}
+
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+BENCHMARK(bm_add_conf)
+    ->ArgNames({"depth", "width", "seqlen", "layers"})
+    ->Args({2, 16, 0, 1})
+    ->Args({4, 8, 0, 1})
+    ->Args({4, 8, 8, 1})
+    ->Args({6, 4, 4, 1})
+    ->Args({4, 8, 4, 4})
+    ->Args({4, 8, 4, 16});
+
+BENCHMARK(bm_add_conf_reset)
+    ->ArgNames({"depth", "width", "seqlen", "layers"})
+    ->Args({2, 16, 0, 1})
+    ->Args({4, 8, 0, 1})
+    ->Args({4, 8, 4, 4})
+    ->Args({4, 8, 4, 16});
+
+BENCHMARK(bm_add_file)
+    ->ArgNames({"depth", "width", "seqlen", "flags"})
+    ->Args({4, 8, 4, WS_DEFAULT})
+    ->Args({4, 8, 4, WS_MMAP_FILES})
+    ->Args({5, 10, 8, WS_DEFAULT})
+    ->Args({5, 10, 8, WS_MMAP_FILES});
+
+BENCHMARK(bm_add_dir)
+    ->ArgNames({"depth", "width", "seqlen", "files", "flags"})
+    ->Args({3, 8, 4, 4, WS_DEFAULT})
+    ->Args({3, 8, 4, 64, WS_DEFAULT})
+    ->Args({3, 8, 4, 64, WS_MMAP_FILES})
+    ->Args({3, 8, 4, 64, WS_PARALLEL_DIRS})
+    ->Args({3, 8, 4, 64, WS_PARALLEL_DIRS|WS_MMAP_FILES})
+    ->Args({3, 8, 4, 64, WS_DEFERRED_MERGE})
+    ->Args({3, 8, 4, 64, WS_DEFERRED_MERGE|WS_PARALLEL_DIRS})
+    ->UseRealTime();
+
+BENCHMARK(bm_parse_opts)
+    ->ArgNames({"opts"})
+    ->Arg(4)
+    ->Arg(64)
+    ->Arg(1024);
+
+BENCHMARK(bm_apply_opts)
+    ->ArgNames({"depth", "width", "seqlen", "layers", "flags"})
+    ->Args({3, 8, 4, 1, WS_DEFAULT})
+    ->Args({3, 8, 4, 16, WS_DEFAULT})
+    ->Args({3, 8, 4, 16, WS_MMAP_FILES})
+    ->Args({3, 8, 4, 16, WS_DEFERRED_MERGE});
+
+} // namespace conf
+} // namespace c4
+
+C4_SUPPRESS_WARNING_GCC_CLANG_POP
+
+BENCHMARK_MAIN();
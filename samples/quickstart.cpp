@@ -33,7 +33,7 @@ void setbar2(Tree &tree, csubstr bar2val);
 
 // create the specs for the command line options to be handled by
 // c4conf. These options will transform the config tree:
-const ConfigActionSpec conf_specs[] = {
+constexpr const ConfigActionSpec conf_specs[] = {
     // using an explicit csubstr() is required by GCC5, but not with
     // later versions, which will pick the proper csubstr constructor.
     spec_for<ConfigAction::set_node> (csubstr("-cn" ), csubstr("--conf-node"   )),
@@ -44,6 +44,10 @@ const ConfigActionSpec conf_specs[] = {
     spec_for(&setfoo3,                csubstr("-sf3"), csubstr("--set-foo3-val"), csubstr("<foo3val>"  ), csubstr("call setfoo3() with a required arg)")),
     spec_for(&setbar2,                csubstr("-sb2"), csubstr("--set-bar2-val"), csubstr("[<bar2val>]"), csubstr("call setbar2() with an optional arg)")),
 };
+// Because the specs are constexpr, they can be checked at compile
+// time for duplicate option names, malformed argument names, and
+// callback specs without a callback:
+C4CONF_STATIC_CHECK_SPECS(conf_specs);
 
 // Load settings, and override them with any command-line arguments.
 // The arguments registered above are filtered out of the input, and
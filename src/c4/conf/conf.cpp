@@ -3,6 +3,37 @@
 #include <c4/memory_resource.hpp>
 #include <c4/fs/fs.hpp>
 #include <c4/format.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <new>
+#include <thread>
+
+#if defined(C4_POSIX)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define C4CONF_HAVE_MMAP
+#define C4CONF_HAVE_DIRENT
+#if defined(_DIRENT_HAVE_D_TYPE) || defined(__APPLE__) || defined(__FreeBSD__)
+#define C4CONF_HAVE_D_TYPE
+#endif
+#endif
+
+#if defined(__linux__)
+#include <sys/inotify.h>
+#define C4CONF_HAVE_INOTIFY
+#endif
+
+#if defined(__cpp_exceptions) || defined(__EXCEPTIONS) || defined(_CPPUNWIND)
+#define C4CONF_HAVE_EXCEPTIONS
+#endif
 
 C4_SUPPRESS_WARNING_GCC_CLANG_PUSH
 C4_SUPPRESS_WARNING_GCC_CLANG("-Wold-style-cast")
@@ -55,36 +86,542 @@ struct maybe_path_eq_yml : public path_eq_yml
     }
 };
 
-csubstr _get_leaf_key(csubstr path) noexcept
+constexpr const uint64_t fnv1a_basis = 14695981039346656037ull;
+uint64_t fnv1a(uint64_t hash, const void *data, size_t len) noexcept
+{
+    const unsigned char *C4_RESTRICT bytes = (const unsigned char*)data;
+    for(size_t i = 0; i < len; ++i)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+/** a private, writeable memory mapping of a file. Writes go to
+ * copy-on-write pages, so the file is never modified, but the
+ * contents can still be parsed in place. */
+struct MappedFile
+{
+    substr contents;
+    MappedFile() : contents() {}
+    MappedFile(const char *filename) : contents() { map(filename); }
+    bool map(const char *filename)
+    {
+        #ifdef C4CONF_HAVE_MMAP
+        C4_ASSERT(!contents.str);
+        int fd = ::open(filename, O_RDONLY);
+        if(fd < 0)
+            return false;
+        struct stat st;
+        if(::fstat(fd, &st) == 0 && st.st_size > 0)
+        {
+            size_t sz = (size_t)st.st_size;
+            void *mem = ::mmap(nullptr, sz, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+            if(mem != MAP_FAILED)
+                contents = {(char*)mem, sz};
+        }
+        ::close(fd);
+        #else
+        C4_UNUSED(filename);
+        #endif
+        return valid();
+    }
+    ~MappedFile()
+    {
+        #ifdef C4CONF_HAVE_MMAP
+        if(contents.str)
+            ::munmap(contents.str, contents.len);
+        #endif
+    }
+    MappedFile(MappedFile const&) = delete;
+    MappedFile& operator= (MappedFile const&) = delete;
+    bool valid() const { return contents.str != nullptr; }
+};
+
+/** a scratch array, allocated with the given tree callbacks */
+template<class T>
+struct ScopedArray
+{
+    yml::Callbacks m_cb;
+    T *m_buf;
+    size_t m_size;
+    ScopedArray(yml::Callbacks const& cb, size_t sz)
+        : m_cb(cb)
+        , m_buf(sz ? (T*) cb.m_allocate(sizeof(T) * sz, nullptr, cb.m_user_data) : nullptr)
+        , m_size(sz)
+    {
+        for(size_t i = 0; i < m_size; ++i)
+            new (m_buf + i) T();
+    }
+    ~ScopedArray()
+    {
+        for(size_t i = 0; i < m_size; ++i)
+            m_buf[i].~T();
+        if(m_buf)
+            m_cb.m_free(m_buf, sizeof(T) * m_size, m_cb.m_user_data);
+    }
+    ScopedArray(ScopedArray const&) = delete;
+    ScopedArray& operator= (ScopedArray const&) = delete;
+    T& operator[] (size_t i) { C4_ASSERT(i < m_size); return m_buf[i]; }
+};
+
+/** joins the threads when leaving the scope, also when it is left
+ * by an exception: destroying a joinable thread terminates */
+struct JoinGuard
+{
+    ScopedArray<std::thread> *threads;
+    ~JoinGuard()
+    {
+        for(size_t i = 0; i < threads->m_size; ++i)
+            if((*threads)[i].joinable())
+                (*threads)[i].join();
+    }
+};
+
+/** keeps the first exception thrown by a job running in several
+ * threads, to be rethrown in the calling thread after joining them */
+struct FirstError
+{
+    #ifdef C4CONF_HAVE_EXCEPTIONS
+    std::exception_ptr m_error;
+    std::atomic<bool> m_failed{false};
+    #endif
+    template<class Fn>
+    void run(Fn &&fn)
+    {
+        #ifdef C4CONF_HAVE_EXCEPTIONS
+        try
+        {
+            fn();
+        }
+        catch(...)
+        {
+            bool expected = false;
+            if(m_failed.compare_exchange_strong(expected, true))
+                m_error = std::current_exception();
+        }
+        #else
+        fn();
+        #endif
+    }
+    /** whether a job failed, so the others can stop early */
+    bool failed() const
+    {
+        #ifdef C4CONF_HAVE_EXCEPTIONS
+        return m_failed.load(std::memory_order_relaxed);
+        #else
+        return false;
+        #endif
+    }
+    void rethrow()
+    {
+        #ifdef C4CONF_HAVE_EXCEPTIONS
+        if(m_error)
+            std::rethrow_exception(m_error);
+        #endif
+    }
+};
+
+uint64_t hash_str(uint64_t hash, csubstr s) noexcept
+{
+    const uint64_t len = s.len;
+    hash = fnv1a(hash, &len, sizeof(len));
+    return fnv1a(hash, s.str, s.len);
+}
+
+/** hash the state of a file: its size, modification time, inode and
+ * device. Where stat() is not available, hash its contents instead. */
+uint64_t hash_file_state(uint64_t hash, const char *filename, yml::Callbacks const& cb)
+{
+    hash = hash_str(hash, to_csubstr(filename));
+    #ifdef C4_POSIX
+    C4_UNUSED(cb);
+    struct stat st;
+    if(::stat(filename, &st) != 0)
+        return hash; // the load will fail anyway
+    #if defined(__linux__)
+    const uint64_t mtime_ns = (uint64_t)st.st_mtim.tv_nsec;
+    #elif defined(__APPLE__)
+    const uint64_t mtime_ns = (uint64_t)st.st_mtimespec.tv_nsec;
+    #else
+    const uint64_t mtime_ns = 0;
+    #endif
+    const uint64_t state[] = {
+        (uint64_t)st.st_size,
+        (uint64_t)st.st_mtime,
+        mtime_ns,
+        (uint64_t)st.st_ino,
+        (uint64_t)st.st_dev,
+    };
+    return fnv1a(hash, state, sizeof(state));
+    #else
+    if(!fs::file_exists(filename))
+        return hash; // the load will fail anyway
+    size_t sz = fs::file_size(filename);
+    ScopedArray<char> contents(cb, sz);
+    sz = fs::file_get_contents(filename, contents.m_buf, sz);
+    return hash_str(hash, csubstr(contents.m_buf, sz));
+    #endif
+}
+
+/** match a name against a glob pattern with `*` and `?` */
+bool glob_match(csubstr pattern, csubstr name) noexcept
+{
+    size_t p = 0, n = 0;
+    size_t star = csubstr::npos, star_n = 0;
+    while(n < name.len)
+    {
+        if(p < pattern.len && (pattern.str[p] == '?' || pattern.str[p] == name.str[n]))
+        {
+            ++p;
+            ++n;
+        }
+        else if(p < pattern.len && pattern.str[p] == '*')
+        {
+            star = p++;
+            star_n = n;
+        }
+        else if(star != csubstr::npos)
+        {
+            // backtrack: let the last star match one more character
+            p = star + 1u;
+            n = ++star_n;
+        }
+        else
+        {
+            return false;
+        }
+    }
+    while(p < pattern.len && pattern.str[p] == '*')
+        ++p;
+    return p == pattern.len;
+}
+
+/** match a name against comma-separated glob patterns */
+bool glob_match_any(csubstr patterns, csubstr name) noexcept
+{
+    for(csubstr pattern : patterns.split(','))
+    {
+        pattern = pattern.trim(' ');
+        if(!pattern.empty() && glob_match(pattern, name))
+            return true;
+    }
+    return false;
+}
+
+uint64_t trace_now() noexcept
+{
+    using namespace std::chrono;
+    return (uint64_t)duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+/** emit the begin and end events of a phase to the workspace's trace
+ * hook. Nothing is done when the hook is not set. */
+struct TraceScope
+{
+    pfn_trace  m_fn;
+    void *     m_data;
+    TracePhase m_phase;
+    csubstr    m_name;
+    TraceScope(Workspace const* ws, TracePhase phase, csubstr name={})
+        : m_fn(ws->m_trace)
+        , m_data(ws->m_trace_data)
+        , m_phase(phase)
+        , m_name(name)
+    {
+        if(m_fn)
+            m_fn(TraceEvent{m_phase, true, trace_now(), m_name}, m_data);
+    }
+    ~TraceScope()
+    {
+        if(m_fn)
+            m_fn(TraceEvent{m_phase, false, trace_now(), m_name}, m_data);
+    }
+    TraceScope(TraceScope const&) = delete;
+    TraceScope& operator= (TraceScope const&) = delete;
+};
+
+/** files with a .json extension are parsed as JSON */
+bool is_json_file(csubstr filename) noexcept
+{
+    return filename.ends_with(".json") || filename.ends_with(".JSON");
+}
+
+/** parse a file in place, using the JSON parser for JSON files: it
+ * is faster than the YAML parser, and stricter. The parser is reused
+ * across calls, so that its buffers are allocated only once. */
+void parse_file_in_place(yml::Parser *parser, csubstr filename, substr contents, yml::Tree *t)
+{
+    if(is_json_file(filename))
+        parser->parse_json_in_place(filename, contents, t);
+    else
+        parser->parse_in_place(filename, contents, t);
+}
+
+/** get the size of a file, or 0 if it does not exist */
+size_t stat_file_size(const char *filename)
+{
+    #ifdef C4_POSIX
+    struct stat st;
+    return ::stat(filename, &st) == 0 ? (size_t)st.st_size : 0u;
+    #else
+    return fs::file_size(filename);
+    #endif
+}
+
+/** write the zero-terminated name of a cache file into the buffer */
+void cache_filename(substr buf, csubstr cache_dir, uint64_t key, csubstr suffix)
+{
+    char hex[16];
+    for(size_t i = 0; i < 16u; ++i)
+        hex[i] = "0123456789abcdef"[(key >> (60u - 4u * i)) & 0xfu];
+    size_t len = c4::cat(buf, cache_dir, '/', csubstr(hex, sizeof(hex)), ".c4conf", suffix);
+    C4_CHECK(len < buf.len);
+    buf.str[len] = '\0';
+}
+} // namespace
+
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+CompiledPath::CompiledPath(yml::Callbacks const& cb)
+    : m_path()
+    , m_segments(nullptr)
+    , m_num_segments(0)
+    , m_capacity(0)
+    , m_callbacks(cb)
+{
+}
+
+CompiledPath::CompiledPath(csubstr path, yml::Callbacks const& cb)
+    : CompiledPath(cb)
+{
+    compile(path);
+}
+
+CompiledPath::~CompiledPath()
+{
+    _free();
+}
+
+CompiledPath::CompiledPath(CompiledPath &&that) noexcept
+    : m_path(that.m_path)
+    , m_segments(that.m_segments)
+    , m_num_segments(that.m_num_segments)
+    , m_capacity(that.m_capacity)
+    , m_callbacks(that.m_callbacks)
+{
+    that.m_segments = nullptr;
+    that.m_num_segments = 0;
+    that.m_capacity = 0;
+}
+
+CompiledPath& CompiledPath::operator= (CompiledPath &&that) noexcept
+{
+    if(&that != this)
+    {
+        _free();
+        m_path = that.m_path;
+        m_segments = that.m_segments;
+        m_num_segments = that.m_num_segments;
+        m_capacity = that.m_capacity;
+        m_callbacks = that.m_callbacks;
+        that.m_segments = nullptr;
+        that.m_num_segments = 0;
+        that.m_capacity = 0;
+    }
+    return *this;
+}
+
+void CompiledPath::_free()
+{
+    if(m_segments)
+        m_callbacks.m_free(m_segments, sizeof(Segment) * m_capacity, m_callbacks.m_user_data);
+    m_segments = nullptr;
+    m_capacity = 0;
+}
+
+namespace {
+/** call @p fn with each segment of the path, in order */
+template<class Fn>
+void for_each_segment(csubstr path, Fn &&fn)
+{
+    size_t pos = 0;
+    while(pos < path.len)
+    {
+        CompiledPath::Segment seg;
+        if(path.str[pos] == '[')
+        {
+            size_t close = path.find(']', pos);
+            C4_CHECK_MSG(close != csubstr::npos, "unterminated index in path: %.*s", (int)path.len, path.str);
+            csubstr idx = path.range(pos + 1u, close).trim(" \t");
+            C4_CHECK_MSG(idx.is_integer() && c4::atou(idx, &seg.index), "bad index in path: %.*s", (int)path.len, path.str);
+            seg.key = {};
+            seg.hash = fnv1a(fnv1a_basis, &seg.index, sizeof(seg.index));
+            pos = close + 1u;
+        }
+        else
+        {
+            size_t end = path.first_of(".[", pos);
+            if(end == csubstr::npos)
+                end = path.len;
+            seg.key = path.range(pos, end);
+            C4_CHECK_MSG(!seg.key.empty(), "empty key in path: %.*s", (int)path.len, path.str);
+            seg.index = yml::NONE;
+            seg.hash = fnv1a(fnv1a_basis, seg.key.str, seg.key.len);
+            pos = end;
+        }
+        fn(seg);
+        if(pos < path.len && path.str[pos] == '.')
+            ++pos;
+    }
+}
+} // namespace
+
+void CompiledPath::compile(csubstr path)
 {
-    size_t dot_pos = path.last_of('.');
-    return dot_pos == csubstr::npos ? path : path.right_of(dot_pos);
+    path = path.trimr(" \t");
+    m_path = path;
+    m_num_segments = 0;
+    // each segment needs at least one character and a separator
+    const size_t max_segments = path.count('.') + path.count('[') + 1u;
+    if(max_segments > m_capacity)
+    {
+        _free();
+        m_segments = (Segment*) m_callbacks.m_allocate(sizeof(Segment) * max_segments, nullptr, m_callbacks.m_user_data);
+        m_capacity = max_segments;
+    }
+    for_each_segment(path, [this](Segment const& seg){
+        C4_ASSERT(m_num_segments < m_capacity);
+        m_segments[m_num_segments++] = seg;
+    });
 }
-csubstr _get_root_key(csubstr path) noexcept
+
+namespace {
+size_t find_segment(Tree const& t, size_t node, CompiledPath::Segment const& seg)
 {
-    size_t dot_pos = path.first_of('.');
-    return dot_pos == csubstr::npos ? path : path.left_of(dot_pos);
+    if(seg.is_index())
+        return t.is_container(node) ? t.child(node, seg.index) : yml::NONE;
+    if(t.is_map(node))
+    {
+        for(size_t ch = t.first_child(node); ch != yml::NONE; ch = t.next_sibling(ch))
+        {
+            csubstr key = t.key(ch);
+            if(key.len == seg.key.len && key == seg.key)
+                return ch;
+        }
+    }
+    else if(t.is_seq(node))
+    {
+        // as in Tree::lookup_path(), eg seq.1 is the same as seq[1]
+        size_t index;
+        if(seg.key.is_integer() && c4::atou(seg.key, &index))
+            return t.child(node, index);
+    }
+    return yml::NONE;
 }
 } // namespace
 
+size_t CompiledPath::lookup(Tree const& t, size_t start) const
+{
+    if(start == yml::NONE)
+    {
+        if(!t.size())
+            return yml::NONE;
+        start = t.root_id();
+    }
+    size_t node = start;
+    for(size_t i = 0; i < m_num_segments && node != yml::NONE; ++i)
+        node = find_segment(t, node, m_segments[i]);
+    return node;
+}
+
+size_t CompiledPath::lookup_or_modify(Tree *t, size_t start) const
+{
+    size_t node = start != yml::NONE ? start : t->root_id();
+    for(size_t i = 0; i < m_num_segments; ++i)
+    {
+        Segment const& seg = m_segments[i];
+        size_t ch = find_segment(*t, node, seg);
+        if(ch != yml::NONE)
+        {
+            node = ch;
+            continue;
+        }
+        size_t index = seg.index;
+        if(!seg.is_index() && t->is_seq(node) && seg.key.is_integer())
+            C4_CHECK(c4::atou(seg.key, &index));
+        if(index != yml::NONE)
+        {
+            if(!t->is_container(node))
+                t->has_key(node) ? t->to_seq(node, t->key(node)) : t->to_seq(node);
+            C4_CHECK_MSG(t->is_seq(node), "cannot index a map in path: %.*s", (int)m_path.len, m_path.str);
+            // create the missing entries up to the index
+            for(size_t n = t->num_children(node); n < index; ++n)
+                t->to_val(t->append_child(node), csubstr{});
+            ch = t->append_child(node);
+        }
+        else
+        {
+            if(!t->is_container(node))
+                t->has_key(node) ? t->to_map(node, t->key(node)) : t->to_map(node);
+            C4_CHECK_MSG(t->is_map(node), "cannot use a key in a seq in path: %.*s", (int)m_path.len, m_path.str);
+            ch = t->append_child(node);
+            t->_p(ch)->m_key.scalar = seg.key;
+            t->_add_flags(ch, yml::KEY);
+        }
+        node = ch;
+    }
+    return node;
+}
+
 
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
 
-Workspace::Workspace(yml::Tree *output, yml::Tree *t)
+Workspace::Workspace(yml::Tree *output, yml::Tree *t, uint32_t flags)
     : m_wsbuf(output->callbacks())
     , m_ws(t ? t : &m_wsbuf)
     , m_output(output)
+    , m_parser(output->callbacks())
     , m_load_started(false)
     , m_arena_when_load_started()
+    , m_nodes_estimate(0)
+    , m_arena_estimate(0)
+    , m_ws_nodes_estimate(0)
+    , m_flags(flags)
+    , m_path(output->callbacks())
+    , m_borrowed()
     , m_dir_scratch()
     , m_dir_entry_list()
+    , m_dir_include()
+    , m_dir_exclude()
+    , m_num_threads(0)
+    , m_layer_trees(nullptr)
+    , m_num_layer_trees(0)
+    , m_cache_dir(nullptr)
+    , m_cache_hit(false)
+    , m_inputs_changed(false)
+    , m_trace(nullptr)
+    , m_trace_data(nullptr)
 {
 }
 
 Workspace::~Workspace()
 {
+    _reserve_layer_trees(0);
+    _release(&m_pending);
+    _release(&m_merge_srcs);
+    _release(&m_merge_table);
+    _release(&m_manifests);
+    _release(&m_manifest_files);
+    _release(&m_manifest_names);
+    _release(&m_dir_path);
+    _release(&m_dir_ancestors);
     _release(&m_dir_entry_list.names);
     _release(&m_dir_entry_list.arena);
     _release(&m_dir_scratch);
@@ -95,7 +632,15 @@ void Workspace::_load_started()
     const bool is_first_load = !m_load_started;
     m_load_started = true;
     if(is_first_load)
+    {
         m_arena_when_load_started = m_output->arena();
+        // reserve all the nodes estimated in the prepare phase, so
+        // that the trees do not need to grow during the load
+        if(m_nodes_estimate)
+            m_output->reserve(m_output->size() + m_nodes_estimate);
+        if(m_ws_nodes_estimate > m_ws->capacity())
+            m_ws->reserve(m_ws_nodes_estimate);
+    }
     else
         C4_CHECK(m_arena_when_load_started.str == m_output->arena().str);
 }
@@ -109,365 +654,2823 @@ substr Workspace::_alloc_arena(size_t sz) const
     return ret;
 }
 
-void Workspace::_reserve_arena(size_t sz) const
+void Workspace::_reserve_arena(size_t sz)
+{
+    // reserve relative to the size, not to the capacity, so that the
+    // capacity left over in a reused output tree is not wasted
+    m_arena_estimate += sz;
+    size_t arena_req = m_output->arena_size() + m_arena_estimate;
+    _dbg("reserving arena: " << sz << "B: " << m_output->arena_capacity() << "B-->" << arena_req << "B");
+    m_output->reserve_arena(arena_req);
+}
+
+size_t Workspace::_get_manifest(const char *dirname, bool recursive)
+{
+    csubstr name = to_csubstr(dirname);
+    for(size_t i = 0; i < m_manifests.required_size; ++i)
+        if(m_manifests.buf[i].recursive == recursive && to_csubstr(_manifest_name(m_manifests.buf[i].dirname)) == name)
+            return i;
+    return _make_manifest(dirname, recursive);
+}
+
+size_t Workspace::_make_manifest(const char *dirname, bool recursive)
+{
+    _dbg("listing directory: " << dirname << (recursive ? " (recursive)" : ""));
+    DirManifest manifest;
+    manifest.dirname = _add_manifest_name(to_csubstr(dirname));
+    manifest.first_file = m_manifest_files.required_size;
+    manifest.recursive = recursive;
+    // list the files passing the filters. Nothing is stat'ed here,
+    // except where the listing does not give the type of an entry.
+    const char nul = '\0';
+    csubstr path = to_csubstr(dirname);
+    m_dir_path.required_size = 0;
+    _append(&m_dir_path, path.str, path.len);
+    _append(&m_dir_path, &nul, 1u);
+    {
+        TraceScope trace(this, TracePhase::list, path);
+        _list_files(recursive);
+        manifest.num_files = m_manifest_files.required_size - manifest.first_file;
+        // sort by path
+        DirManifestFile *files = m_manifest_files.buf + manifest.first_file;
+        std::sort(files, files + manifest.num_files, [this](DirManifestFile const& a, DirManifestFile const& b){
+            return strcmp(_manifest_name(a.name), _manifest_name(b.name)) < 0;
+        });
+    }
+    // now get the file sizes
+    {
+        TraceScope trace(this, TracePhase::stat, path);
+        _stat_files(manifest.first_file, manifest.num_files);
+    }
+    _append(&m_manifests, &manifest, 1u);
+    return m_manifests.required_size - 1u;
+}
+
+void Workspace::_list_files(bool recursive)
+{
+    // m_dir_path has the zero-terminated name of the directory
+    C4_ASSERT(m_dir_path.required_size > 0 && m_dir_path.buf[m_dir_path.required_size - 1u] == '\0');
+    const size_t dirlen = m_dir_path.required_size - 1u;
+    const char nul = '\0';
+    #ifdef C4CONF_HAVE_DIRENT
+    DIR *dir = ::opendir(m_dir_path.buf);
+    C4_CHECK_MSG(dir != nullptr, "could not open directory: %s", m_dir_path.buf);
+    const size_t num_ancestors = m_dir_ancestors.required_size;
+    if(recursive)
+    {
+        // symlinks to directories are followed, so skip a directory
+        // which is already being listed: it is reached through a loop
+        struct stat st;
+        C4_CHECK(::fstat(::dirfd(dir), &st) == 0);
+        const DirId id = {(uint64_t)st.st_dev, (uint64_t)st.st_ino};
+        for(size_t i = 0; i < num_ancestors; ++i)
+        {
+            if(m_dir_ancestors.buf[i].dev == id.dev && m_dir_ancestors.buf[i].ino == id.ino)
+            {
+                _dbg("skipping directory symlink loop: " << m_dir_path.buf);
+                ::closedir(dir);
+                return;
+            }
+        }
+        _append(&m_dir_ancestors, &id, 1u);
+    }
+    const char sep = '/';
+    while(struct dirent const* entry = ::readdir(dir))
+    {
+        const csubstr name = to_csubstr(entry->d_name);
+        if(name == "." || name == ".." || glob_match_any(m_dir_exclude, name))
+            continue;
+        m_dir_path.required_size = dirlen;
+        _append(&m_dir_path, &sep, 1u);
+        _append(&m_dir_path, name.str, name.len);
+        _append(&m_dir_path, &nul, 1u);
+        bool is_dir = false, is_file = false;
+        #ifdef C4CONF_HAVE_D_TYPE
+        is_dir = entry->d_type == DT_DIR;
+        is_file = entry->d_type == DT_REG;
+        if(entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK)
+        #endif
+        {
+            // the type is not known from the listing
+            struct stat st;
+            if(::stat(m_dir_path.buf, &st) == 0)
+            {
+                is_dir = S_ISDIR(st.st_mode);
+                is_file = S_ISREG(st.st_mode);
+            }
+        }
+        if(is_dir)
+        {
+            if(recursive)
+                _list_files(recursive);
+        }
+        else if(is_file && (m_dir_include.empty() || glob_match_any(m_dir_include, name)))
+        {
+            _add_manifest_file(csubstr(m_dir_path.buf, m_dir_path.required_size - 1u));
+        }
+    }
+    ::closedir(dir);
+    m_dir_ancestors.required_size = num_ancestors;
+    #else
+    // ensure the scratch and the entry list have enough space for
+    // all the existing filenames in the dir
+    if(m_dir_scratch.required_size < 256)
+        m_dir_scratch.required_size = 256;
+    bool ok;
+    do
+    {
+        _ensure(&m_dir_scratch);
+        ok = c4::fs::list_entries(m_dir_path.buf, &m_dir_entry_list, &m_dir_scratch);
+    } while(!m_dir_scratch.valid());
+    C4_CHECK(m_dir_scratch.valid());
+    if(!ok)
+    {
+        _ensure(&m_dir_entry_list.names);
+        _ensure(&m_dir_entry_list.arena);
+        ok = c4::fs::list_entries(m_dir_path.buf, &m_dir_entry_list, &m_dir_scratch);
+    }
+    C4_CHECK(ok);
+    C4_CHECK(m_dir_entry_list.valid());
+    // the entry list is reused when recursing, so first keep the
+    // subdirectories after the name of this directory
+    for(const char *entry : m_dir_entry_list)
+    {
+        const csubstr path = to_csubstr(entry);
+        const csubstr name = path.basename('/').basename('\\');
+        if(name == "." || name == ".." || glob_match_any(m_dir_exclude, name))
+            continue;
+        if(fs::is_dir(entry))
+        {
+            if(recursive)
+            {
+                _append(&m_dir_path, path.str, path.len);
+                _append(&m_dir_path, &nul, 1u);
+            }
+        }
+        else if(m_dir_include.empty() || glob_match_any(m_dir_include, name))
+        {
+            _add_manifest_file(path);
+        }
+    }
+    const size_t subdirs_end = m_dir_path.required_size;
+    for(size_t pos = dirlen + 1u; pos < subdirs_end; )
+    {
+        // copy the subdirectory name to the end, where it is the
+        // current directory for the recursive call
+        const size_t len = strlen(m_dir_path.buf + pos);
+        m_dir_path.required_size = subdirs_end;
+        _append(&m_dir_path, (const char*)nullptr, len + 1u);
+        memcpy(m_dir_path.buf + subdirs_end, m_dir_path.buf + pos, len + 1u);
+        _list_files(recursive);
+        pos += len + 1u;
+    }
+    #endif
+    m_dir_path.required_size = dirlen;
+    _append(&m_dir_path, &nul, 1u);
+}
+
+void Workspace::_add_manifest_file(csubstr filename)
+{
+    DirManifestFile file;
+    file.name = _add_manifest_name(filename);
+    file.size = 0;
+    _append(&m_manifest_files, &file, 1u);
+}
+
+void Workspace::_stat_files(size_t first_file, size_t num_files)
+{
+    DirManifestFile *files = m_manifest_files.buf + first_file;
+    std::atomic<size_t> next_file(0);
+    FirstError error;
+    auto stat_files = [&]{
+        error.run([&]{
+            for(size_t i = next_file++; i < num_files && !error.failed(); i = next_file++)
+                files[i].size = stat_file_size(_manifest_name(files[i].name));
+        });
+    };
+    // stat() is I/O bound: use several threads when there are many
+    // files, but not less than a minimum of files per thread
+    constexpr const size_t min_files_per_thread = 64u;
+    size_t num_threads = m_num_threads ? m_num_threads : (size_t)std::thread::hardware_concurrency();
+    if(num_threads > num_files / min_files_per_thread)
+        num_threads = num_files / min_files_per_thread;
+    {
+        // the calling thread is also used
+        ScopedArray<std::thread> threads(m_output->callbacks(), num_threads > 1u ? num_threads - 1u : 0u);
+        JoinGuard join{&threads};
+        for(size_t i = 0; i < threads.m_size; ++i)
+            threads[i] = std::thread(stat_files);
+        stat_files();
+    }
+    error.rethrow();
+}
+
+size_t Workspace::_add_manifest_name(csubstr name)
+{
+    size_t pos = m_manifest_names.required_size;
+    const char nul = '\0';
+    _append(&m_manifest_names, name.str, name.len);
+    _append(&m_manifest_names, &nul, 1u);
+    return pos;
+}
+
+void Workspace::_reserve_nodes(csubstr tree_path, size_t num_nodes)
+{
+    // +1 for the key added by _askeyx()
+    if(num_nodes + 1u > m_ws_nodes_estimate)
+        m_ws_nodes_estimate = num_nodes + 1u;
+    // nodes in the path may also need to be created
+    m_nodes_estimate += num_nodes + 1u + tree_path.count('.') + tree_path.count('[');
+}
+
+void Workspace::prepare_add_dir(csubstr tree_path, const char *dirname)
+{
+    if(tree_path.not_empty()) { _dbg("preparing add directory: " << tree_path << "=" << dirname); }
+    else { _dbg("preparing add directory to root: " << dirname); }
+    _prepare_add_dir(tree_path, dirname, /*recursive*/false);
+}
+
+void Workspace::prepare_add_dir(const char *dirname)
+{
+    prepare_add_dir("", dirname);
+}
+
+void Workspace::prepare_add_dir_recursive(csubstr tree_path, const char *dirname)
+{
+    if(tree_path.not_empty()) { _dbg("preparing add directory recursively: " << tree_path << "=" << dirname); }
+    else { _dbg("preparing add directory recursively to root: " << dirname); }
+    _prepare_add_dir(tree_path, dirname, /*recursive*/true);
+}
+
+void Workspace::prepare_add_dir_recursive(const char *dirname)
+{
+    prepare_add_dir_recursive("", dirname);
+}
+
+void Workspace::_prepare_add_dir(csubstr tree_path, const char *dirname, bool recursive)
+{
+    C4_CHECK(!m_load_started);
+    // list the directory once; add_dir() will reuse the listing
+    DirManifest manifest = m_manifests.buf[_get_manifest(dirname, recursive)];
+    for(size_t i = 0; i < manifest.num_files; ++i)
+    {
+        DirManifestFile const& file = m_manifest_files.buf[manifest.first_file + i];
+        _prepare_add_file(tree_path, _manifest_name(file.name), file.size);
+    }
+    // accomodate also the directory name
+    _reserve_arena(tree_path.len + 2u + strlen(dirname));
+}
+
+void Workspace::prepare_add_file(csubstr tree_path, const char *filename)
+{
+    if(tree_path.not_empty()) { _dbg("preparing add file: " << tree_path << "=" << filename); }
+    else { _dbg("preparing add file to root: " << filename); }
+    size_t filesz;
+    {
+        TraceScope trace(this, TracePhase::stat, to_csubstr(filename));
+        filesz = fs::file_size(filename);
+    }
+    _prepare_add_file(tree_path, filename, filesz);
+}
+
+void Workspace::_prepare_add_file(csubstr tree_path, const char *filename, size_t filesz)
+{
+    C4_CHECK(!m_load_started);
+    _reserve_arena(tree_path.len + 2u + strlen(filename) + 2u + filesz);
+    // the estimate from the size alone may be too low, so scan the
+    // contents, which are needed for the load anyway. Scanning
+    // through a mapping does not copy the file, and leaves it in the
+    // page cache for when it is loaded.
+    MappedFile mapped(filename);
+    if(mapped.valid())
+    {
+        _reserve_nodes(tree_path, estimate_num_nodes(mapped.contents));
+    }
+    else if(filesz)
+    {
+        // no mmap: read into a scratch buffer
+        ScopedArray<char> buf(m_output->callbacks(), filesz);
+        const size_t sz = fs::file_get_contents(filename, buf.m_buf, filesz);
+        _reserve_nodes(tree_path, estimate_num_nodes(csubstr(buf.m_buf, sz < filesz ? sz : filesz)));
+    }
+    else
+    {
+        _reserve_nodes(tree_path, 1u);
+    }
+}
+
+void Workspace::prepare_add_file(const char *filename)
+{
+    prepare_add_file("", filename);
+}
+
+void Workspace::prepare_add_conf(csubstr tree_path, csubstr conf_yml)
+{
+    C4_CHECK(!m_load_started);
+    _reserve_arena(tree_path.len + 2u + conf_yml.len);
+    _reserve_nodes(tree_path, estimate_num_nodes(conf_yml));
+}
+
+void Workspace::prepare_add_conf(CompiledPath const& tree_path, csubstr conf_yml)
+{
+    prepare_add_conf(tree_path.path(), conf_yml);
+}
+
+void Workspace::prepare_add_conf(csubstr tree_path_eq_conf_yml)
+{
+    auto specs = path_eq_yml(tree_path_eq_conf_yml);
+    prepare_add_conf(specs.tree_path, specs.yml);
+}
+
+void Workspace::_parse_yml(csubstr filename, substr yml, yml::Tree *t)
+{
+    // ensure the conf yml is already in the destination tree, or
+    // will be copied there after merging
+    C4_CHECK(yml.is_sub(m_output->arena()) || yml.is_sub(m_borrowed));
+    C4_CHECK(!yml.is_sub(t->arena()));
+    t->clear(); // does not clear the arena
+    t->clear_arena();
+    TraceScope trace(this, TracePhase::parse, filename);
+    parse_file_in_place(&m_parser, filename, yml, t);
+}
+
+void Workspace::_parse_yml(csubstr filename, csubstr yml, yml::Tree *t)
+{
+    if(yml.is_sub(m_output->arena()))
+    {
+        substr arena = m_output->arena();
+        size_t pos = (size_t)(yml.str - arena.str);
+        substr yml_copy = arena.sub(pos, yml.len);
+        C4_ASSERT(yml_copy.str == yml.str);
+        C4_ASSERT(yml_copy.len == yml.len);
+        _parse_yml(filename, yml_copy, t);
+    }
+    else
+    {
+        substr yml_copy = _alloc_arena(yml.len);
+        size_t used = c4::cat(yml_copy, yml);
+        C4_CHECK(used == yml.len);
+        _parse_yml(filename, yml_copy, t);
+    }
+}
+
+namespace {
+/** the documents of a tree are merged in order, as successive
+ * inputs. A stream has one per child, skipping the empty ones, and
+ * any other tree has only its root. */
+size_t skip_empty_docs(yml::Tree const* t, size_t doc)
+{
+    while(doc != yml::NONE && !t->has_val(doc) && !t->has_children(doc))
+        doc = t->next_sibling(doc);
+    return doc;
+}
+size_t first_doc(yml::Tree const* t)
+{
+    const size_t root = t->root_id();
+    return t->is_stream(root) ? skip_empty_docs(t, t->first_child(root)) : root;
+}
+size_t next_doc(yml::Tree const* t, size_t doc)
+{
+    return t->is_root(doc) ? yml::NONE : skip_empty_docs(t, t->next_sibling(doc));
+}
+} // namespace
+
+// ensure the doc node is not a doc
+void Workspace::_remdoc(yml::Tree *t, size_t doc)
+{
+    C4_CHECK(!t->is_stream(doc));
+    t->_rem_flags(doc, c4::yml::DOC);
+}
+
+// ensure the doc node has a key
+void Workspace::_askeyx(yml::Tree *t, size_t doc, csubstr key)
+{
+    C4_CHECK(!t->has_key(doc));
+    C4_CHECK(t->is_val(doc) || t->has_children(doc));
+    C4_CHECK(t->is_root(doc) || t->is_stream(t->parent(doc)));
+    yml::NodeData saved = *t->_p(doc);
+    if(saved.m_type.is_doc())
+        if(saved.m_type.is_val())
+            saved.m_type = saved.m_type & ~yml::DOC;
+    // this may reallocate the nodes, so get the pointers only after it
+    size_t newid = t->append_child(doc);
+    yml::NodeData *C4_RESTRICT old_data = t->_p(doc);
+    yml::NodeData *C4_RESTRICT new_data = t->_p(newid);
+    *new_data = saved;
+    new_data->m_type = new_data->m_type | yml::KEY;
+    new_data->m_key.scalar = key;
+    new_data->m_parent = doc;
+    new_data->m_prev_sibling = yml::NONE;
+    new_data->m_next_sibling = yml::NONE;
+    old_data->m_type = yml::MAP;
+    old_data->m_first_child = newid;
+    old_data->m_last_child = newid;
+    if(saved.m_last_child != yml::NONE)
+        t->_p(saved.m_last_child)->m_next_sibling = yml::NONE;
+    for(size_t ch = t->first_child(newid); ch != yml::NONE; ch = t->next_sibling(ch))
+    {
+        C4_ASSERT(t->_p(ch)->m_parent == doc);
+        t->_p(ch)->m_parent = newid;
+    }
+}
+
+template<class CharType>
+size_t Workspace::_add_conf(csubstr filename, csubstr dst_path, basic_substring<CharType> conf_yml)
+{
+    m_path.compile(dst_path);
+    return _add_conf(filename, m_path, conf_yml);
+}
+
+template<class CharType>
+size_t Workspace::_add_conf(csubstr filename, CompiledPath const& dst_path, basic_substring<CharType> conf_yml)
+{
+    if(m_flags & WS_DEFERRED_MERGE)
+    {
+        yml::Tree *t = _push_layer(dst_path.path());
+        t->reserve(estimate_num_nodes(conf_yml) + 1u);
+        _parse_yml(filename, conf_yml, t);
+        return yml::NONE;
+    }
+    _parse_yml(filename, conf_yml, m_ws);
+    return _merge(m_ws, dst_path);
+}
+
+size_t Workspace::_merge(yml::Tree *src, CompiledPath const& dst_path)
+{
+    _dbg("dst_tree"); _pr(*m_output);
+    _dbg("src_tree"); _pr(*src);
+    size_t target;
+    if(dst_path.empty())
+    {
+        _dbg("merging at root");
+        target = m_output->root_id();
+        TraceScope trace(this, TracePhase::merge);
+        for(size_t doc = first_doc(src); doc != yml::NONE; doc = next_doc(src, doc))
+        {
+            m_output->merge_with(src, doc, target);
+            if(m_borrowed.str)
+                _unborrow(src, doc, target);
+        }
+    }
+    else
+    {
+        // resolve the path, creating any missing nodes, in a single
+        // traversal. We only have the value of the conf; if the
+        // target node has a key, we need to make the conf look like
+        // it (eg, foo.bar.baz implies the key must be baz)
+        _dbg("dst_path=" << dst_path.path());
+        {
+            TraceScope trace(this, TracePhase::lookup, dst_path.path());
+            target = dst_path.lookup_or_modify(m_output);
+        }
+        TraceScope trace(this, TracePhase::merge, dst_path.path());
+        for(size_t doc = first_doc(src); doc != yml::NONE; doc = next_doc(src, doc))
+        {
+            size_t conf_node = _merge_src_node(src, doc, dst_path, target);
+            _dbg("conf=" << conf_node << "(" << src->type_str(conf_node) << ")");
+            m_output->merge_with(src, conf_node, target);
+            if(m_borrowed.str)
+                _unborrow(src, conf_node, target);
+        }
+    }
+    _dbg("outputtree=\n" << *m_output);_pr(*m_output);
+    return target;
+}
+
+void Workspace::_add_conf_borrowed(csubstr filename, csubstr dst_path, substr conf_yml)
+{
+    C4_ASSERT(!(m_flags & WS_DEFERRED_MERGE));
+    // any borrowed strings surviving the merge are copied by _merge()
+    m_borrowed = conf_yml;
+    _add_conf(filename, dst_path, conf_yml);
+    m_borrowed = {};
+}
+
+yml::Tree* Workspace::_push_layer(csubstr dst_path)
+{
+    const size_t pos = m_pending.required_size;
+    if(pos >= m_num_layer_trees)
+        _reserve_layer_trees(pos < 4u ? 4u : 2u * pos);
+    _append(&m_pending, &dst_path, 1u);
+    return &m_layer_trees[pos];
+}
+
+void Workspace::merge_pending()
+{
+    const size_t num_pending = m_pending.required_size;
+    size_t i = 0;
+    while(i < num_pending)
+    {
+        const csubstr dst_path = m_pending.buf[i];
+        m_path.compile(dst_path);
+        size_t target;
+        {
+            TraceScope trace(this, TracePhase::lookup, dst_path);
+            target = m_path.lookup(*m_output);
+        }
+        if(target == yml::NONE)
+        {
+            // the path must be created: merge this one alone
+            _merge(&m_layer_trees[i], m_path);
+            ++i;
+            continue;
+        }
+        // merge together all the following inputs with the same
+        // destination
+        const size_t first_src = m_merge_srcs.required_size;
+        size_t j = i;
+        for( ; j < num_pending && m_pending.buf[j] == dst_path; ++j)
+        {
+            yml::Tree *src = &m_layer_trees[j];
+            for(size_t doc = first_doc(src); doc != yml::NONE; doc = next_doc(src, doc))
+            {
+                MergeSrc ms = {src, _merge_src_node(src, doc, m_path, target), yml::NONE, yml::NONE, false};
+                _append(&m_merge_srcs, &ms, 1u);
+            }
+        }
+        _dbg("merging " << (j - i) << " pending inputs at " << dst_path);
+        if(m_merge_srcs.required_size > first_src)
+        {
+            TraceScope trace(this, TracePhase::merge, dst_path);
+            _merge_kway(first_src, m_merge_srcs.required_size - first_src, target);
+        }
+        m_merge_srcs.required_size = first_src;
+        i = j;
+    }
+    m_pending.required_size = 0;
+}
+
+/** prepare the source tree to be merged into the target node of the
+ * path, and get the source node to merge */
+size_t Workspace::_merge_src_node(yml::Tree *src, size_t doc, CompiledPath const& dst_path, size_t target)
+{
+    if(dst_path.empty())
+        return doc;
+    if(!m_output->has_key(target))
+    {
+        // no key is needed
+        _remdoc(src, doc);
+        return doc;
+    }
+    // ensure the conf has the leaf key of the path
+    C4_CHECK(!dst_path.back().is_index());
+    _askeyx(src, doc, dst_path.back().key);
+    _remdoc(src, doc);
+    return src->first_child(doc);
+}
+
+namespace {
+yml::NodeType_e merge_kind(yml::Tree const* t, size_t node)
+{
+    if(t->has_val(node))
+        return yml::VAL;
+    else if(t->is_seq(node))
+        return yml::SEQ;
+    else if(t->is_map(node))
+        return yml::MAP;
+    C4_ERROR("cannot merge different node types");
+    return yml::NOTYPE;
+}
+} // namespace
+
+/** merge several source nodes into the destination node, with the
+ * same result as merging them one after the other with
+ * Tree::merge_with(), but writing each output node only once */
+void Workspace::_merge_kway(size_t first_src, size_t num_srcs, size_t dst)
+{
+    C4_ASSERT(num_srcs > 0);
+    yml::Tree *C4_RESTRICT out = m_output;
+    MergeSrc last = m_merge_srcs.buf[first_src + num_srcs - 1u];
+    const yml::NodeType_e kind = merge_kind(last.tree, last.node);
+    if(num_srcs == 1u || kind == yml::VAL)
+    {
+        // a val overwrites everything before it
+        out->merge_with(last.tree, last.node, dst);
+        return;
+    }
+    // a container resets anything of a different kind before it,
+    // so only the last run of sources of the same kind matters
+    size_t run = num_srcs - 1u;
+    while(run > 0 && merge_kind(m_merge_srcs.buf[first_src + run - 1u].tree, m_merge_srcs.buf[first_src + run - 1u].node) == kind)
+        --run;
+    const bool keep_dst = run == 0 && (kind == yml::SEQ ? out->is_seq(dst) : out->is_map(dst));
+    if(!keep_dst)
+    {
+        MergeSrc reset = m_merge_srcs.buf[first_src + run];
+        if(out->has_children(dst))
+            out->remove_children(dst);
+        out->_set_flags(dst, yml::NOTYPE);
+        if(reset.tree->has_key(reset.node))
+            kind == yml::SEQ ? out->to_seq(dst, reset.tree->key(reset.node)) : out->to_map(dst, reset.tree->key(reset.node));
+        else
+            kind == yml::SEQ ? out->to_seq(dst) : out->to_map(dst);
+    }
+    if(kind == yml::SEQ)
+    {
+        // seqs are concatenated
+        for(size_t i = run; i < num_srcs; ++i)
+            out->merge_with(m_merge_srcs.buf[first_src + i].tree, m_merge_srcs.buf[first_src + i].node, dst);
+        return;
+    }
+    // maps are merged key by key. First gather all the children,
+    // starting with those already in the destination.
+    const size_t base = m_merge_srcs.required_size;
+    if(keep_dst)
+    {
+        for(size_t ch = out->first_child(dst); ch != yml::NONE; ch = out->next_sibling(ch))
+        {
+            MergeSrc ms = {out, ch, yml::NONE, yml::NONE, false};
+            _append(&m_merge_srcs, &ms, 1u);
+        }
+    }
+    const size_t num_dst = m_merge_srcs.required_size - base;
+    for(size_t i = run; i < num_srcs; ++i)
+    {
+        MergeSrc src = m_merge_srcs.buf[first_src + i];
+        for(size_t ch = src.tree->first_child(src.node); ch != yml::NONE; ch = src.tree->next_sibling(ch))
+        {
+            MergeSrc ms = {src.tree, ch, yml::NONE, yml::NONE, false};
+            _append(&m_merge_srcs, &ms, 1u);
+        }
+    }
+    const size_t num_children = m_merge_srcs.required_size - base;
+    // now group the children by key, with an open-addressing table
+    // of (1 + position of the group head)
+    size_t table_size = 16u;
+    while(table_size < 2u * num_children)
+        table_size *= 2u;
+    const size_t table_pos = m_merge_table.required_size;
+    _append(&m_merge_table, (size_t const*)nullptr, table_size);
+    {
+        MergeSrc *C4_RESTRICT children = m_merge_srcs.buf + base;
+        size_t *C4_RESTRICT table = m_merge_table.buf + table_pos;
+        for(size_t i = 0; i < num_children; ++i)
+        {
+            csubstr key = children[i].tree->key(children[i].node);
+            size_t slot = (size_t)fnv1a(fnv1a_basis, key.str, key.len) & (table_size - 1u);
+            for(;;)
+            {
+                if(!table[slot])
+                {
+                    table[slot] = 1u + i;
+                    children[i].head = true;
+                    children[i].last = i;
+                    break;
+                }
+                MergeSrc &head = children[table[slot] - 1u];
+                if(head.tree->key(head.node) == key)
+                {
+                    // like Tree::find_child(), only the first
+                    // destination child with a key is merged into
+                    if(i >= num_dst)
+                    {
+                        children[head.last].next = i;
+                        head.last = i;
+                    }
+                    break;
+                }
+                slot = (slot + 1u) & (table_size - 1u);
+            }
+        }
+    }
+    m_merge_table.required_size = table_pos;
+    // finally merge each group, in the order of its first appearance
+    for(size_t i = 0; i < num_children; ++i)
+    {
+        MergeSrc head = m_merge_srcs.buf[base + i];
+        if(!head.head)
+            continue;
+        size_t dch;
+        size_t src = i;
+        if(i < num_dst)
+        {
+            dch = head.node;
+            src = head.next;
+            if(src == yml::NONE)
+                continue; // not in any source
+        }
+        else
+        {
+            dch = out->append_child(dst);
+            yml::NodeData *C4_RESTRICT d = out->_p(dch);
+            yml::NodeData const* C4_RESTRICT s = head.tree->_p(head.node);
+            d->m_type = s->m_type;
+            d->m_key = s->m_key;
+            d->m_val = s->m_val;
+        }
+        const size_t group = m_merge_srcs.required_size;
+        for( ; src != yml::NONE; src = m_merge_srcs.buf[base + src].next)
+        {
+            MergeSrc ms = m_merge_srcs.buf[base + src];
+            _append(&m_merge_srcs, &ms, 1u);
+        }
+        _merge_kway(group, m_merge_srcs.required_size - group, dch);
+        m_merge_srcs.required_size = group;
+    }
+    m_merge_srcs.required_size = base;
+}
+
+/** copy to the arena the borrowed strings of the output nodes
+ * written when merging the source node into the destination node.
+ * This follows the walk of Tree::merge_with(), so only the nodes
+ * touched by the merge are visited, instead of the whole destination
+ * subtree. */
+void Workspace::_unborrow(yml::Tree const* src, size_t src_node, size_t dst_node)
+{
+    yml::NodeData *C4_RESTRICT d = m_output->_p(dst_node);
+    _unborrow(&d->m_key.scalar);
+    _unborrow(&d->m_key.tag);
+    _unborrow(&d->m_key.anchor);
+    _unborrow(&d->m_val.scalar);
+    _unborrow(&d->m_val.tag);
+    _unborrow(&d->m_val.anchor);
+    if(src->has_val(src_node))
+        return;
+    if(src->is_seq(src_node))
+    {
+        // the children were appended to the destination
+        size_t dch = m_output->last_child(dst_node);
+        for(size_t sch = src->last_child(src_node); sch != yml::NONE; sch = src->prev_sibling(sch), dch = m_output->prev_sibling(dch))
+            _unborrow(src, sch, dch);
+    }
+    else
+    {
+        // each child was merged into the first one with its key
+        for(size_t sch = src->first_child(src_node); sch != yml::NONE; sch = src->next_sibling(sch))
+            _unborrow(src, sch, m_output->find_child(dst_node, src->key(sch)));
+    }
+}
+
+void Workspace::_unborrow(csubstr *s)
+{
+    if(s->str && s->is_sub(m_borrowed))
+    {
+        substr copy = _alloc_arena(s->len);
+        if(s->len)
+            memcpy(copy.str, s->str, s->len);
+        *s = copy;
+    }
+}
+
+void Workspace::_reserve_layer_trees(size_t num_trees)
+{
+    // num_trees=0 releases the trees
+    if(num_trees && num_trees <= m_num_layer_trees)
+        return;
+    yml::Callbacks const& cb = m_output->callbacks();
+    yml::Tree *trees = nullptr;
+    if(num_trees)
+    {
+        trees = (yml::Tree*) cb.m_allocate(sizeof(yml::Tree) * num_trees, m_layer_trees, cb.m_user_data);
+        for(size_t i = 0; i < num_trees; ++i)
+        {
+            if(i < m_num_layer_trees)
+                new (trees + i) yml::Tree(std::move(m_layer_trees[i]));
+            else
+                new (trees + i) yml::Tree(cb);
+        }
+    }
+    for(size_t i = 0; i < m_num_layer_trees; ++i)
+        m_layer_trees[i].~Tree();
+    if(m_layer_trees)
+        cb.m_free(m_layer_trees, sizeof(yml::Tree) * m_num_layer_trees, cb.m_user_data);
+    m_layer_trees = trees;
+    m_num_layer_trees = num_trees;
+}
+
+void Workspace::_add_files_parallel(csubstr tree_path, DirManifest const& manifest)
+{
+    _load_started();
+    yml::Callbacks const& cb = m_output->callbacks();
+    size_t num_files = manifest.num_files;
+    DirManifestFile const* files = m_manifest_files.buf + manifest.first_file;
+    ScopedArray<const char*> filenames(cb, num_files);
+    for(size_t i = 0; i < num_files; ++i)
+        filenames[i] = _manifest_name(files[i].name);
+    const bool deferred = (m_flags & WS_DEFERRED_MERGE) != 0;
+    ScopedArray<MappedFile> mapped(cb, ((m_flags & WS_MMAP_FILES) && !deferred) ? num_files : 0);
+    ScopedArray<substr> contents(cb, num_files);
+    ScopedArray<substr> borrowed(cb, num_files);
+    // first get the contents of every file. This is done serially,
+    // because allocating from the arena is not thread safe. The
+    // manifest already has the type and size of each file, so there
+    // is no need to stat it again. Files which changed since then
+    // are skipped, so the remaining ones are moved to the front.
+    size_t num_loaded = 0;
+    for(size_t i = 0; i < num_files; ++i)
+    {
+        bool is_mapped = false;
+        if(mapped.m_size)
+        {
+            TraceScope trace(this, TracePhase::read, to_csubstr(filenames[i]));
+            is_mapped = mapped[i].map(filenames[i]);
+        }
+        if(is_mapped)
+            contents[num_loaded] = borrowed[num_loaded] = mapped[i].contents;
+        else if(!_read_file(filenames[i], files[i].size, &contents[num_loaded]))
+            continue;
+        filenames[num_loaded++] = filenames[i];
+    }
+    num_files = num_loaded;
+    // now parse each file into its own tree, after the pending ones
+    const size_t first_tree = m_pending.required_size;
+    _reserve_layer_trees(first_tree + num_files);
+    std::atomic<size_t> next_file(0);
+    FirstError error;
+    auto parse_files = [&](yml::Parser *parser){
+        for(size_t i = next_file++; i < num_files && !error.failed(); i = next_file++)
+        {
+            yml::Tree *t = &m_layer_trees[first_tree + i];
+            t->clear();
+            t->clear_arena();
+            t->reserve(estimate_num_nodes(contents[i]) + 1u);
+            parse_file_in_place(parser, to_csubstr(filenames[i]), contents[i], t);
+        }
+    };
+    size_t num_threads = m_num_threads ? m_num_threads : (size_t)std::thread::hardware_concurrency();
+    if(num_threads > num_files)
+        num_threads = num_files;
+    {
+        // the files are parsed concurrently, so there is a single
+        // event for all of them
+        TraceScope trace(this, TracePhase::parse, to_csubstr(_manifest_name(manifest.dirname)));
+        // the calling thread is also used, with the workspace's
+        // parser. Each of the other threads uses one parser for all
+        // its files. An error in any thread is reported in the
+        // calling thread, once all of them are joined.
+        ScopedArray<std::thread> threads(cb, num_threads > 1u ? num_threads - 1u : 0u);
+        JoinGuard join{&threads};
+        for(size_t i = 0; i < threads.m_size; ++i)
+            threads[i] = std::thread([&]{
+                error.run([&]{
+                    yml::Parser parser(cb);
+                    parse_files(&parser);
+                });
+            });
+        error.run([&]{ parse_files(&m_parser); });
+    }
+    error.rethrow();
+    if(deferred)
+    {
+        for(size_t i = 0; i < num_files; ++i)
+            _append(&m_pending, &tree_path, 1u);
+        return;
+    }
+    // finally merge, in the given order
+    m_path.compile(tree_path);
+    for(size_t i = 0; i < num_files; ++i)
+    {
+        _dbg("merging parsed file: " << filenames[i]);
+        m_borrowed = borrowed[i];
+        _merge(&m_layer_trees[first_tree + i], m_path);
+        m_borrowed = {};
+    }
+}
+
+void Workspace::add_dir(csubstr tree_path, const char *dirname)
+{
+    if(tree_path.not_empty()) { _dbg("adding directory: " << tree_path << "=" << dirname); }
+    else { _dbg("adding directory to root: " << dirname); }
+    _add_dir(tree_path, dirname, /*recursive*/false);
+}
+
+void Workspace::add_dir(const char *dirname)
+{
+    csubstr rootpath = "";
+    add_dir(rootpath, dirname);
+}
+
+void Workspace::add_dir_recursive(csubstr tree_path, const char *dirname)
+{
+    if(tree_path.not_empty()) { _dbg("adding directory recursively: " << tree_path << "=" << dirname); }
+    else { _dbg("adding directory recursively to root: " << dirname); }
+    _add_dir(tree_path, dirname, /*recursive*/true);
+}
+
+void Workspace::add_dir_recursive(const char *dirname)
+{
+    csubstr rootpath = "";
+    add_dir_recursive(rootpath, dirname);
+}
+
+void Workspace::_add_dir(csubstr tree_path, const char *dirname, bool recursive)
+{
+    // this reuses the listing from prepare_add_dir(), if it was called
+    DirManifest manifest = m_manifests.buf[_get_manifest(dirname, recursive)];
+    if((m_flags & WS_PARALLEL_DIRS) && manifest.num_files > 1u)
+    {
+        _add_files_parallel(tree_path, manifest);
+        return;
+    }
+    for(size_t i = 0; i < manifest.num_files; ++i)
+    {
+        DirManifestFile const& file = m_manifest_files.buf[manifest.first_file + i];
+        _add_file(tree_path, _manifest_name(file.name), file.size);
+    }
+}
+
+void Workspace::add_file(csubstr tree_path, const char *filename_)
+{
+    if(tree_path.not_empty()) { _dbg("adding file: " << tree_path << "=" << filename_); }
+    else { _dbg("adding file to root: " << filename_); }
+    C4_CHECK(fs::is_file(filename_));
+    _add_file(tree_path, filename_, fs::file_size(filename_));
+}
+
+void Workspace::_add_file(csubstr tree_path, const char *filename, size_t filesz)
+{
+    _load_started();
+    if((m_flags & WS_MMAP_FILES) && !(m_flags & WS_DEFERRED_MERGE))
+    {
+        MappedFile mapped;
+        {
+            TraceScope trace(this, TracePhase::read, to_csubstr(filename));
+            mapped.map(filename);
+        }
+        if(mapped.valid())
+        {
+            _add_conf_borrowed(to_csubstr(filename), tree_path, mapped.contents);
+            return;
+        }
+        // otherwise fall back to copying
+    }
+    // copy the file contents into the tree arena
+    substr file_contents; // must be substr, not csubstr!
+    if(!_read_file(filename, filesz, &file_contents))
+        return;
+    // now parse the yaml content into the work tree
+    _add_conf(to_csubstr(filename), tree_path, file_contents);
+}
+
+bool Workspace::_read_file(const char *filename, size_t filesz, substr *contents)
+{
+    // the arena was reserved for the size of the file when it was
+    // stat'ed, which may have been in the prepare phase. If the file
+    // was since rewritten or removed, skip it instead of failing.
+    substr file_contents = _alloc_arena(filesz);
+    TraceScope trace(this, TracePhase::read, to_csubstr(filename));
+    bool changed = true;
+    if(FILE *file = fopen(filename, "rb"))
+    {
+        const size_t actualsz = fread(file_contents.str, 1u, file_contents.len, file);
+        changed = actualsz != filesz || fgetc(file) != EOF;
+        fclose(file);
+    }
+    if(changed)
+    {
+        _dbg("file changed since it was stat'ed, skipping: " << filename);
+        m_inputs_changed = true;
+        return false;
+    }
+    *contents = file_contents;
+    return true;
+}
+
+void Workspace::add_file(const char *filename)
+{
+    csubstr rootpath = "";
+    add_file(rootpath, filename);
+}
+
+void Workspace::add_conf(csubstr path_eq_conf_yml)
+{
+    auto specs = path_eq_yml(path_eq_conf_yml);
+    add_conf(specs.tree_path, specs.yml);
+}
+
+void Workspace::add_conf(csubstr dst_path, csubstr conf_yml)
+{
+    _load_started();
+    _add_conf("", dst_path, conf_yml);
+}
+
+void Workspace::add_conf(CompiledPath const& dst_path, csubstr conf_yml)
+{
+    _load_started();
+    _add_conf("", dst_path, conf_yml);
+}
+
+void Workspace::add_conf_in_place(csubstr dst_path, substr conf_yml)
+{
+    _load_started();
+    // deferred inputs are merged later, when the buffer may be gone
+    if(m_flags & WS_DEFERRED_MERGE)
+    {
+        _add_conf("", dst_path, csubstr(conf_yml));
+        return;
+    }
+    _add_conf_borrowed("", dst_path, conf_yml);
+}
+
+void Workspace::apply_opts(ParsedOpt const* args, size_t num_args)
+{
+    m_cache_hit = false;
+    // a callback can do anything to the tree, so the result is
+    // cacheable only up to the first callback
+    size_t num_cacheable = 0;
+    if(m_cache_dir && !m_load_started)
+        while(num_cacheable < num_args && args[num_cacheable].action != ConfigAction::callback)
+            ++num_cacheable;
+    if(!num_cacheable)
+    {
+        _prepare_opts(args, num_args);
+        _apply_opts(args, num_args);
+        return;
+    }
+    ParsedOpt const* rest = args + num_cacheable;
+    const size_t num_rest = num_args - num_cacheable;
+    csubstr cache_dir = to_csubstr(m_cache_dir);
+    const uint64_t key = _hash_opts(args, num_cacheable);
+    ScopedArray<char> filename(m_output->callbacks(), cache_dir.len + 64u);
+    cache_filename({filename.m_buf, filename.m_size}, cache_dir, key, {});
+    {
+        // load into a scratch tree, so that the output is kept
+        // intact if the cached snapshot is rejected
+        yml::Tree cached(m_output->callbacks());
+        bool hit;
+        {
+            TraceScope trace(this, TracePhase::cache, to_csubstr(filename.m_buf));
+            hit = load_snapshot_file(filename.m_buf, &cached);
+        }
+        if(hit)
+        {
+            _dbg("cache hit: " << filename.m_buf);
+            *m_output = std::move(cached);
+            m_cache_hit = true;
+            _prepare_opts(rest, num_rest);
+            _apply_opts(rest, num_rest);
+            return;
+        }
+    }
+    _dbg("cache miss: " << filename.m_buf);
+    _prepare_opts(args, num_args);
+    _apply_opts(args, num_cacheable);
+    // the key was computed from the state of the files before they
+    // were loaded, so it does not match a result with skipped files
+    if(m_inputs_changed)
+    {
+        _apply_opts(rest, num_rest);
+        return;
+    }
+    // write to a temporary file first and then rename it, so that
+    // concurrent processes never see a partial snapshot. Failing to
+    // write the cache is not an error.
+    #ifdef C4_POSIX
+    const uint64_t unique = (uint64_t)::getpid();
+    #else
+    const uint64_t unique = (uint64_t)(uintptr_t)this;
+    #endif
+    char tmpsuffix[32];
+    size_t tmpsuffix_len = c4::cat(substr(tmpsuffix, sizeof(tmpsuffix)), ".tmp", unique);
+    C4_CHECK(tmpsuffix_len < sizeof(tmpsuffix));
+    ScopedArray<char> tmpfilename(m_output->callbacks(), cache_dir.len + 64u + tmpsuffix_len);
+    cache_filename({tmpfilename.m_buf, tmpfilename.m_size}, cache_dir, key, csubstr(tmpsuffix, tmpsuffix_len));
+    {
+        TraceScope trace(this, TracePhase::cache, to_csubstr(filename.m_buf));
+        if(!save_snapshot_file(*m_output, tmpfilename.m_buf)
+           || ::rename(tmpfilename.m_buf, filename.m_buf) != 0)
+            ::remove(tmpfilename.m_buf);
+    }
+    _apply_opts(rest, num_rest);
+}
+
+uint64_t Workspace::_hash_opts(ParsedOpt const* args, size_t num_args)
+{
+    yml::Callbacks const& cb = m_output->callbacks();
+    uint64_t hash = hash_inputs(args, num_args);
+    // the initial contents of the output tree
+    ScopedArray<char> buf(cb, save_snapshot(*m_output, {}));
+    save_snapshot(*m_output, {buf.m_buf, buf.m_size});
+    return fnv1a(hash, buf.m_buf, buf.m_size);
+}
+
+uint64_t Workspace::hash_inputs(ParsedOpt const* args, size_t num_args)
+{
+    yml::Callbacks const& cb = m_output->callbacks();
+    uint64_t hash = fnv1a_basis;
+    for(ParsedOpt const* C4_RESTRICT arg = args; arg < args + num_args; ++arg)
+    {
+        const uint32_t action = (uint32_t)arg->action;
+        hash = fnv1a(hash, &action, sizeof(action));
+        hash = hash_str(hash, arg->target);
+        hash = hash_str(hash, arg->payload);
+        if(arg->action == ConfigAction::load_file)
+        {
+            C4_ASSERT(strlen(arg->payload.data()) == arg->payload.len);
+            hash = hash_file_state(hash, arg->payload.data(), cb);
+        }
+        else if(arg->action == ConfigAction::load_dir || arg->action == ConfigAction::load_dir_recursive)
+        {
+            C4_ASSERT(strlen(arg->payload.data()) == arg->payload.len);
+            // the listing is reused later by prepare_add_dir() or
+            // add_dir(), so the directory is still listed only once
+            const bool recursive = (arg->action == ConfigAction::load_dir_recursive);
+            DirManifest manifest = m_manifests.buf[_get_manifest(arg->payload.data(), recursive)];
+            const uint64_t num_files = manifest.num_files;
+            hash = fnv1a(hash, &num_files, sizeof(num_files));
+            for(size_t i = 0; i < manifest.num_files; ++i)
+                hash = hash_file_state(hash, _manifest_name(m_manifest_files.buf[manifest.first_file + i].name), cb);
+        }
+    }
+    return hash;
+}
+
+void Workspace::_prepare_opts(ParsedOpt const* args_, size_t num_args)
+{
+    TraceScope trace(this, TracePhase::prepare);
+    ParsedOpt const* C4_RESTRICT args = args_;
+    for(size_t iarg = 0; iarg < num_args; ++iarg)
+    {
+        ParsedOpt const& arg = args[iarg];
+        switch(arg.action)
+        {
+        case ConfigAction::set_node:
+            prepare_add_conf(arg.target, arg.payload);
+            break;
+        case ConfigAction::load_file:
+            C4_ASSERT(strlen(arg.payload.data()) == arg.payload.len);
+            prepare_add_file(arg.target, arg.payload.data());
+            break;
+        case ConfigAction::load_dir:
+            C4_ASSERT(strlen(arg.payload.data()) == arg.payload.len);
+            prepare_add_dir(arg.target, arg.payload.data());
+            break;
+        case ConfigAction::load_dir_recursive:
+            C4_ASSERT(strlen(arg.payload.data()) == arg.payload.len);
+            prepare_add_dir_recursive(arg.target, arg.payload.data());
+            break;
+        case ConfigAction::callback:
+            break;
+        default:
+            C4_ERROR("unknown action");
+        }
+    }
+}
+
+void Workspace::_apply_opts(ParsedOpt const* args_, size_t num_args)
+{
+    ParsedOpt const* C4_RESTRICT args = args_;
+    for(size_t iarg = 0; iarg < num_args; ++iarg)
+    {
+        ParsedOpt const& arg = args[iarg];
+        TraceScope trace(this, TracePhase::layer, arg.payload);
+        switch(arg.action)
+        {
+        case ConfigAction::set_node:
+            add_conf(arg.target, arg.payload);
+            break;
+        case ConfigAction::load_file:
+            add_file(arg.target, arg.payload.data());
+            break;
+        case ConfigAction::load_dir:
+            add_dir(arg.target, arg.payload.data());
+            break;
+        case ConfigAction::load_dir_recursive:
+            add_dir_recursive(arg.target, arg.payload.data());
+            break;
+        case ConfigAction::callback:
+            merge_pending(); // the callback must see the result so far
+            arg.callback(*m_output, arg.payload);
+            break;
+        default:
+            C4_ERROR("unknown action");
+        }
+    }
+    merge_pending();
+}
+
+
+MemoryReport Workspace::memory_report() const
+{
+    MemoryReport report = {};
+    report.output = tree_memory(*m_output);
+    report.workspace = tree_memory(*m_ws);
+    report.num_layers = m_num_layer_trees;
+    for(size_t i = 0; i < m_num_layer_trees; ++i)
+    {
+        TreeMemory layer = tree_memory(m_layer_trees[i]);
+        report.layers.node_capacity += layer.node_capacity;
+        report.layers.node_size += layer.node_size;
+        report.layers.node_bytes += layer.node_bytes;
+        report.layers.arena_capacity += layer.arena_capacity;
+        report.layers.arena_size += layer.arena_size;
+        report.layers.arena_referenced += layer.arena_referenced;
+    }
+    report.dir_scratch_bytes = m_dir_scratch.size + m_dir_path.size + m_dir_ancestors.size * sizeof(DirId);
+    report.dir_entry_list_bytes = m_dir_entry_list.names.size * sizeof(char*) + m_dir_entry_list.arena.size;
+    report.manifest_bytes = m_manifests.size * sizeof(DirManifest)
+        + m_manifest_files.size * sizeof(DirManifestFile)
+        + m_manifest_names.size;
+    report.merge_scratch_bytes = m_pending.size * sizeof(csubstr)
+        + m_merge_srcs.size * sizeof(MergeSrc)
+        + m_merge_table.size * sizeof(size_t);
+    report.path_bytes = m_path.m_capacity * sizeof(CompiledPath::Segment);
+    return report;
+}
+
+size_t Workspace::finalize(NodeOrder order)
+{
+    merge_pending();
+    reorder_nodes(m_output, order);
+    const size_t released = compact_arena(m_output);
+    m_wsbuf = yml::Tree(m_output->callbacks());
+    m_parser = yml::Parser(m_output->callbacks());
+    _reserve_layer_trees(0);
+    _release(&m_pending);
+    _release(&m_merge_srcs);
+    _release(&m_merge_table);
+    _release(&m_manifests);
+    _release(&m_manifest_files);
+    _release(&m_manifest_names);
+    _release(&m_dir_path);
+    _release(&m_dir_ancestors);
+    _release(&m_dir_entry_list.names);
+    _release(&m_dir_entry_list.arena);
+    _release(&m_dir_scratch);
+    m_manifests.required_size = 0;
+    m_manifest_files.required_size = 0;
+    m_manifest_names.required_size = 0;
+    m_dir_entry_list = {};
+    m_dir_scratch.required_size = 0;
+    m_load_started = false;
+    m_nodes_estimate = 0;
+    m_arena_estimate = 0;
+    m_ws_nodes_estimate = 0;
+    return released;
+}
+
+void Workspace::reset(yml::Tree *output)
+{
+    if(output && output != m_output)
+    {
+        // the buffers were allocated with the callbacks of the
+        // current output tree, and will be freed with those of the
+        // new one
+        C4_CHECK(output->callbacks() == m_output->callbacks());
+        m_output = output;
+    }
+    // clearing a tree keeps its capacity
+    m_ws->clear();
+    m_ws->clear_arena();
+    // the layer trees, the parser and the directory scratch buffers
+    // are cleared when they are next used. Only the state of the
+    // previous load needs to be dropped.
+    m_pending.required_size = 0;
+    m_merge_srcs.required_size = 0;
+    m_merge_table.required_size = 0;
+    m_manifests.required_size = 0;
+    m_manifest_files.required_size = 0;
+    m_manifest_names.required_size = 0;
+    m_dir_path.required_size = 0;
+    m_dir_ancestors.required_size = 0;
+    m_borrowed = {};
+    m_load_started = false;
+    m_arena_when_load_started = {};
+    m_nodes_estimate = 0;
+    m_arena_estimate = 0;
+    m_ws_nodes_estimate = 0;
+    m_cache_hit = false;
+    m_inputs_changed = false;
+}
+
+const char* trace_phase_str(TracePhase phase) noexcept
+{
+    switch(phase)
+    {
+    case TracePhase::prepare: return "prepare";
+    case TracePhase::layer: return "layer";
+    case TracePhase::list: return "list";
+    case TracePhase::stat: return "stat";
+    case TracePhase::read: return "read";
+    case TracePhase::parse: return "parse";
+    case TracePhase::lookup: return "lookup";
+    case TracePhase::merge: return "merge";
+    case TracePhase::cache: return "cache";
+    }
+    return "unknown";
+}
+
+ChromeTraceSink::ChromeTraceSink(const char *filename)
+    : m_file(std::fopen(filename, "wb"))
+    , m_num_events(0)
+{
+    if(m_file)
+        std::fputs("[\n", m_file);
+}
+
+ChromeTraceSink::~ChromeTraceSink()
+{
+    if(m_file)
+    {
+        std::fputs("\n]\n", m_file);
+        std::fclose(m_file);
+    }
+}
+
+void ChromeTraceSink::write(TraceEvent const& event, void *sink_)
+{
+    ChromeTraceSink *sink = (ChromeTraceSink*) sink_;
+    if(!sink->m_file)
+        return;
+    std::FILE *f = sink->m_file;
+    // the timestamps are in microseconds
+    std::fprintf(f, "%s{\"name\":\"%s\",\"cat\":\"c4conf\",\"ph\":\"%c\",\"ts\":%llu.%03u,\"pid\":1,\"tid\":1",
+                 sink->m_num_events ? ",\n" : "",
+                 trace_phase_str(event.phase),
+                 event.begin ? 'B' : 'E',
+                 (unsigned long long)(event.time_ns / 1000u), (unsigned)(event.time_ns % 1000u));
+    if(event.begin && !event.name.empty())
+    {
+        std::fputs(",\"args\":{\"name\":\"", f);
+        for(const char c : event.name)
+        {
+            if(c == '"' || c == '\\')
+                std::fprintf(f, "\\%c", c);
+            else if((unsigned char)c < 0x20u)
+                std::fprintf(f, "\\u%04x", (unsigned)c);
+            else
+                std::fputc(c, f);
+        }
+        std::fputs("\"}", f);
+    }
+    std::fputc('}', f);
+    ++sink->m_num_events;
+}
+
+
+//-----------------------------------------------------------------------------
+
+struct MonotonicResource::Block
+{
+    Block *prev;
+    size_t size;   //!< the size of the block, including this header
+    bool   mapped; //!< whether the block was mmap()ed instead of allocated upstream
+};
+
+namespace {
+constexpr const size_t monotonic_align = alignof(std::max_align_t);
+constexpr const size_t hugepage_size = size_t(2) << 20u;
+C4_ALWAYS_INLINE char* align_up(char *p, size_t align) noexcept
+{
+    return (char*)(((uintptr_t)p + (align - 1u)) & ~(uintptr_t)(align - 1u));
+}
+/** spin while another thread is allocating. The critical sections
+ * are a few instructions long, except when a new block is needed. */
+struct SpinLock
+{
+    std::atomic<bool> *m_locked;
+    SpinLock(std::atomic<bool> *locked) : m_locked(locked)
+    {
+        while(m_locked->exchange(true, std::memory_order_acquire))
+            std::this_thread::yield();
+    }
+    ~SpinLock()
+    {
+        m_locked->store(false, std::memory_order_release);
+    }
+};
+} // anon namespace
+
+MonotonicResource::MonotonicResource(size_t block_size, bool hugepages, yml::Callbacks const& upstream)
+    : m_upstream(upstream)
+    , m_next_block_size(block_size > sizeof(Block) ? block_size : size_t(4096))
+    , m_hugepages(hugepages)
+    , m_blocks(nullptr)
+    , m_pos(nullptr)
+    , m_end(nullptr)
+    , m_num_blocks(0)
+    , m_num_reserved(0)
+    , m_num_allocated(0)
+    , m_locked(false)
+{
+}
+
+MonotonicResource::~MonotonicResource()
+{
+    release();
+}
+
+yml::Callbacks MonotonicResource::callbacks()
+{
+    auto alloc = [](size_t len, void * /*hint*/, void *this_) -> void* {
+        return ((MonotonicResource*)this_)->allocate(len);
+    };
+    auto dealloc = [](void *mem, size_t len, void *this_) {
+        ((MonotonicResource*)this_)->free(mem, len);
+    };
+    // the upstream error callback expects its own user data
+    auto error = [](const char *msg, size_t len, yml::Location loc, void *this_) {
+        yml::Callbacks const& upstream = ((MonotonicResource*)this_)->m_upstream;
+        upstream.m_error(msg, len, loc, upstream.m_user_data);
+    };
+    return yml::Callbacks(this, alloc, dealloc, error);
+}
+
+void* MonotonicResource::allocate(size_t len)
+{
+    SpinLock lock(&m_locked);
+    char *mem = align_up(m_pos, monotonic_align);
+    if(!m_pos || mem > m_end || len > (size_t)(m_end - mem))
+    {
+        // get a new block; the remainder of the current one is wasted
+        const size_t header = (sizeof(Block) + monotonic_align - 1u) & ~(monotonic_align - 1u);
+        size_t blocksz = m_next_block_size;
+        while(blocksz < header + len)
+            blocksz *= 2u;
+        m_next_block_size = 2u * blocksz;
+        void *block = nullptr;
+        bool mapped = false;
+        #ifdef C4CONF_HAVE_MMAP
+        if(m_hugepages)
+        {
+            // hugepages are only used for aligned ranges, so map with
+            // room to align and then trim the excess
+            blocksz = (blocksz + hugepage_size - 1u) & ~(hugepage_size - 1u);
+            void *region = ::mmap(nullptr, blocksz + hugepage_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+            if(region != MAP_FAILED)
+            {
+                char *first = (char*)region;
+                char *aligned = align_up(first, hugepage_size);
+                char *last = first + blocksz + hugepage_size;
+                if(aligned > first)
+                    ::munmap(first, (size_t)(aligned - first));
+                if(last > aligned + blocksz)
+                    ::munmap(aligned + blocksz, (size_t)(last - (aligned + blocksz)));
+                #ifdef MADV_HUGEPAGE
+                ::madvise(aligned, blocksz, MADV_HUGEPAGE);
+                #endif
+                block = aligned;
+                mapped = true;
+            }
+        }
+        #endif
+        if(!block)
+            block = m_upstream.m_allocate(blocksz, nullptr, m_upstream.m_user_data);
+        m_blocks = new (block) Block{m_blocks, blocksz, mapped};
+        m_pos = (char*)block + header;
+        m_end = (char*)block + blocksz;
+        ++m_num_blocks;
+        m_num_reserved += blocksz;
+        mem = m_pos;
+    }
+    m_pos = mem + len;
+    m_num_allocated += len;
+    return mem;
+}
+
+void MonotonicResource::free(void *mem, size_t len)
+{
+    SpinLock lock(&m_locked);
+    if((char*)mem + len == m_pos)
+        m_pos = (char*)mem;
+}
+
+void MonotonicResource::release()
+{
+    SpinLock lock(&m_locked);
+    while(m_blocks)
+    {
+        Block *b = m_blocks;
+        m_blocks = b->prev;
+        #ifdef C4CONF_HAVE_MMAP
+        if(b->mapped)
+        {
+            ::munmap(b, b->size);
+            continue;
+        }
+        #endif
+        m_upstream.m_free(b, b->size, m_upstream.m_user_data);
+    }
+    m_pos = nullptr;
+    m_end = nullptr;
+    m_num_blocks = 0;
+    m_num_reserved = 0;
+    m_num_allocated = 0;
+}
+
+
+namespace {
+
+/** visit the live nodes of a tree in preorder, without recursion */
+template<class Fn>
+void for_each_node(Tree const& t, Fn &&fn)
+{
+    if(t.empty())
+        return;
+    for(size_t node = t.root_id(); node != yml::NONE; )
+    {
+        fn(node);
+        if(t.first_child(node) != yml::NONE)
+        {
+            node = t.first_child(node);
+            continue;
+        }
+        while(node != yml::NONE && t.next_sibling(node) == yml::NONE)
+            node = t.parent(node);
+        if(node != yml::NONE)
+            node = t.next_sibling(node);
+    }
+}
+
+/** a range of positions in a tree's arena */
+struct ArenaRange
+{
+    size_t first, last;
+};
+
+/** get the ranges of the arena referenced by the strings of the
+ * live nodes, sorted and merged so that no two ranges overlap.
+ * @return the number of ranges */
+size_t referenced_ranges(Tree const& t, ScopedArray<ArenaRange> *ranges)
+{
+    C4_ASSERT(ranges->m_size >= 6u * t.size());
+    size_t num_ranges = 0;
+    const csubstr arena = t.arena();
+    auto add = [&](csubstr s){
+        if(s.len && t.in_arena(s))
+            (*ranges)[num_ranges++] = {(size_t)(s.str - arena.str), (size_t)(s.str - arena.str) + s.len};
+    };
+    for_each_node(t, [&](size_t node){
+        yml::NodeData const* data = t._p(node);
+        add(data->m_key.scalar);
+        add(data->m_key.tag);
+        add(data->m_key.anchor);
+        add(data->m_val.scalar);
+        add(data->m_val.tag);
+        add(data->m_val.anchor);
+    });
+    ArenaRange *buf = ranges->m_buf;
+    std::sort(buf, buf + num_ranges, [](ArenaRange const& a, ArenaRange const& b){
+        return a.first < b.first;
+    });
+    size_t num_merged = 0;
+    for(size_t i = 0; i < num_ranges; ++i)
+    {
+        if(num_merged && buf[i].first <= buf[num_merged - 1u].last)
+        {
+            if(buf[i].last > buf[num_merged - 1u].last)
+                buf[num_merged - 1u].last = buf[i].last;
+        }
+        else
+        {
+            buf[num_merged++] = buf[i];
+        }
+    }
+    return num_merged;
+}
+
+} // namespace
+
+TreeMemory tree_memory(Tree const& t)
+{
+    TreeMemory mem = {};
+    mem.node_capacity = t.capacity();
+    mem.node_size = t.size();
+    mem.node_bytes = t.capacity() * sizeof(yml::NodeData);
+    mem.arena_capacity = t.arena_capacity();
+    mem.arena_size = t.arena_size();
+    ScopedArray<ArenaRange> ranges(t.callbacks(), 6u * t.size());
+    const size_t num_ranges = referenced_ranges(t, &ranges);
+    for(size_t i = 0; i < num_ranges; ++i)
+        mem.arena_referenced += ranges[i].last - ranges[i].first;
+    return mem;
+}
+
+size_t compact_arena(Tree *t)
+{
+    yml::Callbacks const& cb = t->callbacks();
+    const substr old_arena = t->m_arena;
+    ScopedArray<ArenaRange> ranges(cb, 6u * t->size());
+    const size_t num_ranges = referenced_ranges(*t, &ranges);
+    // copy the referenced ranges to the new arena, and keep in each
+    // range its position there
+    size_t size = 0;
+    for(size_t i = 0; i < num_ranges; ++i)
+        size += ranges[i].last - ranges[i].first;
+    substr new_arena = {};
+    if(size)
+        new_arena = {(char*) cb.m_allocate(size, old_arena.str, cb.m_user_data), size};
+    ScopedArray<size_t> new_pos(cb, num_ranges);
+    size_t pos = 0;
+    for(size_t i = 0; i < num_ranges; ++i)
+    {
+        const size_t len = ranges[i].last - ranges[i].first;
+        memcpy(new_arena.str + pos, old_arena.str + ranges[i].first, len);
+        new_pos[i] = pos;
+        pos += len;
+    }
+    // now re-point the strings
+    auto repoint = [&](csubstr *s){
+        if(!s->len || !s->is_sub(old_arena))
+            return;
+        const size_t first = (size_t)(s->str - old_arena.str);
+        // the range containing the string: the last one starting at
+        // or before it
+        ArenaRange const* r = std::upper_bound(ranges.m_buf, ranges.m_buf + num_ranges, first, [](size_t val, ArenaRange const& range){
+            return val < range.first;
+        }) - 1;
+        C4_ASSERT(r >= ranges.m_buf && first + s->len <= r->last);
+        s->str = new_arena.str + new_pos[(size_t)(r - ranges.m_buf)] + (first - r->first);
+    };
+    for_each_node(*t, [&](size_t node){
+        yml::NodeData *data = t->_p(node);
+        repoint(&data->m_key.scalar);
+        repoint(&data->m_key.tag);
+        repoint(&data->m_key.anchor);
+        repoint(&data->m_val.scalar);
+        repoint(&data->m_val.tag);
+        repoint(&data->m_val.anchor);
+    });
+    if(old_arena.str)
+        cb.m_free(old_arena.str, old_arena.len, cb.m_user_data);
+    t->m_arena = new_arena;
+    t->m_arena_pos = size;
+    return old_arena.len - size;
+}
+
+void reorder_nodes(Tree *t, NodeOrder order)
+{
+    if(t->empty())
+        return;
+    yml::Callbacks const& cb = t->callbacks();
+    const size_t cap = t->capacity();
+    const size_t size = t->size();
+    // the old ids, in the new order
+    ScopedArray<size_t> old_ids(cb, size);
+    size_t num = 0;
+    if(order == NodeOrder::depth_first)
+    {
+        for_each_node(*t, [&](size_t node){
+            old_ids[num++] = node;
+        });
+    }
+    else
+    {
+        // the order array is also the queue
+        old_ids[num++] = t->root_id();
+        for(size_t i = 0; i < num; ++i)
+            for(size_t ch = t->first_child(old_ids[i]); ch != yml::NONE; ch = t->next_sibling(ch))
+                old_ids[num++] = ch;
+    }
+    C4_CHECK(num == size);
+    ScopedArray<size_t> new_ids(cb, cap);
+    for(size_t i = 0; i < cap; ++i)
+        new_ids[i] = yml::NONE;
+    for(size_t i = 0; i < size; ++i)
+        new_ids[old_ids[i]] = i;
+    auto remap = [&](size_t id){
+        return id == yml::NONE ? yml::NONE : new_ids[id];
+    };
+    // move the live nodes, from a copy of the old ones
+    ScopedArray<yml::NodeData> old_nodes(cb, size);
+    for(size_t i = 0; i < size; ++i)
+        old_nodes[i] = *t->_p(old_ids[i]);
+    yml::NodeData *C4_RESTRICT nodes = t->m_buf;
+    for(size_t i = 0; i < size; ++i)
+    {
+        yml::NodeData n = old_nodes[i];
+        n.m_parent = remap(n.m_parent);
+        n.m_first_child = remap(n.m_first_child);
+        n.m_last_child = remap(n.m_last_child);
+        n.m_next_sibling = remap(n.m_next_sibling);
+        n.m_prev_sibling = remap(n.m_prev_sibling);
+        nodes[i] = n;
+    }
+    // the free nodes are now a single chain after the live ones
+    for(size_t i = size; i < cap; ++i)
+    {
+        nodes[i] = yml::NodeData();
+        nodes[i].m_type = yml::NOTYPE;
+        nodes[i].m_parent = yml::NONE;
+        nodes[i].m_first_child = yml::NONE;
+        nodes[i].m_last_child = yml::NONE;
+        nodes[i].m_prev_sibling = i > size ? i - 1u : yml::NONE;
+        nodes[i].m_next_sibling = i + 1u < cap ? i + 1u : yml::NONE;
+    }
+    t->m_free_head = size < cap ? size : yml::NONE;
+    t->m_free_tail = size < cap ? cap - 1u : yml::NONE;
+}
+
+
+size_t estimate_num_nodes(csubstr yml) noexcept
+{
+    // one node for the root and one for a document, and then one for
+    // each line, flow entry or flow container. A block line may open
+    // several nested containers (eg `- - a: b`), so count also each
+    // sequence entry, key or complex key indicator. The last line may
+    // not have a newline.
+    size_t num = 2u;
+    for(size_t i = 0; i < yml.len; ++i)
+    {
+        const char c = yml.str[i];
+        if(c == '\n' || c == ',' || c == '[' || c == '{')
+        {
+            ++num;
+        }
+        else if(c == '-' || c == ':' || c == '?')
+        {
+            const char next = i + 1u < yml.len ? yml.str[i + 1u] : ' ';
+            num += (next == ' ' || next == '\t' || next == '\r' || next == '\n');
+        }
+    }
+    return num;
+}
+
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+namespace {
+
+constexpr const char snapshot_magic[8] = {'c', '4', 'c', 'o', 'n', 'f', '\0', '\0'};
+constexpr const uint32_t snapshot_endianness = 0x01020304u;
+constexpr const uint64_t snapshot_npos = (uint64_t)-1;
+
+struct SnapshotHeader
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t endianness;     //!< snapshot_endianness, as written by the native byte order
+    uint64_t type_signature; //!< see snapshot_type_signature()
+    uint64_t num_nodes;
+    uint64_t strings_size;
+};
+
+struct SnapshotStr
+{
+    uint64_t pos; //!< offset into the string section, or snapshot_npos for null strings
+    uint64_t len;
+};
+
+struct SnapshotNode
+{
+    uint64_t type;
+    uint64_t parent; //!< index of the parent, which always precedes the node
+    SnapshotStr key, key_tag, key_anchor;
+    SnapshotStr val, val_tag, val_anchor;
+};
+
+static_assert(sizeof(SnapshotHeader) == 40u, "unexpected padding");
+static_assert(sizeof(SnapshotNode) == 112u, "unexpected padding");
+
+/** the node type flags saved in snapshots */
+constexpr const uint64_t snapshot_type_flags[] = {
+    (uint64_t)yml::VAL, (uint64_t)yml::KEY, (uint64_t)yml::MAP,
+    (uint64_t)yml::SEQ, (uint64_t)yml::DOC, (uint64_t)yml::STREAM,
+    (uint64_t)yml::KEYREF, (uint64_t)yml::VALREF,
+    (uint64_t)yml::KEYANCH, (uint64_t)yml::VALANCH,
+    (uint64_t)yml::KEYTAG, (uint64_t)yml::VALTAG,
+    (uint64_t)yml::KEYQUO, (uint64_t)yml::VALQUO,
+};
+
+/** a hash of the values of the node type flags, so that snapshots
+ * written by a build with different flags are rejected */
+uint64_t snapshot_type_signature() noexcept
+{
+    return fnv1a(fnv1a_basis, snapshot_type_flags, sizeof(snapshot_type_flags));
+}
+
+/** the mask of the node type bits saved in snapshots. Other bits are
+ * not written, and a snapshot with any of them is rejected. */
+uint64_t snapshot_type_mask() noexcept
+{
+    uint64_t mask = 0;
+    for(uint64_t flag : snapshot_type_flags)
+        mask |= flag;
+    return mask;
+}
+
+/** writes the snapshot of a tree: first the node records, then the
+ * string section, which starts with a copy of the tree arena and
+ * is followed by any strings which are not in the arena. Nothing is
+ * written past the end of the buffer, but the required size is
+ * still computed. */
+struct SnapshotWriter
+{
+    Tree const* m_tree;
+    substr      m_buf;
+    csubstr     m_arena;
+    size_t      m_nodes_pos;   //!< where the next node record is written
+    size_t      m_strings_pos; //!< where the string section starts
+    size_t      m_strings_size;
+    uint64_t    m_num_nodes;
+
+    SnapshotWriter(Tree const& t, substr buf)
+        : m_tree(&t)
+        , m_buf(buf)
+        , m_arena(t.arena())
+        , m_nodes_pos(sizeof(SnapshotHeader))
+        , m_strings_pos(sizeof(SnapshotHeader) + t.size() * sizeof(SnapshotNode))
+        , m_strings_size(t.arena().len)
+        , m_num_nodes(0)
+    {
+    }
+
+    void write(size_t pos, const void *data, size_t len)
+    {
+        if(len && pos + len <= m_buf.len)
+            memcpy(m_buf.str + pos, data, len);
+    }
+
+    SnapshotStr str(csubstr s)
+    {
+        SnapshotStr ret = {snapshot_npos, 0u};
+        if(!s.str)
+            return ret;
+        ret.len = s.len;
+        if(s.is_sub(m_arena))
+        {
+            ret.pos = (uint64_t)(s.str - m_arena.str);
+        }
+        else
+        {
+            ret.pos = m_strings_size;
+            write(m_strings_pos + m_strings_size, s.str, s.len);
+            m_strings_size += s.len;
+        }
+        return ret;
+    }
+
+    void node(size_t id, uint64_t parent)
+    {
+        yml::NodeData const* C4_RESTRICT d = m_tree->_p(id);
+        SnapshotNode n;
+        n.type = (uint64_t)d->m_type.type & snapshot_type_mask();
+        n.parent = parent;
+        n.key = str(d->m_key.scalar);
+        n.key_tag = str(d->m_key.tag);
+        n.key_anchor = str(d->m_key.anchor);
+        n.val = str(d->m_val.scalar);
+        n.val_tag = str(d->m_val.tag);
+        n.val_anchor = str(d->m_val.anchor);
+        ++m_num_nodes;
+        write(m_nodes_pos, &n, sizeof(n));
+        m_nodes_pos += sizeof(n);
+    }
+
+    size_t save()
+    {
+        // the nodes are written in preorder, so each parent precedes
+        // its children. Remember the index of each record, to refer
+        // to it from the children.
+        ScopedArray<uint64_t> indices(m_tree->callbacks(), m_tree->capacity());
+        for_each_node(*m_tree, [&](size_t id){
+            const size_t parent = m_tree->parent(id);
+            indices[id] = m_num_nodes;
+            node(id, parent != yml::NONE ? indices[parent] : snapshot_npos);
+        });
+        C4_CHECK(m_num_nodes == m_tree->size());
+        write(m_strings_pos, m_arena.str, m_arena.len);
+        SnapshotHeader h;
+        memcpy(h.magic, snapshot_magic, sizeof(h.magic));
+        h.version = snapshot_version;
+        h.endianness = snapshot_endianness;
+        h.type_signature = snapshot_type_signature();
+        h.num_nodes = m_num_nodes;
+        h.strings_size = m_strings_size;
+        write(0u, &h, sizeof(h));
+        return m_strings_pos + m_strings_size;
+    }
+};
+
+bool snapshot_str_ok(SnapshotStr s, uint64_t strings_size) noexcept
+{
+    if(s.pos == snapshot_npos)
+        return s.len == 0u;
+    return s.pos <= strings_size && s.len <= strings_size - s.pos;
+}
+
+csubstr snapshot_str(SnapshotStr s, substr strings) noexcept
+{
+    if(s.pos == snapshot_npos)
+        return {};
+    return strings.sub((size_t)s.pos, (size_t)s.len);
+}
+} // namespace
+
+size_t save_snapshot(Tree const& t, substr buf)
+{
+    SnapshotWriter writer(t, buf);
+    return writer.save();
+}
+
+bool save_snapshot_file(Tree const& t, const char *filename)
+{
+    yml::Callbacks const& cb = t.callbacks();
+    ScopedArray<char> buf(cb, save_snapshot(t, {}));
+    size_t sz = save_snapshot(t, {buf.m_buf, buf.m_size});
+    C4_CHECK(sz == buf.m_size);
+    FILE *file = fopen(filename, "wb");
+    if(!file)
+        return false;
+    bool ok = fwrite(buf.m_buf, 1u, sz, file) == sz;
+    ok &= (fclose(file) == 0);
+    return ok;
+}
+
+bool load_snapshot(csubstr snapshot, Tree *t)
+{
+    // first validate everything, so that the tree is only
+    // modified when the snapshot is known to be good
+    SnapshotHeader h;
+    if(snapshot.len < sizeof(h))
+        return false;
+    memcpy(&h, snapshot.str, sizeof(h));
+    if(memcmp(h.magic, snapshot_magic, sizeof(h.magic)) != 0
+       || h.version != snapshot_version
+       || h.endianness != snapshot_endianness
+       || h.type_signature != snapshot_type_signature())
+        return false;
+    const size_t avail = snapshot.len - sizeof(h);
+    if(h.num_nodes > avail / sizeof(SnapshotNode)
+       || h.strings_size != avail - h.num_nodes * sizeof(SnapshotNode))
+        return false;
+    const char *nodes = snapshot.str + sizeof(h);
+    const size_t num_nodes = (size_t)h.num_nodes;
+    const uint64_t type_mask = snapshot_type_mask();
+    SnapshotNode n, parent;
+    for(size_t i = 0; i < num_nodes; ++i)
+    {
+        memcpy(&n, nodes + i * sizeof(n), sizeof(n));
+        if((i == 0) != (n.parent == snapshot_npos))
+            return false;
+        if(n.type & ~type_mask)
+            return false;
+        if(i)
+        {
+            if(n.parent >= i)
+                return false;
+            // children must be in a container, and have a key
+            // exactly when the container is a map
+            memcpy(&parent, nodes + (size_t)n.parent * sizeof(parent), sizeof(parent));
+            if(!(parent.type & (uint64_t)(yml::MAP|yml::SEQ)))
+                return false;
+            if(((n.type & (uint64_t)yml::KEY) != 0) != ((parent.type & (uint64_t)yml::MAP) != 0))
+                return false;
+        }
+        if(!snapshot_str_ok(n.key, h.strings_size)
+           || !snapshot_str_ok(n.key_tag, h.strings_size)
+           || !snapshot_str_ok(n.key_anchor, h.strings_size)
+           || !snapshot_str_ok(n.val, h.strings_size)
+           || !snapshot_str_ok(n.val_tag, h.strings_size)
+           || !snapshot_str_ok(n.val_anchor, h.strings_size))
+            return false;
+    }
+    t->clear();
+    t->clear_arena();
+    if(!num_nodes)
+        return true;
+    // now the string section is copied whole into the arena...
+    const size_t strings_size = (size_t)h.strings_size;
+    t->reserve(num_nodes);
+    t->reserve_arena(strings_size);
+    substr strings = t->alloc_arena(strings_size);
+    if(strings_size)
+        memcpy(strings.str, nodes + num_nodes * sizeof(n), strings_size);
+    // ... and the nodes are recreated in the same order
+    ScopedArray<size_t> ids(t->callbacks(), num_nodes);
+    for(size_t i = 0; i < num_nodes; ++i)
+    {
+        memcpy(&n, nodes + i * sizeof(n), sizeof(n));
+        ids[i] = i ? t->append_child(ids[(size_t)n.parent]) : t->root_id();
+        yml::NodeData *C4_RESTRICT d = t->_p(ids[i]);
+        d->m_type = (yml::NodeType_e)n.type;
+        d->m_key.scalar = snapshot_str(n.key, strings);
+        d->m_key.tag = snapshot_str(n.key_tag, strings);
+        d->m_key.anchor = snapshot_str(n.key_anchor, strings);
+        d->m_val.scalar = snapshot_str(n.val, strings);
+        d->m_val.tag = snapshot_str(n.val_tag, strings);
+        d->m_val.anchor = snapshot_str(n.val_anchor, strings);
+    }
+    return true;
+}
+
+bool load_snapshot_file(const char *filename, Tree *t)
+{
+    MappedFile mapped;
+    if(mapped.map(filename))
+        return load_snapshot(mapped.contents, t);
+    // no mmap: read into a scratch buffer
+    if(!fs::file_exists(filename))
+        return false;
+    size_t sz = fs::file_size(filename);
+    ScopedArray<char> buf(t->callbacks(), sz);
+    if(fs::file_get_contents(filename, buf.m_buf, sz) != sz)
+        return false;
+    return load_snapshot(csubstr(buf.m_buf, sz), t);
+}
+
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+namespace {
+bool starts_layer(ConfigAction action) noexcept
+{
+    return action == ConfigAction::load_file
+        || action == ConfigAction::load_dir
+        || action == ConfigAction::load_dir_recursive;
+}
+} // namespace
+
+ReloadableConf::ReloadableConf(yml::Tree *output, uint32_t flags)
+    : m_output(output)
+    , m_flags(flags)
+    , m_dir_include()
+    , m_dir_exclude()
+    , m_trace(nullptr)
+    , m_trace_data(nullptr)
+    , m_opts(nullptr)
+    , m_num_opts(0)
+    , m_layers(nullptr)
+    , m_num_layers(0)
+    , m_watch_fd(-1)
+    , m_workspace(output, nullptr, flags)
+{
+    #ifdef C4CONF_HAVE_INOTIFY
+    m_watch_fd = ::inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+    #endif
+}
+
+ReloadableConf::~ReloadableConf()
+{
+    _release_layers();
+    #ifdef C4CONF_HAVE_INOTIFY
+    if(m_watch_fd >= 0)
+        ::close(m_watch_fd);
+    #endif
+}
+
+void ReloadableConf::_release_layers()
+{
+    yml::Callbacks const& cb = m_output->callbacks();
+    for(size_t i = 0; i < m_num_layers; ++i)
+    {
+        #ifdef C4CONF_HAVE_INOTIFY
+        if(m_layers[i].watch >= 0)
+            ::inotify_rm_watch(m_watch_fd, m_layers[i].watch);
+        #endif
+        if(m_layers[i].checkpoint.str)
+            cb.m_free(m_layers[i].checkpoint.str, m_layers[i].checkpoint_capacity, cb.m_user_data);
+        m_layers[i].~Layer();
+    }
+    if(m_layers)
+        cb.m_free(m_layers, sizeof(Layer) * m_num_layers, cb.m_user_data);
+    m_layers = nullptr;
+    m_num_layers = 0;
+}
+
+void ReloadableConf::load(ParsedOpt const* args, size_t num_args)
+{
+    _release_layers();
+    m_opts = args;
+    m_num_opts = num_args;
+    size_t num_layers = 0;
+    for(size_t i = 0; i < num_args; ++i)
+        num_layers += starts_layer(args[i].action);
+    if(num_layers)
+    {
+        yml::Callbacks const& cb = m_output->callbacks();
+        m_layers = (Layer*) cb.m_allocate(sizeof(Layer) * num_layers, nullptr, cb.m_user_data);
+        m_num_layers = num_layers;
+        size_t layer = 0;
+        for(size_t i = 0; i < num_args; ++i)
+        {
+            if(!starts_layer(args[i].action))
+                continue;
+            Layer *l = new (m_layers + layer) Layer();
+            l->first_opt = i;
+            l->end_opt = num_args;
+            l->watch = -1;
+            l->changed = false;
+            if(layer)
+                m_layers[layer - 1].end_opt = i;
+            ++layer;
+        }
+    }
+    // the options before the first layer are never reapplied
+    _apply(0, m_num_layers ? m_layers[0].first_opt : num_args);
+    for(size_t i = 0; i < m_num_layers; ++i)
+    {
+        _watch(i);
+        m_layers[i].signature = _signature(i);
+    }
+    _retry_from(_apply_layers(0, /*restore*/false));
+}
+
+void ReloadableConf::_retry_from(size_t first_layer)
+{
+    // force the next reload() to recompute these layers
+    for(size_t i = first_layer; i < m_num_layers; ++i)
+    {
+        m_layers[i].signature = 0;
+        m_layers[i].changed = true;
+    }
+}
+
+bool ReloadableConf::reload()
+{
+    _read_events();
+    const bool watching = m_watch_fd >= 0;
+    ScopedArray<uint64_t> signatures(m_output->callbacks(), m_num_layers);
+    size_t first_changed = m_num_layers;
+    for(size_t i = 0; i < m_num_layers; ++i)
+    {
+        Layer const& l = m_layers[i];
+        // without events, a watched layer is known to be unchanged
+        if(watching && l.watch >= 0 && !l.changed)
+        {
+            signatures[i] = l.signature;
+            continue;
+        }
+        signatures[i] = _signature(i);
+        if(signatures[i] != l.signature)
+        {
+            // retry on the next call, eg when the file is replaced
+            if(!_inputs_exist(i))
+                return false;
+            if(first_changed == m_num_layers)
+                first_changed = i;
+        }
+    }
+    for(size_t i = 0; i < m_num_layers; ++i)
+    {
+        Layer &l = m_layers[i];
+        if(watching && (l.changed || l.watch < 0))
+        {
+            l.changed = false;
+            _watch(i); // the file may have been replaced
+        }
+        l.signature = signatures[i];
+    }
+    if(first_changed == m_num_layers)
+        return false;
+    // keep the current output, in case an input changes while it
+    // is being loaded
+    yml::Tree previous(std::move(*m_output));
+    if(_apply_layers(first_changed, /*restore*/true) < m_num_layers)
+    {
+        *m_output = std::move(previous);
+        _retry_from(first_changed);
+        return false;
+    }
+    return true;
+}
+
+bool ReloadableConf::_apply(size_t first_opt, size_t end_opt)
+{
+    if(first_opt == end_opt)
+        return true;
+    Workspace &ws = m_workspace;
+    ws.reset();
+    ws.m_flags = m_flags;
+    ws.m_dir_include = m_dir_include;
+    ws.m_dir_exclude = m_dir_exclude;
+    ws.m_trace = m_trace;
+    ws.m_trace_data = m_trace_data;
+    ws.apply_opts(m_opts + first_opt, end_opt - first_opt);
+    return !ws.m_inputs_changed;
+}
+
+size_t ReloadableConf::_apply_layers(size_t first_layer, bool restore)
+{
+    if(first_layer == m_num_layers)
+        return m_num_layers;
+    if(restore)
+        _restore_checkpoint(first_layer);
+    else
+        _save_checkpoint(first_layer);
+    if(!_apply(m_layers[first_layer].first_opt, m_layers[first_layer].end_opt))
+        return first_layer;
+    for(size_t i = first_layer + 1; i < m_num_layers; ++i)
+    {
+        _save_checkpoint(i);
+        if(!_apply(m_layers[i].first_opt, m_layers[i].end_opt))
+            return i;
+    }
+    return m_num_layers;
+}
+
+void ReloadableConf::_save_checkpoint(size_t layer)
+{
+    Layer &l = m_layers[layer];
+    // drop the dead text from the output first, so that it is not
+    // kept in the snapshot
+    compact_arena(m_output);
+    const size_t sz = save_snapshot(*m_output, {});
+    if(sz > l.checkpoint_capacity)
+    {
+        yml::Callbacks const& cb = m_output->callbacks();
+        char *buf = (char*) cb.m_allocate(sz, l.checkpoint.str, cb.m_user_data);
+        if(l.checkpoint.str)
+            cb.m_free(l.checkpoint.str, l.checkpoint_capacity, cb.m_user_data);
+        l.checkpoint.str = buf;
+        l.checkpoint_capacity = sz;
+    }
+    l.checkpoint.len = save_snapshot(*m_output, {l.checkpoint.str, sz});
+    C4_CHECK(l.checkpoint.len == sz);
+}
+
+void ReloadableConf::_restore_checkpoint(size_t layer)
+{
+    C4_CHECK(load_snapshot(m_layers[layer].checkpoint, m_output));
+}
+
+uint64_t ReloadableConf::_signature(size_t layer) const
+{
+    yml::Tree scratch(m_output->callbacks());
+    Workspace ws(&scratch);
+    ws.m_dir_include = m_dir_include;
+    ws.m_dir_exclude = m_dir_exclude;
+    return ws.hash_inputs(m_opts + m_layers[layer].first_opt, 1u);
+}
+
+bool ReloadableConf::_inputs_exist(size_t layer) const
+{
+    ParsedOpt const& opt = m_opts[m_layers[layer].first_opt];
+    C4_ASSERT(strlen(opt.payload.data()) == opt.payload.len);
+    if(opt.action == ConfigAction::load_dir || opt.action == ConfigAction::load_dir_recursive)
+        return fs::dir_exists(opt.payload.data());
+    return fs::file_exists(opt.payload.data());
+}
+
+void ReloadableConf::_watch(size_t layer)
+{
+    #ifdef C4CONF_HAVE_INOTIFY
+    if(m_watch_fd < 0)
+        return;
+    ParsedOpt const& opt = m_opts[m_layers[layer].first_opt];
+    // inotify does not watch subdirectories, so the signature of a
+    // recursive directory is always checked
+    if(opt.action == ConfigAction::load_dir_recursive)
+        return;
+    uint32_t mask = IN_MODIFY|IN_CLOSE_WRITE|IN_ATTRIB|IN_MOVE_SELF|IN_DELETE_SELF;
+    if(opt.action == ConfigAction::load_dir)
+        mask |= IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO;
+    m_layers[layer].watch = ::inotify_add_watch(m_watch_fd, opt.payload.data(), mask);
+    #else
+    C4_UNUSED(layer);
+    #endif
+}
+
+void ReloadableConf::_read_events()
+{
+    #ifdef C4CONF_HAVE_INOTIFY
+    if(m_watch_fd < 0)
+        return;
+    alignas(struct inotify_event) char buf[4096];
+    ssize_t len;
+    while((len = ::read(m_watch_fd, buf, sizeof(buf))) > 0)
+    {
+        for(char *ptr = buf; ptr < buf + len; )
+        {
+            struct inotify_event const* ev = (struct inotify_event const*) ptr;
+            for(size_t i = 0; i < m_num_layers; ++i)
+            {
+                Layer &l = m_layers[i];
+                if(ev->mask & IN_Q_OVERFLOW)
+                {
+                    l.changed = true;
+                }
+                else if(l.watch == ev->wd)
+                {
+                    l.changed = true;
+                    if(ev->mask & IN_IGNORED)
+                        l.watch = -1;
+                }
+            }
+            ptr += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+    #endif
+}
+
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+Binding::Binding(BoundField const* fields, size_t num_fields, yml::Callbacks const& cb)
+    : m_fields(fields)
+    , m_num_fields(num_fields)
+    , m_trie(nullptr)
+    , m_trie_size(0)
+    , m_trie_capacity(0)
+    , m_callbacks(cb)
+{
+    // each path segment creates at most one trie node
+    m_trie_capacity = 1u;
+    for(size_t i = 0; i < num_fields; ++i)
+        m_trie_capacity += fields[i].path.count('.') + fields[i].path.count('[') + 1u;
+    m_trie = (TrieNode*) m_callbacks.m_allocate(sizeof(TrieNode) * m_trie_capacity, nullptr, m_callbacks.m_user_data);
+    m_trie[0] = TrieNode{CompiledPath::Segment{{}, yml::NONE, 0}, yml::NONE, yml::NONE, yml::NONE};
+    m_trie_size = 1u;
+    CompiledPath path(cb);
+    for(size_t i = 0; i < num_fields; ++i)
+    {
+        C4_CHECK(fields[i].read != nullptr);
+        path.compile(fields[i].path);
+        size_t node = 0;
+        for(size_t iseg = 0; iseg < path.size(); ++iseg)
+        {
+            CompiledPath::Segment const& seg = path[iseg];
+            size_t ch = m_trie[node].first_child, last = yml::NONE;
+            for( ; ch != yml::NONE; last = ch, ch = m_trie[ch].next_sibling)
+            {
+                CompiledPath::Segment const& other = m_trie[ch].segment;
+                if(other.index == seg.index && other.hash == seg.hash && other.key == seg.key)
+                    break;
+            }
+            if(ch == yml::NONE)
+            {
+                // keep the trie nodes in the order of the fields
+                C4_ASSERT(m_trie_size < m_trie_capacity);
+                ch = m_trie_size++;
+                m_trie[ch] = TrieNode{seg, yml::NONE, yml::NONE, yml::NONE};
+                if(last != yml::NONE)
+                    m_trie[last].next_sibling = ch;
+                else
+                    m_trie[node].first_child = ch;
+            }
+            node = ch;
+        }
+        C4_CHECK_MSG(m_trie[node].field == yml::NONE, "field path bound twice: %.*s", (int)fields[i].path.len, fields[i].path.str);
+        m_trie[node].field = i;
+    }
+}
+
+Binding::~Binding()
+{
+    if(m_trie)
+        m_callbacks.m_free(m_trie, sizeof(TrieNode) * m_trie_capacity, m_callbacks.m_user_data);
+}
+
+size_t Binding::_bind(Tree const& t, void *obj, size_t start) const
+{
+    if(start == yml::NONE)
+    {
+        if(!t.size())
+            return 0;
+        start = t.root_id();
+    }
+    return _bind_node(t, start, 0, obj);
+}
+
+size_t Binding::_bind_node(Tree const& t, size_t node, size_t trie_node, void *obj) const
+{
+    TrieNode const& tn = m_trie[trie_node];
+    size_t count = 0;
+    if(tn.field != yml::NONE)
+    {
+        m_fields[tn.field].read(t.cref(node), obj);
+        ++count;
+    }
+    if(tn.first_child == yml::NONE || !t.is_container(node))
+        return count;
+    const bool is_map = t.is_map(node);
+    size_t pos = 0;
+    for(size_t ch = t.first_child(node); ch != yml::NONE; ch = t.next_sibling(ch), ++pos)
+    {
+        // hash the key only once, and only if needed
+        uint64_t hash = 0;
+        bool hashed = false;
+        for(size_t tch = tn.first_child; tch != yml::NONE; tch = m_trie[tch].next_sibling)
+        {
+            CompiledPath::Segment const& seg = m_trie[tch].segment;
+            if(seg.is_index())
+            {
+                if(seg.index != pos)
+                    continue;
+            }
+            else
+            {
+                if(!is_map)
+                    continue;
+                csubstr key = t.key(ch);
+                if(!hashed)
+                {
+                    hash = fnv1a(fnv1a_basis, key.str, key.len);
+                    hashed = true;
+                }
+                if(hash != seg.hash || key != seg.key)
+                    continue;
+            }
+            count += _bind_node(t, ch, tch, obj);
+            break;
+        }
+    }
+    return count;
+}
+
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+namespace {
+// the hash of a path is chained from the hashes of its segments
+inline uint64_t path_hash(uint64_t parent_hash, uint64_t segment_hash)
 {
-    size_t arena_cap = m_output->arena_capacity();
-    size_t arena_req = arena_cap + sz;
-    _dbg("reserving arena: " << sz << "B: " << arena_cap << "B-->" << arena_req << "B");
-    m_output->reserve_arena(arena_req);
+    return fnv1a(parent_hash, &segment_hash, sizeof(segment_hash));
 }
+} // namespace
 
-void Workspace::prepare_add_dir(csubstr tree_path, const char *dirname)
+PathIndex::PathIndex(yml::Callbacks const& cb)
+    : m_tree(nullptr)
+    , m_root(yml::NONE)
+    , m_table(nullptr)
+    , m_capacity(0)
+    , m_size(0)
+    , m_positions(nullptr)
+    , m_num_positions(0)
+    , m_callbacks(cb)
 {
-    if(tree_path.not_empty()) { _dbg("preparing add directory: " << tree_path << "=" << dirname); }
-    else { _dbg("preparing add directory to root: " << dirname); }
-    C4_CHECK(!m_load_started);
-    auto noop = [](fs::VisitedFile const&){ return 0; };
-    // ensure the scratch has enough space for all the existing
-    // filenames in the dir
-    if(!m_dir_scratch.required_size)
-        m_dir_scratch.required_size = 256;
-    bool ok;
-    do
-    {
-        _ensure(&m_dir_scratch);
-        ok = c4::fs::walk_entries(dirname, noop, &m_dir_scratch, this);
-    } while(!m_dir_scratch.valid());
-    C4_CHECK(ok);
-    // now prepare for each file in the dir
-    auto file_visitor = [](fs::VisitedFile const& vf){
-        ((Workspace *)vf.user_data)->prepare_add_file(vf.name);
-        return 0;
-    };
-    ok = c4::fs::walk_entries(dirname, file_visitor, &m_dir_scratch, this);
-    C4_CHECK(ok);
-    // accomodate also the directory name
-    _reserve_arena(tree_path.len + 2u + strlen(dirname));
 }
 
-void Workspace::prepare_add_dir(const char *dirname)
+PathIndex::PathIndex(Tree const& t, size_t start, yml::Callbacks const& cb)
+    : PathIndex(cb)
 {
-    prepare_add_dir("", dirname);
+    build(t, start);
 }
 
-void Workspace::prepare_add_file(csubstr tree_path, const char *filename)
+PathIndex::~PathIndex()
 {
-    if(tree_path.not_empty()) { _dbg("preparing add file: " << tree_path << "=" << filename); }
-    else { _dbg("preparing add file to root: " << filename); }
-    C4_CHECK(!m_load_started);
-    _reserve_arena(tree_path.len + 2u + strlen(filename) + 2u + fs::file_size(filename));
+    if(m_table)
+        m_callbacks.m_free(m_table, sizeof(Entry) * m_capacity, m_callbacks.m_user_data);
+    if(m_positions)
+        m_callbacks.m_free(m_positions, sizeof(size_t) * m_num_positions, m_callbacks.m_user_data);
 }
 
-void Workspace::prepare_add_file(const char *filename)
+void PathIndex::clear()
 {
-    prepare_add_file("", filename);
+    for(size_t i = 0; i < m_capacity; ++i)
+        m_table[i].node = yml::NONE;
+    m_size = 0;
+    m_tree = nullptr;
+    m_root = yml::NONE;
 }
 
-void Workspace::prepare_add_conf(csubstr tree_path, csubstr conf_yml)
+void PathIndex::build(Tree const& t, size_t start)
 {
-    C4_CHECK(!m_load_started);
-    _reserve_arena(tree_path.len + 2u + conf_yml.len);
+    clear();
+    if(!t.size())
+        return;
+    // keep the load factor at or below 1/2
+    size_t capacity = 16u;
+    while(capacity < 2u * t.size())
+        capacity <<= 1u;
+    if(capacity > m_capacity)
+    {
+        if(m_table)
+            m_callbacks.m_free(m_table, sizeof(Entry) * m_capacity, m_callbacks.m_user_data);
+        m_table = (Entry*) m_callbacks.m_allocate(sizeof(Entry) * capacity, nullptr, m_callbacks.m_user_data);
+        m_capacity = capacity;
+        clear();
+    }
+    if(t.capacity() > m_num_positions)
+    {
+        if(m_positions)
+            m_callbacks.m_free(m_positions, sizeof(size_t) * m_num_positions, m_callbacks.m_user_data);
+        m_positions = (size_t*) m_callbacks.m_allocate(sizeof(size_t) * t.capacity(), nullptr, m_callbacks.m_user_data);
+        m_num_positions = t.capacity();
+    }
+    m_tree = &t;
+    m_root = start != yml::NONE ? start : t.root_id();
+    m_positions[m_root] = 0;
+    _insert(fnv1a_basis, m_root);
+    _index_children(m_root, fnv1a_basis);
 }
 
-void Workspace::prepare_add_conf(csubstr tree_path_eq_conf_yml)
+void PathIndex::_index_children(size_t node, uint64_t hash)
 {
-    auto specs = path_eq_yml(tree_path_eq_conf_yml);
-    prepare_add_conf(specs.tree_path, specs.yml);
+    Tree const& t = *m_tree;
+    const bool is_map = t.is_map(node);
+    size_t pos = 0;
+    for(size_t ch = t.first_child(node); ch != yml::NONE; ch = t.next_sibling(ch), ++pos)
+    {
+        uint64_t seghash;
+        if(is_map)
+        {
+            csubstr key = t.key(ch);
+            seghash = fnv1a(fnv1a_basis, key.str, key.len);
+        }
+        else
+        {
+            seghash = fnv1a(fnv1a_basis, &pos, sizeof(pos));
+        }
+        const uint64_t chhash = path_hash(hash, seghash);
+        m_positions[ch] = pos;
+        _insert(chhash, ch);
+        if(t.has_children(ch))
+            _index_children(ch, chhash);
+    }
 }
 
-void Workspace::_parse_yml(csubstr filename, substr yml)
+void PathIndex::_insert(uint64_t hash, size_t node)
 {
-    // ensure the conf yml is already in the destination tree
-    C4_CHECK(yml.is_sub(m_output->arena()));
-    C4_CHECK(!yml.is_sub(m_ws->arena()));
-    m_ws->clear(); // does not clear the arena
-    m_ws->clear_arena();
-    yml::parse_in_place(filename, yml, m_ws);
+    C4_ASSERT(m_size < m_capacity);
+    const size_t mask = m_capacity - 1u;
+    size_t slot = (size_t)hash & mask;
+    while(m_table[slot].node != yml::NONE)
+        slot = (slot + 1u) & mask;
+    m_table[slot] = Entry{hash, node};
+    ++m_size;
 }
 
-void Workspace::_parse_yml(csubstr filename, csubstr yml)
+template<class Verify>
+size_t PathIndex::_find(uint64_t hash, Verify &&verify) const
 {
-    if(yml.is_sub(m_output->arena()))
-    {
-        substr arena = m_output->arena();
-        size_t pos = (size_t)(yml.str - arena.str);
-        substr yml_copy = arena.sub(pos, yml.len);
-        C4_ASSERT(yml_copy.str == yml.str);
-        C4_ASSERT(yml_copy.len == yml.len);
-        _parse_yml(filename, yml_copy);
-    }
-    else
+    if(!m_size)
+        return yml::NONE;
+    const size_t mask = m_capacity - 1u;
+    for(size_t slot = (size_t)hash & mask; m_table[slot].node != yml::NONE; slot = (slot + 1u) & mask)
     {
-        substr yml_copy = _alloc_arena(yml.len);
-        size_t used = c4::cat(yml_copy, yml);
-        C4_CHECK(used == yml.len);
-        _parse_yml(filename, yml_copy);
+        // different paths may have the same hash
+        if(m_table[slot].hash == hash && verify(m_table[slot].node))
+            return m_table[slot].node;
     }
+    return yml::NONE;
 }
 
-// ensure root is not a doc
-void Workspace::_remdoc(yml::Tree *t)
+/** check the last segment of the path against the node, and move up
+ * to its parent */
+bool PathIndex::_matches(size_t *node, CompiledPath::Segment const& seg) const
 {
-    C4_CHECK(!t->is_stream(t->root_id()));
-    t->_rem_flags(t->root_id(), c4::yml::DOC);
+    if(*node == m_root)
+        return false;
+    const size_t parent = m_tree->parent(*node);
+    bool ok;
+    if(seg.is_index())
+        ok = m_tree->is_seq(parent) && m_positions[*node] == seg.index;
+    else
+        ok = m_tree->is_map(parent) && m_tree->key(*node) == seg.key;
+    *node = parent;
+    return ok;
 }
 
-// ensure root has a key
-void Workspace::_askeyx(yml::Tree *t, csubstr key)
+size_t PathIndex::find(CompiledPath const& path) const
 {
-    size_t root = t->root_id();
-    C4_CHECK(!t->has_key(root));
-    C4_CHECK(t->is_val(root) || t->has_children(root));
-    C4_CHECK(!t->has_other_siblings(root));
-    yml::NodeData *C4_RESTRICT old_data = t->_p(root);
-    yml::NodeData saved = *old_data;
-    old_data->m_type = yml::MAP;
-    if(saved.m_type.is_doc())
-        if(saved.m_type.is_val())
-            saved.m_type = saved.m_type & ~yml::DOC;
-    size_t newid = t->append_child(root);
-    yml::NodeData *C4_RESTRICT new_data = t->_p(newid);
-    *new_data = saved;
-    new_data->m_type = new_data->m_type | yml::KEY;
-    new_data->m_key.scalar = key;
-    new_data->m_parent = root;
-    old_data->m_first_child = newid;
-    old_data->m_last_child = newid;
-    if(saved.m_last_child != yml::NONE)
-        t->_p(saved.m_last_child)->m_next_sibling = yml::NONE;
-    for(size_t ch = t->first_child(newid); ch != yml::NONE; ch = t->next_sibling(ch))
-    {
-        C4_ASSERT(t->_p(ch)->m_parent == root);
-        t->_p(ch)->m_parent = newid;
-    }
+    uint64_t hash = fnv1a_basis;
+    for(size_t i = 0; i < path.size(); ++i)
+        hash = path_hash(hash, path[i].hash);
+    return _find(hash, [&](size_t node){
+        for(size_t i = path.size(); i > 0; --i)
+            if(!_matches(&node, path[i - 1u]))
+                return false;
+        return node == m_root;
+    });
 }
 
-template<class CharType>
-void Workspace::_add_conf(csubstr filename, csubstr dst_path, basic_substring<CharType> conf_yml)
+size_t PathIndex::find(csubstr path) const
 {
-    auto _setup_yml_as_val = [this, filename](basic_substring<CharType> yml){
-        _parse_yml(filename, yml);
-        _remdoc(m_ws);
-        _dbg("src_tree");_pr(*m_ws);
-        return m_ws->root_id();
-    };
-    auto _setup_yml_as_keyval = [this, filename](csubstr key, basic_substring<CharType> yml){
-        _parse_yml(filename, yml);
-        _askeyx(m_ws, key);
-        _remdoc(m_ws);
-        _dbg("src_tree");_pr(*m_ws);
-        size_t keyconf_node = m_ws->first_child(m_ws->root_id());
-        return keyconf_node;
-    };
-
-    // now find the node where we should insert
-    _dbg("dst_tree"); _pr(*m_output);
-    if(dst_path.empty())
-    {
-        _parse_yml(filename, conf_yml);
-        _dbg("src_tree"); _pr(*m_ws);
-        _dbg("merging at root");
-        m_output->merge_with(m_ws, m_ws->root_id(), m_output->root_id());
-    }
-    else
-    {
-        _dbg("dst_path=" << dst_path);
-        auto result = m_output->lookup_path(dst_path);
-        _dbg("result: resolved='" << result.resolved() << "' vs unresolved='" << result.unresolved() << "'");
-        if( ! result)
-        {
-            _dbg("modifying...");
-            if(dst_path.trimr(" \t").ends_with(']'))
-            {
-                _dbg("no key!");
-                size_t conf_node = _setup_yml_as_val(conf_yml);
-                m_output->lookup_path_or_modify(m_ws, conf_node, dst_path);
-            }
-            else
-            {
-                csubstr res = result.resolved();
-                _dbg("res='" << res << "'");
-                csubstr rem;
-                if(res.empty()) // do not use the ternary operator to expose potential coverage misses
-                {
-                    //C4_ERROR("crl");
-                    rem = _get_root_key(result.unresolved());
-                }
-                else
-                {
-                    rem = _get_leaf_key(result.unresolved());
-                }
-                _dbg("key='" << dst_path << "' rem='" << rem << "'");
-                size_t keyconf_node = _setup_yml_as_keyval(rem, conf_yml);
-                m_output->lookup_path_or_modify(m_ws, keyconf_node, dst_path);
-            }
-        }
-        else
+    path = path.trimr(" \t");
+    uint64_t hash = fnv1a_basis;
+    for_each_segment(path, [&hash](CompiledPath::Segment const& seg){
+        hash = path_hash(hash, seg.hash);
+    });
+    return _find(hash, [&](size_t node){
+        // walk the path backwards, from the node up to the root
+        csubstr rem = path;
+        while(rem.len)
         {
-            _dbg("merging...");
-            // we only have the value of the conf; we need to make it look
-            // like the destination node, so if it needs a key, we need to
-            // add the appropriate key (eg, foo.bar.baz implies key must
-            // be baz)
-            if(!m_output->has_key(result.target))
+            CompiledPath::Segment seg;
+            if(rem.ends_with(']'))
             {
-                // no key is needed, just do it.
-                _dbg("no key!");
-                size_t conf_node = _setup_yml_as_val(conf_yml);
-                m_output->merge_with(m_ws, conf_node, result.target);
+                size_t open = rem.last_of('[');
+                C4_CHECK(open != csubstr::npos);
+                csubstr idx = rem.range(open + 1u, rem.len - 1u).trim(" \t");
+                C4_CHECK(c4::atou(idx, &seg.index));
+                rem = rem.first(open);
             }
             else
             {
-                C4_CHECK(!dst_path.ends_with(']'));
-                // get the appropriate key
-                csubstr rem = _get_leaf_key(dst_path);
-                _dbg("key='" << dst_path << "' rem='" << rem << "'");
-                // ensure we have that key with the conf
-                size_t keyconf_node = _setup_yml_as_keyval(rem, conf_yml);
-                // finally we have the conf ready to merge with the
-                // destination node
-                _dbg("conf=" << keyconf_node << "(" << m_ws->type_str(keyconf_node) << ")" << "\n" << *m_ws);
-                _dbg("conf=\n" << *m_ws);
-                m_output->merge_with(m_ws, keyconf_node, result.target);
+                size_t pos = rem.last_of(".]");
+                seg.index = yml::NONE;
+                seg.key = pos != csubstr::npos ? rem.sub(pos + 1u) : rem;
+                rem = rem.first(pos == csubstr::npos ? 0u : (rem.str[pos] == '.' ? pos : pos + 1u));
             }
+            if(!_matches(&node, seg))
+                return false;
         }
-    }
-    _dbg("outputtree=\n" << *m_output);_pr(*m_output);
+        return node == m_root;
+    });
 }
 
-void Workspace::add_dir(csubstr tree_path, const char *dirname)
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+ConfigSnapshot::ConfigSnapshot(yml::Tree &&tree)
+    : m_tree(std::move(tree))
+    , m_index(m_tree.callbacks())
+    , m_refs(1u)
 {
-    if(tree_path.not_empty()) { _dbg("adding directory: " << tree_path << "=" << dirname); }
-    else { _dbg("adding directory to root: " << dirname); }
+    m_index.build(m_tree);
+}
 
-    m_dir_scratch.required_size = 256;
-    bool ok;
-    do
-    {
-        _ensure(&m_dir_scratch);
-        ok = c4::fs::list_entries(dirname, &m_dir_entry_list, &m_dir_scratch);
-    } while(!m_dir_scratch.valid());
-    C4_CHECK(m_dir_scratch.valid());
-    if(!ok)
+ConfigSnapshot* ConfigSnapshot::create(yml::Tree &&tree)
+{
+    yml::Callbacks const& cb = tree.callbacks();
+    void *mem = cb.m_allocate(sizeof(ConfigSnapshot), nullptr, cb.m_user_data);
+    return new (mem) ConfigSnapshot(std::move(tree));
+}
+
+void ConfigSnapshot::acquire() const noexcept
+{
+    m_refs.fetch_add(1u, std::memory_order_relaxed);
+}
+
+void ConfigSnapshot::release() const noexcept
+{
+    if(m_refs.fetch_sub(1u, std::memory_order_acq_rel) == 1u)
     {
-        _ensure(&m_dir_entry_list.names);
-        _ensure(&m_dir_entry_list.arena);
-        ok = c4::fs::list_entries(dirname, &m_dir_entry_list, &m_dir_scratch);
+        yml::Callbacks cb = m_tree.callbacks();
+        ConfigSnapshot *self = const_cast<ConfigSnapshot*>(this);
+        self->~ConfigSnapshot();
+        cb.m_free(self, sizeof(ConfigSnapshot), cb.m_user_data);
     }
-    C4_CHECK(ok);
-    C4_CHECK(m_dir_entry_list.valid());
-    C4_CHECK(m_dir_scratch.valid());
-    m_dir_entry_list.sort();
-    for(const char *filename : m_dir_entry_list)
+}
+
+
+//-----------------------------------------------------------------------------
+
+ConfigPublisher::ConfigPublisher(size_t num_slots, yml::Callbacks const& cb)
+    : m_current(nullptr)
+    , m_slots(nullptr)
+    , m_slots_buf(nullptr)
+    , m_num_slots(num_slots)
+    , m_callbacks(cb)
+{
+    C4_CHECK(num_slots > 0);
+    // over-allocate, so that the slots can be aligned to the cache line
+    m_slots_buf = m_callbacks.m_allocate(sizeof(HazardSlot) * num_slots + alignof(HazardSlot), nullptr, m_callbacks.m_user_data);
+    m_slots = (HazardSlot*) align_up((char*)m_slots_buf, alignof(HazardSlot));
+    for(size_t i = 0; i < num_slots; ++i)
     {
-        add_file(tree_path, filename);
+        new (m_slots + i) HazardSlot();
+        m_slots[i].snapshot.store(nullptr);
+        m_slots[i].owned.store(0u);
     }
 }
 
-void Workspace::add_dir(const char *dirname)
+ConfigPublisher::~ConfigPublisher()
 {
-    csubstr rootpath = "";
-    add_dir(rootpath, dirname);
+    ConfigSnapshot const* s = m_current.exchange(nullptr);
+    if(s)
+        s->release();
+    m_callbacks.m_free(m_slots_buf, sizeof(HazardSlot) * m_num_slots + alignof(HazardSlot), m_callbacks.m_user_data);
 }
 
-void Workspace::add_file(csubstr tree_path, const char *filename_)
+void ConfigPublisher::publish(yml::Tree &&tree)
 {
-    if(tree_path.not_empty()) { _dbg("adding file: " << tree_path << "=" << filename_); }
-    else { _dbg("adding file to root: " << filename_); }
-    _load_started();
-    C4_CHECK(fs::is_file(filename_));
-    // copy the file contents into the tree arena
-    size_t filesz = fs::file_size(filename_);
-    substr file_contents = _alloc_arena(filesz); // must be substr, not csubstr!
-    size_t actualsz = fs::file_get_contents(filename_, file_contents.str, file_contents.len);
-    C4_CHECK(actualsz == filesz);
-    // now parse the yaml content into the work tree
-    _add_conf(to_csubstr(filename_), tree_path, file_contents);
+    publish(ConfigSnapshot::create(std::move(tree)));
 }
 
-void Workspace::add_file(const char *filename)
+void ConfigPublisher::publish(ConfigSnapshot const* snapshot)
 {
-    csubstr rootpath = "";
-    add_file(rootpath, filename);
+    ConfigSnapshot const* prev = m_current.exchange(snapshot);
+    if(prev)
+        _retire(prev);
 }
 
-void Workspace::add_conf(csubstr path_eq_conf_yml)
+void ConfigPublisher::_retire(ConfigSnapshot const* s)
 {
-    auto specs = path_eq_yml(path_eq_conf_yml);
-    add_conf(specs.tree_path, specs.yml);
+    // the snapshot is no longer current, so no new read can protect
+    // it; wait for the reads in progress
+    for(size_t i = 0; i < m_num_slots; ++i)
+        while(m_slots[i].snapshot.load() == s)
+            std::this_thread::yield();
+    s->release();
 }
 
-void Workspace::add_conf(csubstr dst_path, csubstr conf_yml)
+ConfigPublisher::HazardSlot* ConfigPublisher::_claim_slot() const
 {
-    _load_started();
-    _add_conf("", dst_path, conf_yml);
+    const size_t start = std::hash<std::thread::id>()(std::this_thread::get_id()) % m_num_slots;
+    for(size_t i = start; ; i = (i + 1u) % m_num_slots)
+    {
+        HazardSlot *slot = &m_slots[i];
+        uint32_t expected = 0u;
+        if(slot->owned.load(std::memory_order_relaxed) == 0u
+           && slot->owned.compare_exchange_strong(expected, 1u, std::memory_order_acquire))
+            return slot;
+        if((i + 1u) % m_num_slots == start)
+            std::this_thread::yield(); // every slot is busy
+    }
 }
 
-void Workspace::apply_opts(ParsedOpt const* args_, size_t num_args)
+ConfigPublisher::ReadGuard ConfigPublisher::read() const
 {
-    // prepare everything first
-    ParsedOpt const* C4_RESTRICT args = args_;
-    for(size_t iarg = 0; iarg < num_args; ++iarg)
+    HazardSlot *slot = _claim_slot();
+    ConfigSnapshot const* s = m_current.load();
+    while(true)
     {
-        ParsedOpt const& arg = args[iarg];
-        switch(arg.action)
-        {
-        case ConfigAction::set_node:
-            prepare_add_conf(arg.target, arg.payload);
-            break;
-        case ConfigAction::load_file:
-            C4_ASSERT(strlen(arg.payload.data()) == arg.payload.len);
-            prepare_add_file(arg.target, arg.payload.data());
-            break;
-        case ConfigAction::load_dir:
-            C4_ASSERT(strlen(arg.payload.data()) == arg.payload.len);
-            prepare_add_dir(arg.target, arg.payload.data());
-            break;
-        case ConfigAction::callback:
+        slot->snapshot.store(s);
+        // if it is still current, then publish() will see the slot
+        // before retiring it
+        ConfigSnapshot const* again = m_current.load();
+        if(again == s)
             break;
-        default:
-            C4_ERROR("unknown action");
-        }
+        s = again;
     }
-    // now we can apply
-    for(size_t iarg = 0; iarg < num_args; ++iarg)
+    return ReadGuard(slot, s);
+}
+
+ConfigPublisher::ReadGuard::~ReadGuard()
+{
+    if(m_slot)
     {
-        ParsedOpt const& arg = args[iarg];
-        switch(arg.action)
-        {
-        case ConfigAction::set_node:
-            add_conf(arg.target, arg.payload);
-            break;
-        case ConfigAction::load_file:
-            add_file(arg.target, arg.payload.data());
-            break;
-        case ConfigAction::load_dir:
-            add_dir(arg.target, arg.payload.data());
-            break;
-        case ConfigAction::callback:
-            arg.callback(*m_output, arg.payload);
-            break;
-        default:
-            C4_ERROR("unknown action");
-        }
+        m_slot->snapshot.store(nullptr, std::memory_order_release);
+        m_slot->owned.store(0u, std::memory_order_release);
     }
 }
 
+SnapshotRef ConfigPublisher::acquire() const
+{
+    ReadGuard guard = read();
+    if(guard)
+        guard->acquire();
+    return SnapshotRef(guard.get());
+}
 
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
 
+OptionTable::OptionTable(ConfigActionSpec const* specs, size_t num_specs, yml::Callbacks const& cb)
+    : OptionTable(specs, num_specs, nullptr, nullptr, cb)
+{
+}
+
+OptionTable::OptionTable(ConfigActionSpec const* specs, size_t num_specs,
+                         uint64_t const* short_hashes, uint64_t const* long_hashes,
+                         yml::Callbacks const& cb)
+    : m_specs(specs)
+    , m_num_specs(num_specs)
+    , m_table(nullptr)
+    , m_capacity(detail::cx_table_capacity(num_specs))
+    , m_owns_table(true)
+    , m_callbacks(cb)
+{
+    // the layout must be the same as detail::cx_slots_fill()
+    Entry *table = (Entry*) m_callbacks.m_allocate(sizeof(Entry) * m_capacity, nullptr, m_callbacks.m_user_data);
+    for(size_t i = 0; i < m_capacity; ++i)
+        new (table + i) Entry{0, {}, nullptr};
+    m_table = table;
+    const size_t mask = m_capacity - 1u;
+    // the hashes must be the same as detail::cx_hash()
+    auto insert = [&](csubstr name, uint64_t const* hashes, ConfigActionSpec const* spec){
+        if(name.empty())
+            return;
+        const uint64_t hash = hashes ? hashes[spec - specs] : fnv1a(fnv1a_basis, name.str, name.len);
+        C4_ASSERT(hash == fnv1a(fnv1a_basis, name.str, name.len));
+        size_t slot = (size_t)hash & mask;
+        for( ; table[slot].spec; slot = (slot + 1u) & mask)
+            if(table[slot].hash == hash && table[slot].name == name)
+                return; // the first spec wins
+        table[slot] = Entry{hash, name, spec};
+    };
+    for(size_t i = 0; i < num_specs; ++i)
+    {
+        insert(specs[i].optshort, short_hashes, specs + i);
+        insert(specs[i].optlong, long_hashes, specs + i);
+    }
+}
+
+OptionTable::~OptionTable()
+{
+    if(m_owns_table)
+        m_callbacks.m_free(const_cast<Entry*>(m_table), sizeof(Entry) * m_capacity, m_callbacks.m_user_data);
+}
+
+ConfigActionSpec const* OptionTable::find(csubstr arg) const
+{
+    if(arg.empty())
+        return nullptr;
+    const uint64_t hash = fnv1a(fnv1a_basis, arg.str, arg.len);
+    const size_t mask = m_capacity - 1u;
+    for(size_t slot = (size_t)hash & mask; m_table[slot].spec; slot = (slot + 1u) & mask)
+        if(m_table[slot].hash == hash && m_table[slot].name == arg)
+            return m_table[slot].spec;
+    return nullptr;
+}
+
+
+//-----------------------------------------------------------------------------
+
 size_t parse_opts(int *argc, char ***argv,
                   ConfigActionSpec const* specs, size_t num_specs,
                   ParsedOpt *opt_args, size_t opt_args_size)
 {
-    auto getspec = [specs, num_specs](csubstr a) -> ConfigActionSpec const* {
-        for(size_t ispec = 0; ispec < num_specs; ++ispec)
-            if(specs[ispec].matches(a))
-                return specs + ispec;
-        return nullptr;
-    };
+    OptionTable table(specs, num_specs);
+    return parse_opts(argc, argv, table, opt_args, opt_args_size);
+}
+
+size_t parse_opts(int *argc, char ***argv,
+                  OptionTable const& table,
+                  ParsedOpt *opt_args, size_t opt_args_size)
+{
     auto getarg = [&argc, &argv](int i) -> csubstr { C4_CHECK(i < *argc); return to_csubstr((*argv)[i]); };
     auto check_next_arg = [&](int iarg) -> bool {
         _dbg("arg[" << iarg << "]: expect one more argument");
@@ -509,90 +3512,80 @@ size_t parse_opts(int *argc, char ***argv,
         }
         return true;
     };
+    // the consumed arguments are only removed at the end: if there
+    // is an error or the output buffer size is insufficient, the
+    // input arguments buffer must not change
+    ScopedArray<uint64_t> consumed(table.m_callbacks, ((size_t)*argc + 63u) / 64u);
+    auto consume = [&consumed](int iarg) { consumed[(size_t)iarg / 64u] |= uint64_t(1) << ((size_t)iarg % 64u); };
+    auto is_consumed = [&consumed](int iarg) { return (consumed[(size_t)iarg / 64u] & (uint64_t(1) << ((size_t)iarg % 64u))) != 0; };
     size_t num_opt_args = 0;
-    // if the output buffer size is insufficient, just report the
-    // needed size, and do not change the input arguments buffer
     for(int iarg = 0; iarg < *argc; ++iarg)
     {
-        ConfigActionSpec const* spec = getspec(getarg(iarg));
+        ConfigActionSpec const* spec = table.find(getarg(iarg));
         if(!spec)
+        {
+            _dbg("arg[" << iarg << "]=" << getarg(iarg) << ": no spec found");
             continue;
+        }
         _dbg("arg[" << iarg << "]=" << getarg(iarg) << ": found spec: " << spec->optshort << "/" << spec->optlong);
+        // write the option only if it fits, but keep going to
+        // report the needed size, and to report argerror ASAP
+        ParsedOpt *opt = num_opt_args < opt_args_size ? opt_args + num_opt_args : nullptr;
         ++num_opt_args;
-        // but report argerror ASAP
+        consume(iarg);
         switch(spec->action)
         {
         case ConfigAction::load_file:
         case ConfigAction::load_dir:
+        case ConfigAction::load_dir_recursive:
         case ConfigAction::set_node:
+        {
             if(!check_next_arg(iarg))
                 return argerror;
-            ++iarg;
+            consume(++iarg);
+            if(opt)
+            {
+                maybe_path_eq_yml parsed_spec(getarg(iarg));
+                opt->action = spec->action;
+                opt->target = parsed_spec.tree_path;
+                opt->payload = parsed_spec.yml;
+                opt->callback = spec->callback;
+            }
             break;
+        }
         case ConfigAction::callback:
         {
-            if(get_optional_arg(iarg, spec, nullptr))
-                ++iarg;
+            csubstr payload = {};
+            if(get_optional_arg(iarg, spec, &payload))
+                consume(++iarg);
+            if(opt)
+            {
+                opt->action = spec->action;
+                opt->target = {};
+                opt->payload = payload;
+                opt->callback = spec->callback;
+            }
             break;
         }
         default:
             C4_ERROR("unknown action");
         }
     }
-    // now we know the arguments are sane
     if(num_opt_args > opt_args_size)
     {
         _dbg("require " << num_opt_args << " args, but space only for " << opt_args_size);
         return num_opt_args;
     }
-    // ok, now we know we have enough size
-    num_opt_args = 0;
+    // now we know the arguments are sane and fit in the output
     int filtered_argc = 0;
-    for(int iarg = 0; iarg < *argc; /*do nothing here*/)
+    for(int iarg = 0; iarg < *argc; ++iarg)
     {
-        ConfigActionSpec const* spec = getspec(getarg(iarg));
-        if(!spec)
-        {
-            _dbg("arg[" << iarg << "]=" << getarg(iarg) << ": no spec found");
-            C4_ASSERT(filtered_argc <= iarg);
-            if(filtered_argc != iarg)
-                (*argv)[filtered_argc] = (*argv)[iarg];
-            ++filtered_argc;
-            ++iarg;
+        if(is_consumed(iarg))
             continue;
-        }
-        _dbg("arg[" << iarg << "]=" << getarg(iarg) << ": found spec: " << spec->optshort << "/" << spec->optlong);
-        switch(spec->action)
-        {
-        case ConfigAction::load_file:
-        case ConfigAction::load_dir:
-        case ConfigAction::set_node:
-        {
-            C4_ASSERT(check_next_arg(iarg));
-            C4_ASSERT(opt_args && num_opt_args < opt_args_size);
-            maybe_path_eq_yml parsed_spec(getarg(iarg + 1));
-            opt_args[num_opt_args].action = spec->action;
-            opt_args[num_opt_args].target = parsed_spec.tree_path;
-            opt_args[num_opt_args].payload = parsed_spec.yml;
-            opt_args[num_opt_args].callback = spec->callback;
-            iarg += 2;
-            break;
-        }
-        case ConfigAction::callback:
-        {
-            C4_ASSERT(opt_args && num_opt_args < opt_args_size);
-            opt_args[num_opt_args].action = spec->action;
-            opt_args[num_opt_args].target = {};
-            opt_args[num_opt_args].payload = {};
-            opt_args[num_opt_args].callback = spec->callback;
-            bool needs_arg = get_optional_arg(iarg, spec, &opt_args[num_opt_args].payload);
-            iarg += 1 + needs_arg;
-            break;
-        }
-        default:
-            C4_ERROR("unknown action");
-        }
-        ++num_opt_args;
+        C4_ASSERT(filtered_argc <= iarg);
+        if(filtered_argc != iarg)
+            (*argv)[filtered_argc] = (*argv)[iarg];
+        ++filtered_argc;
     }
     _dbg("require " << num_opt_args);
     for(int iarg = filtered_argc; iarg < *argc; ++iarg)
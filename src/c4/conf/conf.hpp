@@ -4,7 +4,10 @@
 #include "c4/language.hpp"
 #include <c4/yml/yml.hpp>
 #include <c4/fs/fs.hpp>
+#include <atomic>
+#include <cstdio>
 #include <type_traits>
+#include <utility>
 
 
 
@@ -24,15 +27,193 @@ C4_SUPPRESS_WARNING_GCC_CLANG("-Wold-style-cast")
 
 struct ParsedOpt;
 
+/** Flags to control how a Workspace loads its inputs. */
+typedef enum : uint32_t {
+    /** the default behavior: file contents are copied whole into the
+     * arena of the output tree before being parsed. */
+    WS_DEFAULT = 0u,
+    /** Memory-map files instead of reading them into the output arena.
+     * Files are mapped privately and parsed in place; after merging,
+     * only the strings which survived into the output tree are copied
+     * into its arena. Falls back to the default behavior on platforms
+     * without mmap(), or for empty files. */
+    WS_MMAP_FILES = 1u << 0u,
+    /** Parse the files of a directory in parallel, each into its own
+     * tree, using up to @ref Workspace::m_num_threads threads. The
+     * parsed trees are then merged in the usual alphabetical order,
+     * so the result is the same as when loading serially. Note that
+     * the tree callbacks will then be called from several threads. */
+    WS_PARALLEL_DIRS = 1u << 1u,
+    /** Do not merge each input into the output as soon as it is
+     * added. Instead, parse each input into its own tree, and merge
+     * all the pending trees at once with Workspace::merge_pending():
+     * consecutive inputs with the same destination are merged in a
+     * single pass, which walks all their trees simultaneously and
+     * writes each output node only once. apply_opts() merges before
+     * each callback and at the end; when calling the add methods
+     * directly, merge_pending() must be called afterwards. With this
+     * flag, files are always copied to the output arena (ie,
+     * @ref WS_MMAP_FILES is ignored). */
+    WS_DEFERRED_MERGE = 1u << 2u,
+} WorkspaceFlags_e;
+
+/** A tree path such as `foo.bar[3].baz`, tokenized once so that it
+ * can be resolved many times. Keys in the path are not copied: the
+ * path string must outlive this object, and also the trees where
+ * nodes are created with lookup_or_modify(), because the keys of
+ * the created nodes point into it. */
+struct CompiledPath
+{
+    struct Segment
+    {
+        csubstr  key;   //!< the map key; empty for seq indices
+        size_t   index; //!< the seq index, or NONE for map keys
+        uint64_t hash;  //!< hash of the key, or of the index
+        bool is_index() const noexcept { return index != yml::NONE; }
+    };
+
+    CompiledPath(yml::Callbacks const& cb=yml::get_callbacks());
+    CompiledPath(csubstr path, yml::Callbacks const& cb=yml::get_callbacks());
+    ~CompiledPath();
+
+    CompiledPath(CompiledPath const&) = delete;
+    CompiledPath& operator= (CompiledPath const&) = delete;
+    CompiledPath(CompiledPath &&that) noexcept;
+    CompiledPath& operator= (CompiledPath &&that) noexcept;
+
+    /** tokenize the path, reusing the existing segment buffer */
+    void compile(csubstr path);
+
+    csubstr path() const noexcept { return m_path; }
+    bool empty() const noexcept { return m_num_segments == 0; }
+    size_t size() const noexcept { return m_num_segments; }
+    Segment const& operator[] (size_t i) const noexcept { C4_ASSERT(i < m_num_segments); return m_segments[i]; }
+    Segment const& back() const noexcept { C4_ASSERT(m_num_segments); return m_segments[m_num_segments - 1u]; }
+
+    /** find the node at this path, starting at @p start (or at the
+     * root). Nothing is created.
+     * @return the node, or NONE if it does not exist */
+    size_t lookup(Tree const& t, size_t start=yml::NONE) const;
+    /** find the node at this path, starting at @p start (or at the
+     * root), creating any missing nodes along the way, in a single
+     * traversal. Missing seq entries before an index are created as
+     * null vals, and vals are turned into containers as needed. */
+    size_t lookup_or_modify(Tree *t, size_t start=yml::NONE) const;
+
+public:
+
+    csubstr        m_path;
+    Segment *      m_segments;
+    size_t         m_num_segments;
+    size_t         m_capacity;
+    yml::Callbacks m_callbacks;
+
+private:
+
+    void _free();
+};
+
+/** The phases of loading, reported to Workspace::m_trace */
+enum class TracePhase : uint32_t
+{
+    prepare, //!< preparing all the options in apply_opts()
+    layer,   //!< applying one option in apply_opts(); the name is its payload
+    list,    //!< listing a directory; the name is the directory
+    stat,    //!< getting the size of files; the name is the file or directory
+    read,    //!< reading or mapping a file; the name is the file
+    parse,   //!< parsing a file or conf; the name is the file, if any, or the directory parsed in parallel
+    lookup,  //!< resolving the destination path in the output tree
+    merge,   //!< merging into the output tree; the name is the destination path
+    cache,   //!< loading or saving a cached result; the name is the cache file
+};
+
+/** get the name of a trace phase */
+const char* trace_phase_str(TracePhase phase) noexcept;
+
+/** An event reported to Workspace::m_trace */
+struct TraceEvent
+{
+    TracePhase phase;
+    bool       begin;   //!< true at the start of the phase, false at its end
+    uint64_t   time_ns; //!< a steady clock timestamp, in nanoseconds
+    csubstr    name;    //!< see TracePhase
+};
+
+using pfn_trace = void (*)(TraceEvent const& event, void *user_data);
+
+/** How the memory of a tree is used */
+struct TreeMemory
+{
+    size_t node_capacity;    //!< the number of nodes allocated
+    size_t node_size;        //!< the number of live nodes
+    size_t node_bytes;       //!< the bytes allocated for the nodes
+    size_t arena_capacity;   //!< the bytes reserved for the arena
+    size_t arena_size;       //!< the bytes used in the arena
+    /** the bytes of the arena referenced by the keys, vals, tags and
+     * anchors of live nodes. Shared or overlapping strings are
+     * counted once. The difference to @ref arena_size is dead text,
+     * eg from overridden values. */
+    size_t arena_referenced;
+    /** the total bytes allocated by the tree */
+    size_t total() const { return node_bytes + arena_capacity; }
+};
+
+/** get the memory usage of a tree. This visits every node. */
+TreeMemory tree_memory(Tree const& t);
+
+/** Rebuild the arena of a tree with only the strings referenced by
+ * its live nodes, and re-point the nodes to it. The new arena has
+ * exactly the size of those strings; strings outside the arena are
+ * not touched. This invalidates any pointers into the old arena.
+ * @return the number of arena bytes released */
+size_t compact_arena(Tree *t);
+
+/** The order of the nodes after reorder_nodes() */
+enum class NodeOrder
+{
+    depth_first,   //!< each node is followed by its descendants; good for full traversals
+    breadth_first, //!< the children of each node are contiguous; good for iterating siblings
+};
+
+/** Renumber the live nodes of a tree so that they are contiguous in
+ * the node array, in the given order, with the root first. The free
+ * nodes are moved after them. This invalidates any node ids held
+ * for the tree, eg in a PathIndex. */
+void reorder_nodes(Tree *t, NodeOrder order=NodeOrder::depth_first);
+
+/** How the memory of a Workspace is used. See Workspace::memory_report(). */
+struct MemoryReport
+{
+    TreeMemory output;     //!< the output tree
+    TreeMemory workspace;  //!< the workspace tree
+    TreeMemory layers;     //!< the sum over the layer trees, used for parallel and deferred loads
+    size_t     num_layers; //!< the number of layer trees
+    size_t     dir_scratch_bytes;    //!< the scratch used to list directories
+    size_t     dir_entry_list_bytes; //!< the names and name arena of the directory entry list
+    size_t     manifest_bytes;       //!< the directory manifests, their files and names
+    size_t     merge_scratch_bytes;  //!< the pending inputs and the merge scratch
+    size_t     path_bytes;           //!< the segments of the scratch compiled path
+    /** the total bytes allocated, excluding the output tree */
+    size_t total_workspace() const
+    {
+        return workspace.total() + layers.total() + dir_scratch_bytes + dir_entry_list_bytes
+            + manifest_bytes + merge_scratch_bytes + path_bytes;
+    }
+};
+
 /** The main structure to create the configuration. */
 struct Workspace
 {
     /** @p output the output directory
      * @p workspace @p workspace is null, default to the tree from this
-     * workspace */
-    Workspace(yml::Tree *output, yml::Tree *workspace=nullptr);
+     * workspace
+     * @p flags a mask of @ref WorkspaceFlags_e */
+    Workspace(yml::Tree *output, yml::Tree *workspace=nullptr, uint32_t flags=WS_DEFAULT);
     ~Workspace();
 
+    /** Prepare and then apply the given options, in order. When
+     * @ref m_cache_dir is set, the result of the options up to the
+     * first callback is memoized there; see @ref m_cache_dir. */
     void apply_opts(ParsedOpt const* args, size_t num_args);
 
     template<class OptArgContainer>
@@ -42,11 +223,45 @@ struct Workspace
         apply_opts(opt_args.data(), opt_args.size());
     }
 
+    /** Hash the given options and the state of the files they load:
+     * the name, size, modification time and inode of each file, or
+     * its contents where stat() is not available. Directories are
+     * listed with the same manifest used by add_dir(). */
+    uint64_t hash_inputs(ParsedOpt const* args, size_t num_args);
+
+    /** Report how memory is used by the output tree and by this
+     * workspace's trees and buffers. Useful after loading, to size
+     * the trees with reserve(), or to find how much of the output
+     * arena is dead text. */
+    MemoryReport memory_report() const;
+
+    /** Call once done loading, to shed the memory used only while
+     * loading: merge any pending inputs, reorder the nodes of the
+     * output tree (see reorder_nodes()), compact its arena (see
+     * compact_arena()), and release the workspace
+     * tree, the layer trees, the parser and the scratch buffers. The workspace
+     * can still be used afterwards, but any further input must be
+     * prepared again, as the buffers are then allocated anew.
+     * @return the number of bytes released from the output arena */
+    size_t finalize(NodeOrder order=NodeOrder::depth_first);
+
+    /** Prepare this workspace for a new load, dropping the inputs
+     * prepared or pending from the previous one, but keeping the
+     * capacity of the workspace tree, of the layer trees, of the
+     * parser and of the scratch buffers. Reusing a workspace this way
+     * avoids most allocations when loading many configurations.
+     * @p output the output tree for the next load, or null to keep
+     * the current one. It must have the same callbacks as the
+     * current one, as these own the buffers. */
+    void reset(yml::Tree *output=nullptr);
+
     // all the prepare methods need to be called before its
     // corresponding add method
 
     void prepare_add_dir(const char *dirname);
     void prepare_add_dir(csubstr tree_path, const char *filename);
+    void prepare_add_dir_recursive(const char *dirname);
+    void prepare_add_dir_recursive(csubstr tree_path, const char *dirname);
     void prepare_add_file(const char *filename);
     void prepare_add_file(csubstr tree_path, const char *filename);
     void prepare_add_conf(csubstr tree_path_eq_conf_yml);
@@ -54,31 +269,179 @@ struct Workspace
 
     void add_dir(const char *dirname);
     void add_dir(csubstr tree_path, const char *dirname);
+    void add_dir_recursive(const char *dirname);
+    void add_dir_recursive(csubstr tree_path, const char *dirname);
     void add_file(const char *filename);
     void add_file(csubstr tree_path, const char *filename);
     void add_conf(csubstr tree_path_eq_conf_yml);
     void add_conf(csubstr tree_path, csubstr conf_yml);
 
+    /** overloads taking a path compiled once, to be reused across
+     * many calls */
+    void prepare_add_conf(CompiledPath const& tree_path, csubstr conf_yml);
+    void add_conf(CompiledPath const& tree_path, csubstr conf_yml);
+
+    /** like add_conf(), but parse the caller's buffer in place
+     * instead of copying it whole into the output arena: after
+     * merging, only the strings which survived into the output tree
+     * are copied into its arena. The buffer is modified by the
+     * parser, and must stay alive only until this call returns. With
+     * @ref WS_DEFERRED_MERGE, the buffer is copied as in add_conf().
+     * Prepare it with prepare_add_conf(). */
+    void add_conf_in_place(csubstr tree_path, substr conf_yml);
+
+    /** with @ref WS_DEFERRED_MERGE, merge all the inputs added so far
+     * into the output tree. Otherwise, this does nothing. */
+    void merge_pending();
+
+public:
+
+    /** A listing of a directory, captured once (usually by
+     * prepare_add_dir()) and then reused by add_dir(), so that the
+     * directory is read and its files are stat'ed only once. Only
+     * the files passing the filters are listed. */
+    struct DirManifest
+    {
+        size_t dirname;    //!< position of the directory name in m_manifest_names
+        size_t first_file; //!< position of the first file in m_manifest_files
+        size_t num_files;  //!< number of files in the directory
+        bool   recursive;  //!< whether the files in subdirectories are listed
+    };
+    /** A file in a DirManifest */
+    struct DirManifestFile
+    {
+        size_t name; //!< position of the (zero-terminated) file name in m_manifest_names
+        size_t size; //!< size of the file
+    };
+    /** The identity of a directory, to detect symlink loops */
+    struct DirId
+    {
+        uint64_t dev;
+        uint64_t ino;
+    };
+    /** A source node in a merge of several trees */
+    struct MergeSrc
+    {
+        yml::Tree const* tree;
+        size_t node;
+        size_t next; //!< the next source in the same group, or NONE
+        size_t last; //!< the last source in the group started by this one
+        bool   head; //!< whether this source starts a group
+    };
+
 public:
 
     yml::Tree   m_wsbuf; //!< workspace buffer
     yml::Tree * m_ws;    //!< workspace (working tree)
     yml::Tree * m_output;
+    yml::Parser m_parser; //!< used for every input, keeping its buffers across inputs and loads
     bool        m_load_started;
     csubstr     m_arena_when_load_started;
+    /** estimated number of nodes to be added to the output tree,
+     * gathered by the prepare methods. The output tree is reserved
+     * to this size when the load starts. */
+    size_t      m_nodes_estimate;
+    /** bytes to be added to the output arena, gathered by the
+     * prepare methods */
+    size_t      m_arena_estimate;
+    /** estimated number of nodes in the largest single input. The
+     * workspace tree is reserved to this size when the load starts. */
+    size_t      m_ws_nodes_estimate;
+    uint32_t    m_flags; //!< a mask of @ref WorkspaceFlags_e
+    CompiledPath m_path; //!< scratch, to compile the paths passed as strings
+    /** the source buffer currently being merged, when it is not owned
+     * by the output tree (eg a memory-mapped file). Any output string
+     * pointing into it is copied to the output arena after merging. */
+    substr      m_borrowed;
     // these are only needed for directories:
     c4::fs::maybe_buf<char> m_dir_scratch = {};
     c4::fs::EntryList       m_dir_entry_list = {};
+    c4::fs::maybe_buf<DirManifest>     m_manifests = {};
+    c4::fs::maybe_buf<DirManifestFile> m_manifest_files = {};
+    c4::fs::maybe_buf<char>            m_manifest_names = {};
+    c4::fs::maybe_buf<char>            m_dir_path = {}; //!< scratch for listing directories
+    c4::fs::maybe_buf<DirId>           m_dir_ancestors = {}; //!< the directories being listed recursively, to skip symlink loops
+    /** comma-separated glob patterns (eg `*.yml,*.yaml`) of the
+     * names of the files to load from directories; when empty, all
+     * files are loaded. Patterns may use `*` and `?`, and are matched
+     * against the file name, not its path. Set this before
+     * preparing: the filters are applied when listing a directory,
+     * before any of its files is stat'ed or read. */
+    csubstr                 m_dir_include;
+    /** comma-separated glob patterns of the names of the files and
+     * subdirectories to skip when listing directories. */
+    csubstr                 m_dir_exclude;
+    /** the number of threads to use with @ref WS_PARALLEL_DIRS. When
+     * zero, std::thread::hardware_concurrency() is used. */
+    size_t                  m_num_threads;
+    yml::Tree *             m_layer_trees; //!< one tree per file parsed in parallel, or per pending input
+    size_t                  m_num_layer_trees;
+    /** with @ref WS_DEFERRED_MERGE, the destination path of each
+     * input not yet merged. The input is in the layer tree at the
+     * same position. */
+    c4::fs::maybe_buf<csubstr>  m_pending = {};
+    c4::fs::maybe_buf<MergeSrc> m_merge_srcs = {};  //!< scratch for merge_pending()
+    c4::fs::maybe_buf<size_t>   m_merge_table = {}; //!< scratch for merge_pending()
+    /** an existing directory where apply_opts() memoizes its
+     * results, or null to disable memoization. The cache key is a
+     * hash of the initial output tree, of the options up to the
+     * first callback (callbacks are not cacheable), and of the state
+     * of every file they load: its name, size, modification time
+     * and inode, or its contents where stat() is not available. On a
+     * hit, the merged tree is restored from a binary snapshot (see
+     * load_snapshot()) instead of reading and merging the inputs;
+     * only the options after the first callback are then applied. */
+    const char *            m_cache_dir;
+    bool                    m_cache_hit; //!< whether the last apply_opts() was restored from the cache
+    /** whether a file changed size or was removed between being
+     * stat'ed (eg in the prepare phase) and being read, in which
+     * case it was skipped and the output misses its contents.
+     * Cleared by reset(). */
+    bool                    m_inputs_changed;
+    /** when set, called with the begin and end events of each loading
+     * phase (see TracePhase). Phases may be nested; the events are
+     * emitted from the thread calling the workspace. When null, no
+     * timestamps are taken. See also ChromeTraceSink. */
+    pfn_trace               m_trace;
+    void *                  m_trace_data; //!< the user data passed to m_trace
 
 private:
 
+    void _prepare_opts(ParsedOpt const* args, size_t num_args);
+    void _apply_opts(ParsedOpt const* args, size_t num_args);
+    uint64_t _hash_opts(ParsedOpt const* args, size_t num_args);
+
     void _load_started();
     substr _alloc_arena(size_t sz) const;
-    void _reserve_arena(size_t sz) const;
+    void _reserve_arena(size_t sz);
+    void _reserve_nodes(csubstr tree_path, size_t num_nodes);
+
+    void _parse_yml(csubstr filename, substr yml, yml::Tree *t);
+    void _parse_yml(csubstr filename, csubstr yml, yml::Tree *t);
+    template<class CharType> size_t _add_conf(csubstr filename, csubstr dst_path, basic_substring<CharType> yml);
+    template<class CharType> size_t _add_conf(csubstr filename, CompiledPath const& dst_path, basic_substring<CharType> yml);
+    size_t _merge(yml::Tree *src, CompiledPath const& dst_path);
+    yml::Tree* _push_layer(csubstr dst_path);
+    size_t _merge_src_node(yml::Tree *src, size_t doc, CompiledPath const& dst_path, size_t target);
+    void _merge_kway(size_t first_src, size_t num_srcs, size_t dst);
+    void _add_conf_borrowed(csubstr filename, csubstr dst_path, substr yml);
+    void _add_file(csubstr dst_path, const char *filename, size_t filesz);
+    void _add_files_parallel(csubstr dst_path, DirManifest const& manifest);
+    void _prepare_add_file(csubstr dst_path, const char *filename, size_t filesz);
+    bool _read_file(const char *filename, size_t filesz, substr *contents);
 
-    void _parse_yml(csubstr filename, substr yml);
-    void _parse_yml(csubstr filename, csubstr yml);
-    template<class CharType> void _add_conf(csubstr filename, csubstr dst_path, basic_substring<CharType> yml);
+    void _prepare_add_dir(csubstr tree_path, const char *dirname, bool recursive);
+    void _add_dir(csubstr tree_path, const char *dirname, bool recursive);
+    size_t _get_manifest(const char *dirname, bool recursive);
+    size_t _make_manifest(const char *dirname, bool recursive);
+    void _list_files(bool recursive);
+    void _add_manifest_file(csubstr filename);
+    void _stat_files(size_t first_file, size_t num_files);
+    size_t _add_manifest_name(csubstr name);
+    const char* _manifest_name(size_t pos) const { return m_manifest_names.buf + pos; }
+    void _reserve_layer_trees(size_t num_trees);
+    void _unborrow(yml::Tree const* src, size_t src_node, size_t dst_node);
+    void _unborrow(csubstr *s);
 
     template<class T>
     void _ensure(c4::fs::maybe_buf<T> *mb)
@@ -90,6 +453,31 @@ private:
             mb->size = mb->required_size;
         }
     }
+    /** append to the buffer, keeping its existing contents. T must
+     * be trivially copyable. When @p items is null, value-initialized
+     * items are appended. */
+    template<class T>
+    void _append(c4::fs::maybe_buf<T> *mb, T const* items, size_t num)
+    {
+        size_t pos = mb->required_size;
+        mb->required_size += num;
+        if(!mb->valid())
+        {
+            size_t cap = 2u * mb->size;
+            cap = cap > mb->required_size ? cap : mb->required_size;
+            T *buf = (T*) m_output->m_callbacks.m_allocate(sizeof(T) * cap, mb->buf, m_output->m_callbacks.m_user_data);
+            if(pos)
+                memcpy(buf, mb->buf, sizeof(T) * pos);
+            _release(mb);
+            mb->buf = buf;
+            mb->size = cap;
+        }
+        if(items && num)
+            memcpy(mb->buf + pos, items, sizeof(T) * num);
+        else
+            for(size_t i = pos; i < mb->required_size; ++i)
+                mb->buf[i] = T();
+    }
     template<class T>
     void _release(c4::fs::maybe_buf<T> *mb)
     {
@@ -99,8 +487,590 @@ private:
         mb->size = 0;
     }
 
-    static void _remdoc(yml::Tree *t);
-    static void _askeyx(yml::Tree *t, csubstr key);
+    static void _remdoc(yml::Tree *t, size_t doc);
+    static void _askeyx(yml::Tree *t, size_t doc, csubstr key);
+};
+
+
+/** A trace sink writing the events of a workspace in the Chrome
+ * trace event format, which can be viewed in chrome://tracing or in
+ * Perfetto. The events are written as they arrive, and the file is
+ * completed on destruction. Several workspaces may share a sink, as
+ * long as they are not used concurrently. */
+struct ChromeTraceSink
+{
+    ChromeTraceSink(const char *filename);
+    ~ChromeTraceSink();
+
+    ChromeTraceSink(ChromeTraceSink const&) = delete;
+    ChromeTraceSink& operator= (ChromeTraceSink const&) = delete;
+
+    bool valid() const { return m_file != nullptr; }
+
+    /** set the workspace's trace hook to this sink */
+    void attach(Workspace *ws)
+    {
+        ws->m_trace = &ChromeTraceSink::write;
+        ws->m_trace_data = this;
+    }
+
+    /** the trace hook; @p sink is the ChromeTraceSink */
+    static void write(TraceEvent const& event, void *sink);
+
+public:
+
+    std::FILE * m_file;
+    size_t      m_num_events;
+};
+
+
+/** A monotonic memory resource, to be used for a whole load. Memory
+ * is carved from large blocks by bumping a pointer; freeing is a
+ * no-op, and all the blocks are released at once on destruction or
+ * with release(). The output tree of a workspace which is
+ * constructed with callbacks() makes every allocation of the
+ * workspace come from this resource, including the layer trees and
+ * the scratch buffers:
+ *
+ * @code
+ * MonotonicResource res;
+ * {
+ *     yml::Tree output(res.callbacks());
+ *     Workspace ws(&output);
+ *     ...
+ * }
+ * @endcode
+ *
+ * The resource must outlive every tree using it. Since frees are
+ * no-ops, Workspace::finalize() does not return memory to the
+ * system; copy the result to a tree with the default callbacks if
+ * the memory is to be reclaimed before destroying the resource.
+ *
+ * Allocations are thread-safe, so the resource can also be used
+ * with WS_PARALLEL_DIRS. */
+struct MonotonicResource
+{
+    /** @param block_size the size of the first block. Each new block
+     * doubles the size of the previous one.
+     * @param hugepages back the blocks with transparent hugepages:
+     * blocks are rounded to a multiple of the hugepage size, mapped
+     * anonymously, and madvise()d with MADV_HUGEPAGE. Falls back to
+     * @p upstream where this is not available.
+     * @param upstream the callbacks from which blocks are allocated */
+    MonotonicResource(size_t block_size=size_t(1) << 20u, bool hugepages=false, yml::Callbacks const& upstream=yml::get_callbacks());
+    ~MonotonicResource();
+
+    MonotonicResource(MonotonicResource const&) = delete;
+    MonotonicResource& operator= (MonotonicResource const&) = delete;
+
+    /** callbacks allocating from this resource. Errors are reported
+     * with the upstream error callback. */
+    yml::Callbacks callbacks();
+
+    void* allocate(size_t len);
+    /** a no-op, unless @p mem is the most recent allocation, in which
+     * case its memory is reused by the next one */
+    void free(void *mem, size_t len);
+    /** release all the blocks, invalidating every allocation */
+    void release();
+
+    /** the number of bytes obtained from upstream */
+    size_t reserved() const { return m_num_reserved; }
+    /** the number of bytes handed out, ignoring frees */
+    size_t allocated() const { return m_num_allocated; }
+
+public:
+
+    struct Block;
+
+    yml::Callbacks    m_upstream;
+    size_t            m_next_block_size;
+    bool              m_hugepages;
+    Block *           m_blocks;  //!< the most recent block; older blocks are linked from it
+    char *            m_pos;
+    char *            m_end;
+    size_t            m_num_blocks;
+    size_t            m_num_reserved;
+    size_t            m_num_allocated;
+    std::atomic<bool> m_locked;
+};
+
+
+/** Quickly estimate the number of nodes that will result from
+ * parsing the given YAML, without parsing it. This counts lines, flow
+ * entries, flow containers and block indicators, and is an upper
+ * bound meant for reserving tree capacity. */
+size_t estimate_num_nodes(csubstr yml) noexcept;
+
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+/** @name binary snapshots
+ *
+ * A snapshot is a relocatable binary image of a tree, eg of the
+ * output tree once Workspace::apply_opts() is done. It contains the
+ * nodes in depth-first order, with every string stored as an offset
+ * into a single string section. Loading a snapshot requires no YAML
+ * parsing: the string section is copied whole into the arena of the
+ * tree, and the nodes are recreated directly from their records.
+ *
+ * The snapshot header contains the format version, the byte order
+ * and a signature of the node type flags, so that snapshots written
+ * by an incompatible build are rejected when loading. */
+/** @{ */
+
+enum : uint32_t {
+    /** the version of the snapshot format. Snapshots with a different
+     * version are rejected. */
+    snapshot_version = 1u
+};
+
+/** Serialize a tree into a binary snapshot. Nothing is written if
+ * the buffer is too small.
+ *
+ * @return the size needed for the snapshot */
+size_t save_snapshot(Tree const& t, substr buf);
+
+/** Serialize a tree into a binary snapshot file.
+ *
+ * @return false if the file could not be written */
+bool save_snapshot_file(Tree const& t, const char *filename);
+
+/** Replace the contents of a tree with those of a binary snapshot.
+ *
+ * @return false if the snapshot is malformed or was written by an
+ * incompatible build. The snapshot is validated before the tree is
+ * modified, so the tree is then left untouched. */
+bool load_snapshot(csubstr snapshot, Tree *t);
+
+/** Replace the contents of a tree with those of a binary snapshot
+ * file. The file is memory-mapped where possible.
+ *
+ * @return false if the file could not be read, or if the snapshot is
+ * rejected as in load_snapshot() */
+bool load_snapshot_file(const char *filename, Tree *t);
+
+/** @} */
+
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+/** A configuration which can be reloaded when its input files change.
+ *
+ * The options are split into layers: each layer starts at a
+ * load_file, load_dir or load_dir_recursive option, and extends up
+ * to the next one.
+ * Before each layer is applied, a checkpoint of the output tree is
+ * kept. When reloading, only the layers whose inputs changed are
+ * detected, and the output is recomputed starting from the
+ * checkpoint of the first changed layer; the layers before it are
+ * not touched.
+ *
+ * The checkpoints are the memory cost of this: each is a snapshot
+ * (see save_snapshot()) of the output as it was before its layer,
+ * taken after compacting the arena of the output (see
+ * compact_arena()). So each takes about 112 bytes per node plus the
+ * live strings, and with N layers the checkpoints take up to N times
+ * the size of the output. Put the larger inputs in the later layers
+ * to keep this low.
+ *
+ * On Linux, the files and directories of the layers are watched with
+ * inotify, and reload() only checks the layers which had events;
+ * recursive directories are not watched. Elsewhere, reload() stats
+ * the inputs of every layer. In either case, a layer is deemed
+ * changed only when the state of its inputs differs (see
+ * Workspace::hash_inputs()). */
+struct ReloadableConf
+{
+    /** @p output the output tree
+     * @p flags a mask of @ref WorkspaceFlags_e, used for every load */
+    ReloadableConf(yml::Tree *output, uint32_t flags=WS_DEFAULT);
+    ~ReloadableConf();
+
+    ReloadableConf(ReloadableConf const&) = delete;
+    ReloadableConf& operator= (ReloadableConf const&) = delete;
+
+    /** apply the options to the output tree, and start watching
+     * their inputs. The options (and the strings they point at) must
+     * outlive this object. If a file changes while it is being
+     * loaded, the output misses the layers from its own, which are
+     * then recomputed by the next reload(). */
+    void load(ParsedOpt const* args, size_t num_args);
+
+    template<class OptArgContainer>
+    void load(OptArgContainer const& opt_args)
+    {
+        static_assert(std::is_same<typename OptArgContainer::value_type, ParsedOpt>::value, "must be container of OptArg");
+        load(opt_args.data(), opt_args.size());
+    }
+
+    /** recompute the output tree if the inputs of any layer changed.
+     * If the inputs of a changed layer are missing (eg, a file is
+     * being replaced), or if a file changes while it is being
+     * loaded, the output is kept and the reload is deferred to the
+     * next call.
+     *
+     * @return true if the output tree was recomputed */
+    bool reload();
+
+    /** the inotify file descriptor, which becomes readable when
+     * reload() may have work to do; useful with poll(). -1 when
+     * inotify is not available. */
+    int watch_fd() const { return m_watch_fd; }
+
+public:
+
+    struct Layer
+    {
+        size_t    first_opt;  //!< the option starting this layer
+        size_t    end_opt;    //!< one past the last option of this layer
+        uint64_t  signature;  //!< the hash of the state of the layer's inputs
+        int       watch;      //!< the inotify watch descriptor, or -1
+        bool      changed;    //!< whether there were events for this layer
+        substr    checkpoint; //!< a snapshot of the output tree before this layer was applied
+        size_t    checkpoint_capacity; //!< the size of the buffer of the checkpoint
+    };
+
+public:
+
+    yml::Tree *      m_output;
+    uint32_t         m_flags; //!< a mask of @ref WorkspaceFlags_e
+    csubstr          m_dir_include; //!< passed to Workspace::m_dir_include
+    csubstr          m_dir_exclude; //!< passed to Workspace::m_dir_exclude
+    pfn_trace        m_trace;       //!< passed to Workspace::m_trace
+    void *           m_trace_data;  //!< passed to Workspace::m_trace_data
+    ParsedOpt const* m_opts;
+    size_t           m_num_opts;
+    Layer *          m_layers;
+    size_t           m_num_layers;
+    int              m_watch_fd;
+    Workspace        m_workspace; //!< reset and reused for every layer and every reload
+
+private:
+
+    bool _apply(size_t first_opt, size_t end_opt);
+    size_t _apply_layers(size_t first_layer, bool restore);
+    void _retry_from(size_t first_layer);
+    void _save_checkpoint(size_t layer);
+    void _restore_checkpoint(size_t layer);
+    uint64_t _signature(size_t layer) const;
+    bool _inputs_exist(size_t layer) const;
+    void _watch(size_t layer);
+    void _read_events();
+    void _release_layers();
+};
+
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+/** A field of a struct bound to a path of the config tree. Use
+ * C4CONF_FIELD() to create it. */
+struct BoundField
+{
+    csubstr path; //!< the path of the field, relative to the bound node
+    void (*read)(yml::ConstNodeRef node, void *obj);
+};
+
+/** read a node into a member of an object. This is instantiated for
+ * each member, so there is no runtime dispatch on the member type. */
+template<class T, class M, M T::*Member>
+void read_bound_field(yml::ConstNodeRef node, void *obj)
+{
+    node >> static_cast<T*>(obj)->*Member;
+}
+
+/** create a @ref BoundField for @p member of @p Type, at @p path in
+ * the config tree. Eg:
+ * @code
+ * const BoundField fields[] = {
+ *     C4CONF_FIELD(Settings, num_threads, "app.threads"),
+ *     C4CONF_FIELD(Settings, first_port, "app.ports[0]"),
+ * };
+ * @endcode */
+#define C4CONF_FIELD(Type, member, path)                                \
+    ::c4::conf::BoundField{                                             \
+        ::c4::csubstr(path),                                            \
+        &::c4::conf::read_bound_field<Type, decltype(Type::member), &Type::member> \
+    }
+
+/** Binds the fields of a struct to their paths in the config tree,
+ * so that the struct can be filled in a single traversal of the
+ * tree.
+ *
+ * On construction, the paths of all the fields are compiled into a
+ * trie. bind() then walks the tree and the trie together: the
+ * children of each tree node are visited once, in order, and are
+ * matched against the trie by hash and index, so there is no string
+ * search for each field. Subtrees without bound fields are not
+ * visited.
+ *
+ * Fields whose path is not found in the tree are left untouched. Seq
+ * entries must be given as indices, eg `ports[0]`. The fields (and
+ * the strings of their paths) must outlive the binding. */
+struct Binding
+{
+    Binding(BoundField const* fields, size_t num_fields, yml::Callbacks const& cb=yml::get_callbacks());
+    template<size_t N>
+    Binding(BoundField const (&fields)[N], yml::Callbacks const& cb=yml::get_callbacks())
+        : Binding(fields, N, cb)
+    {
+    }
+    ~Binding();
+
+    Binding(Binding const&) = delete;
+    Binding& operator= (Binding const&) = delete;
+
+    /** fill the bound fields of @p obj from the tree, starting at the
+     * node @p start (or at the root).
+     * @return the number of fields which were found */
+    template<class T>
+    size_t bind(Tree const& t, T *obj, size_t start=yml::NONE) const
+    {
+        return _bind(t, obj, start);
+    }
+
+public:
+
+    struct TrieNode
+    {
+        CompiledPath::Segment segment;
+        size_t field;        //!< the bound field, or NONE
+        size_t first_child;  //!< the first trie node below this one, or NONE
+        size_t next_sibling; //!< the next trie node at this level, or NONE
+    };
+
+public:
+
+    BoundField const* m_fields;
+    size_t            m_num_fields;
+    TrieNode *        m_trie; //!< the root is at position 0
+    size_t            m_trie_size;
+    size_t            m_trie_capacity;
+    yml::Callbacks    m_callbacks;
+
+private:
+
+    size_t _bind(Tree const& t, void *obj, size_t start) const;
+    size_t _bind_node(Tree const& t, size_t node, size_t trie_node, void *obj) const;
+};
+
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+/** A read index over a finished tree, eg the output tree once
+ * Workspace::apply_opts() is done, mapping the canonical path of
+ * every node (eg `foo.bar[3].baz`) to its node id. Finding a path
+ * hashes it and probes an open-addressing table, instead of scanning
+ * the children at each level of the path. The found node is then
+ * verified by walking up to the root, comparing each key and index.
+ *
+ * In canonical paths, seq entries are given by index (`seq[1]`,
+ * not `seq.1`). The index refers to the tree, which must not be
+ * modified while the index is used: after any change, call build()
+ * again. */
+struct PathIndex
+{
+    PathIndex(yml::Callbacks const& cb=yml::get_callbacks());
+    PathIndex(Tree const& t, size_t start=yml::NONE, yml::Callbacks const& cb=yml::get_callbacks());
+    ~PathIndex();
+
+    PathIndex(PathIndex const&) = delete;
+    PathIndex& operator= (PathIndex const&) = delete;
+
+    /** index all the nodes below @p start (or the root) of the tree,
+     * with their paths relative to it */
+    void build(Tree const& t, size_t start=yml::NONE);
+    void clear();
+
+    /** @return the node at the path, or NONE if there is none */
+    size_t find(csubstr path) const;
+    /** @return the node at the path, or NONE if there is none */
+    size_t find(CompiledPath const& path) const;
+
+    size_t size() const noexcept { return m_size; }
+
+public:
+
+    struct Entry
+    {
+        uint64_t hash; //!< the hash of the canonical path of the node
+        size_t   node; //!< NONE for an empty slot
+    };
+
+public:
+
+    Tree const*    m_tree;
+    size_t         m_root;
+    Entry *        m_table;
+    size_t         m_capacity;  //!< the table size, a power of two
+    size_t         m_size;      //!< the number of indexed nodes
+    size_t *       m_positions; //!< the position of each node in its parent, by node id
+    size_t         m_num_positions;
+    yml::Callbacks m_callbacks;
+
+private:
+
+    void _insert(uint64_t hash, size_t node);
+    void _index_children(size_t node, uint64_t hash);
+    template<class Verify> size_t _find(uint64_t hash, Verify &&verify) const;
+    bool _matches(size_t *node, CompiledPath::Segment const& seg) const;
+};
+
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+/** An immutable, reference-counted configuration: a finished tree,
+ * eg the output of a Workspace, together with its PathIndex. Once
+ * created, neither is modified, so any number of threads can read
+ * them concurrently. Use ConfigPublisher to share snapshots between
+ * threads. */
+struct ConfigSnapshot
+{
+    /** create a snapshot taking over the tree. The reference count
+     * starts at one; call release() when done. */
+    static ConfigSnapshot* create(yml::Tree &&tree);
+
+    void acquire() const noexcept;
+    /** decrement the reference count, destroying the snapshot when
+     * it gets to zero */
+    void release() const noexcept;
+
+    Tree const& tree() const noexcept { return m_tree; }
+    PathIndex const& index() const noexcept { return m_index; }
+    /** @return the node at the canonical path, or NONE */
+    size_t find(csubstr path) const { return m_index.find(path); }
+
+public:
+
+    yml::Tree m_tree;
+    PathIndex m_index;
+    mutable std::atomic<size_t> m_refs;
+
+private:
+
+    ConfigSnapshot(yml::Tree &&tree);
+    ~ConfigSnapshot() = default;
+};
+
+
+/** An owning reference to a ConfigSnapshot, which keeps it alive */
+struct SnapshotRef
+{
+    SnapshotRef() noexcept : m_snapshot(nullptr) {}
+    /** take over a reference already acquired */
+    explicit SnapshotRef(ConfigSnapshot const* s) noexcept : m_snapshot(s) {}
+    ~SnapshotRef() { if(m_snapshot) m_snapshot->release(); }
+
+    SnapshotRef(SnapshotRef const&) = delete;
+    SnapshotRef& operator= (SnapshotRef const&) = delete;
+    SnapshotRef(SnapshotRef &&that) noexcept : m_snapshot(that.m_snapshot) { that.m_snapshot = nullptr; }
+    SnapshotRef& operator= (SnapshotRef &&that) noexcept { std::swap(m_snapshot, that.m_snapshot); return *this; }
+
+    ConfigSnapshot const* get() const noexcept { return m_snapshot; }
+    ConfigSnapshot const* operator-> () const noexcept { return m_snapshot; }
+    explicit operator bool() const noexcept { return m_snapshot != nullptr; }
+
+private:
+
+    ConfigSnapshot const* m_snapshot;
+};
+
+
+/** Publishes configuration snapshots to reader threads. publish()
+ * swaps the current snapshot atomically, so that readers see either
+ * the old or the new configuration, never a partial one.
+ *
+ * Readers never take a lock. read() protects the current snapshot
+ * with a hazard slot: the reader claims a slot (starting at a
+ * position derived from its thread id, so that different threads
+ * usually use different cache lines), and stores the snapshot in it.
+ * This touches no shared counter, so reads scale with the number of
+ * threads. acquire() additionally increments the reference count, to
+ * keep the snapshot beyond the read.
+ *
+ * publish() retires the previous snapshot once no hazard slot holds
+ * it, waiting for any reads in progress; it is meant to be called
+ * from a background thread. The publisher must outlive all its
+ * readers. */
+struct ConfigPublisher
+{
+    /** @p num_slots the number of hazard slots; readers wait for a
+     * free slot if there are more concurrent reads than slots */
+    ConfigPublisher(size_t num_slots=128, yml::Callbacks const& cb=yml::get_callbacks());
+    ~ConfigPublisher();
+
+    ConfigPublisher(ConfigPublisher const&) = delete;
+    ConfigPublisher& operator= (ConfigPublisher const&) = delete;
+
+    /** make the tree the current configuration, taking it over */
+    void publish(yml::Tree &&tree);
+    /** make the snapshot the current configuration, taking over the
+     * reference of the caller */
+    void publish(ConfigSnapshot const* snapshot);
+
+    struct ReadGuard;
+
+    /** protect the current snapshot for the duration of a read. The
+     * guard should be short-lived: publish() waits for it. */
+    ReadGuard read() const;
+    /** @return a reference to the current snapshot, which may be
+     * kept for any amount of time */
+    SnapshotRef acquire() const;
+
+public:
+
+    /** each slot is aligned to its own cache line. The slot array is
+     * allocated with room to align it, since the callbacks only
+     * guarantee the alignment of max_align_t. */
+    struct alignas(64) HazardSlot
+    {
+        std::atomic<ConfigSnapshot const*> snapshot;
+        std::atomic<uint32_t> owned;
+        char _pad[64u - sizeof(std::atomic<ConfigSnapshot const*>) - sizeof(std::atomic<uint32_t>)]; //!< keep each slot in its own cache line
+    };
+
+    struct ReadGuard
+    {
+        ReadGuard(ReadGuard const&) = delete;
+        ReadGuard& operator= (ReadGuard const&) = delete;
+        ReadGuard(ReadGuard &&that) noexcept : m_slot(that.m_slot), m_snapshot(that.m_snapshot) { that.m_slot = nullptr; }
+        ReadGuard& operator= (ReadGuard &&) = delete;
+        ~ReadGuard();
+
+        ConfigSnapshot const* get() const noexcept { return m_snapshot; }
+        ConfigSnapshot const* operator-> () const noexcept { return m_snapshot; }
+        explicit operator bool() const noexcept { return m_snapshot != nullptr; }
+
+    private:
+
+        friend struct ConfigPublisher;
+        ReadGuard(HazardSlot *slot, ConfigSnapshot const* s) noexcept : m_slot(slot), m_snapshot(s) {}
+        HazardSlot *m_slot;
+        ConfigSnapshot const* m_snapshot;
+    };
+
+public:
+
+    std::atomic<ConfigSnapshot const*> m_current;
+    HazardSlot *   m_slots;     //!< aligned to the cache line, within m_slots_buf
+    void *         m_slots_buf; //!< the allocation of the slot array
+    size_t         m_num_slots;
+    yml::Callbacks m_callbacks;
+
+private:
+
+    HazardSlot* _claim_slot() const;
+    void _retire(ConfigSnapshot const* s);
 };
 
 
@@ -123,6 +1093,8 @@ enum class ConfigAction
      * the config tree's node at <targetpath>. */
     set_node,
     /** Load a YAML file and merge into a target config node.
+     * Files with a .json extension are parsed as JSON.
+     * The documents of a multi-document file are merged in order.
      * <targetpath> is optional, and defaults to the root level;
      * ie, when <targetpath> is omitted, then the YAML tree
      * resulting from parsing <validyaml> is merged starting at
@@ -132,6 +1104,8 @@ enum class ConfigAction
     load_file,
     /** Consecutively load all files in a directory as YAML into a target config node.
      * All files are visited even if their extension is neither of .yml or .yaml.
+     * Files with a .json extension are parsed as JSON.
+     * The documents of a multi-document file are merged in order.
      * Files are visited in alphabetical order.
      * <targetpath> is optional, and defaults to the root level;
      * ie, when <targetpath> is omitted, then the YAML tree
@@ -140,6 +1114,11 @@ enum class ConfigAction
      * Otherwise the tree from <validyaml> is merged starting at
      * the config tree's node at <targetpath>. */
     load_dir,
+    /** As load_dir, but also loading the files in all the
+     * subdirectories. The files are visited in alphabetical order
+     * of their paths. See Workspace::m_dir_include and
+     * Workspace::m_dir_exclude to filter the files. */
+    load_dir_recursive,
     /** Perform a custom action. */
     callback,
 };
@@ -209,6 +1188,8 @@ template<> inline constexpr ConfigActionSpec spec_for<ConfigAction::load_file>(c
         csubstr("[<targetpath>=]<filename>"), // csubstr is needed by gcc5
         // help
         csubstr("Load a YAML file and merge into a target config node. "
+        "Files with a .json extension are parsed as JSON. "
+        "The documents of a multi-document file are merged in order. "
         "<targetpath> is optional, and defaults to the root level; "
         "ie, when <targetpath> is omitted, then the YAML tree "
         "resulting from parsing <validyaml> is merged starting at "
@@ -230,6 +1211,8 @@ template<> inline constexpr ConfigActionSpec spec_for<ConfigAction::load_dir>(cs
         // help
         csubstr("Consecutively load all files in a directory as YAML into a target config node. "
         "All files are visited even if their extension is neither of .yml or .yaml. "
+        "Files with a .json extension are parsed as JSON. "
+        "The documents of a multi-document file are merged in order. "
         "Files are visited in alphabetical order. "
         "<targetpath> is optional, and defaults to the root level; "
         "ie, when <targetpath> is omitted, then the YAML tree "
@@ -239,6 +1222,250 @@ template<> inline constexpr ConfigActionSpec spec_for<ConfigAction::load_dir>(cs
         "the config tree's node at <targetpath>."),
     };
 }
+/** A helper to create the load_dir_recursive action specification */
+template<> inline constexpr ConfigActionSpec spec_for<ConfigAction::load_dir_recursive>(csubstr optshort, csubstr optlong) noexcept
+{
+    return {
+        ConfigAction::load_dir_recursive,
+        {},
+        optshort,
+        optlong,
+        // argument
+        csubstr("[<targetpath>=]<directory>"),
+        // help
+        csubstr("Consecutively load all files in a directory and in its subdirectories "
+        "as YAML into a target config node. "
+        "Files with a .json extension are parsed as JSON. "
+        "The documents of a multi-document file are merged in order. "
+        "Files are visited in alphabetical order of their paths. "
+        "<targetpath> is optional, and defaults to the root level; "
+        "ie, when <targetpath> is omitted, then the YAML tree "
+        "resulting from parsing <validyaml> is merged starting at "
+        "the config tree's root node. "
+        "Otherwise the tree from <validyaml> is merged starting at "
+        "the config tree's node at <targetpath>."),
+    };
+}
+
+/** @} */
+
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+/** @name compile-time checking of specs
+ *
+ * These are constexpr functions, so they can be used in
+ * static_assert() with spec arrays declared constexpr, which is done
+ * by C4CONF_STATIC_CHECK_SPECS(). make_spec_table() precomputes at
+ * compile time what OptionTable and print_help() would otherwise
+ * compute at startup. */
+/** @{ */
+
+namespace detail {
+constexpr bool cx_eq(csubstr a, csubstr b, size_t i=0) noexcept
+{
+    return a.len == b.len && (i == a.len || (a.str[i] == b.str[i] && cx_eq(a, b, i + 1u)));
+}
+/** FNV-1a, as used by OptionTable */
+constexpr uint64_t cx_hash(csubstr s, size_t i=0, uint64_t hash=14695981039346656037ull) noexcept
+{
+    return i == s.len ? hash : cx_hash(s, i + 1u, (hash ^ (uint64_t)(unsigned char)s.str[i]) * 1099511628211ull);
+}
+/** square brackets may nest; angle brackets may not */
+constexpr bool cx_brackets_ok(csubstr s, size_t i=0, size_t square=0, size_t angle=0) noexcept
+{
+    return i == s.len ? (square == 0 && angle == 0)
+        : s.str[i] == '[' ? cx_brackets_ok(s, i + 1u, square + 1u, angle)
+        : s.str[i] == ']' ? (square > 0 && cx_brackets_ok(s, i + 1u, square - 1u, angle))
+        : s.str[i] == '<' ? (angle == 0 && cx_brackets_ok(s, i + 1u, square, angle + 1u))
+        : s.str[i] == '>' ? (angle > 0 && cx_brackets_ok(s, i + 1u, square, angle - 1u))
+        : cx_brackets_ok(s, i + 1u, square, angle);
+}
+constexpr bool cx_name_is_ok(csubstr name) noexcept
+{
+    return name.len == 0 || (name.str[0] == '-' && name.len > 1u);
+}
+constexpr bool cx_uses_name(ConfigActionSpec const& spec, csubstr name) noexcept
+{
+    return name.len && (cx_eq(spec.optshort, name) || cx_eq(spec.optlong, name));
+}
+/** whether any of the specs in [j,num_specs[ uses the names of specs[i] */
+constexpr bool cx_has_clash(ConfigActionSpec const* specs, size_t num_specs, size_t i, size_t j) noexcept
+{
+    return j < num_specs && (cx_uses_name(specs[j], specs[i].optshort)
+                             || cx_uses_name(specs[j], specs[i].optlong)
+                             || cx_has_clash(specs, num_specs, i, j + 1u));
+}
+constexpr bool cx_all(ConfigActionSpec const* specs, size_t num_specs, bool (*pred)(ConfigActionSpec const&), size_t i=0) noexcept
+{
+    return i >= num_specs || (pred(specs[i]) && cx_all(specs, num_specs, pred, i + 1u));
+}
+template<size_t... I> struct index_seq {};
+template<size_t N, size_t... I> struct make_index_seq : make_index_seq<N - 1u, N - 1u, I...> {};
+template<size_t... I> struct make_index_seq<0, I...> { using type = index_seq<I...>; };
+} // namespace detail
+
+/** @return true if the spec has at least one name, and its names
+ * start with '-' and are different */
+constexpr bool spec_has_valid_names(ConfigActionSpec const& spec) noexcept
+{
+    return (spec.optshort.len || spec.optlong.len)
+        && detail::cx_name_is_ok(spec.optshort)
+        && detail::cx_name_is_ok(spec.optlong)
+        && !(spec.optshort.len && detail::cx_eq(spec.optshort, spec.optlong));
+}
+/** @return true if the brackets in the dummyname are balanced */
+constexpr bool spec_has_valid_dummyname(ConfigActionSpec const& spec) noexcept
+{
+    return detail::cx_brackets_ok(spec.dummyname);
+}
+/** @return false if the spec is a callback action without callback */
+constexpr bool spec_has_valid_callback(ConfigActionSpec const& spec) noexcept
+{
+    return spec.action != ConfigAction::callback || spec.callback != nullptr;
+}
+
+constexpr bool specs_have_valid_names(ConfigActionSpec const* specs, size_t num_specs) noexcept
+{
+    return detail::cx_all(specs, num_specs, &spec_has_valid_names);
+}
+constexpr bool specs_have_valid_dummynames(ConfigActionSpec const* specs, size_t num_specs) noexcept
+{
+    return detail::cx_all(specs, num_specs, &spec_has_valid_dummyname);
+}
+constexpr bool specs_have_valid_callbacks(ConfigActionSpec const* specs, size_t num_specs) noexcept
+{
+    return detail::cx_all(specs, num_specs, &spec_has_valid_callback);
+}
+/** @return true if no option name is used by more than one spec */
+constexpr bool specs_are_unique(ConfigActionSpec const* specs, size_t num_specs, size_t i=0) noexcept
+{
+    return i >= num_specs || (!detail::cx_has_clash(specs, num_specs, i, i + 1u) && specs_are_unique(specs, num_specs, i + 1u));
+}
+
+/** @return the width of the options column of the spec in
+ * print_help(), eg `  -cn [<targetpath>=]<validyaml>, --conf-node [<targetpath>=]<validyaml>` */
+constexpr size_t help_prefix_width(ConfigActionSpec const& spec) noexcept
+{
+    return (spec.optshort.len ? 2u + spec.optshort.len + (spec.dummyname.len ? 1u + spec.dummyname.len : 0u) : 0u)
+        + (spec.optlong.len ? 2u + spec.optlong.len + (spec.dummyname.len ? 1u + spec.dummyname.len : 0u) : 0u);
+}
+
+/** check at compile time an array of specs declared constexpr. Eg:
+ * @code
+ * constexpr const ConfigActionSpec specs[] = {...};
+ * C4CONF_STATIC_CHECK_SPECS(specs);
+ * @endcode */
+#define C4CONF_STATIC_CHECK_SPECS(specs)                                \
+    static_assert(::c4::conf::specs_have_valid_names(specs, C4_COUNTOF(specs)), \
+                  #specs ": every spec needs a name, and names must start with '-'"); \
+    static_assert(::c4::conf::specs_are_unique(specs, C4_COUNTOF(specs)), \
+                  #specs ": an option name is used by more than one spec"); \
+    static_assert(::c4::conf::specs_have_valid_dummynames(specs, C4_COUNTOF(specs)), \
+                  #specs ": unbalanced brackets in a dummyname");       \
+    static_assert(::c4::conf::specs_have_valid_callbacks(specs, C4_COUNTOF(specs)), \
+                  #specs ": a callback spec has no callback")
+
+/** A slot in the open-addressing table of OptionTable */
+struct OptionEntry
+{
+    uint64_t hash;
+    csubstr name;                 //!< the optshort or optlong of the spec
+    ConfigActionSpec const* spec; //!< null for an empty slot
+};
+
+namespace detail {
+/** the number of slots of the OptionTable for @p num_specs specs:
+ * two names for each spec, with the load factor at or below 1/2 */
+constexpr size_t cx_table_capacity(size_t num_specs, size_t capacity=16u) noexcept
+{
+    return capacity >= 4u * num_specs ? capacity : cx_table_capacity(num_specs, capacity << 1u);
+}
+/** the slots of an OptionTable under construction. C++11 constexpr
+ * functions cannot mutate, so each insertion returns a new copy. */
+template<size_t C>
+struct cx_slots
+{
+    OptionEntry e[C];
+};
+template<size_t C, size_t... J>
+constexpr cx_slots<C> cx_slots_set(cx_slots<C> const& t, size_t slot, OptionEntry const& entry, index_seq<J...>) noexcept
+{
+    return cx_slots<C>{{(J == slot ? entry : t.e[J])...}};
+}
+/** @return the free slot for the name, or C if it is already in the table */
+template<size_t C>
+constexpr size_t cx_slots_find(cx_slots<C> const& t, uint64_t hash, csubstr name, size_t slot) noexcept
+{
+    return t.e[slot].spec == nullptr ? slot
+        : (t.e[slot].hash == hash && cx_eq(t.e[slot].name, name)) ? C
+        : cx_slots_find(t, hash, name, (slot + 1u) & (C - 1u));
+}
+template<size_t C>
+constexpr cx_slots<C> cx_slots_insert(cx_slots<C> const& t, OptionEntry const& entry, size_t slot) noexcept
+{
+    return slot == C ? t // the first spec wins
+        : cx_slots_set(t, slot, entry, typename make_index_seq<C>::type{});
+}
+template<size_t C>
+constexpr cx_slots<C> cx_slots_insert(cx_slots<C> const& t, csubstr name, ConfigActionSpec const* spec) noexcept
+{
+    return name.len == 0 ? t
+        : cx_slots_insert(t, OptionEntry{cx_hash(name), name, spec},
+                          cx_slots_find(t, cx_hash(name), name, (size_t)cx_hash(name) & (C - 1u)));
+}
+/** insert the names of the specs in the same order as OptionTable */
+template<size_t C>
+constexpr cx_slots<C> cx_slots_fill(cx_slots<C> const& t, ConfigActionSpec const* specs, size_t num_specs, size_t i=0) noexcept
+{
+    return i == num_specs ? t
+        : cx_slots_fill(cx_slots_insert(cx_slots_insert(t, specs[i].optshort, specs + i), specs[i].optlong, specs + i),
+                        specs, num_specs, i + 1u);
+}
+} // namespace detail
+
+/** A spec array with the data derived from it precomputed at
+ * compile time. Create it with make_spec_table(). */
+template<size_t N, size_t C=detail::cx_table_capacity(N)>
+struct SpecTable
+{
+    static_assert(C && (C & (C - 1u)) == 0, "capacity must be a power of two");
+    ConfigActionSpec const* specs;
+    uint64_t short_hashes[N];  //!< the hashes of optshort, for OptionTable
+    uint64_t long_hashes[N];   //!< the hashes of optlong, for OptionTable
+    size_t   prefix_widths[N]; //!< the widths of the options column, for print_help()
+    OptionEntry slots[C];      //!< the hash table used by OptionTable
+    constexpr size_t size() const noexcept { return N; }
+    constexpr size_t capacity() const noexcept { return C; }
+};
+
+namespace detail {
+template<size_t N, size_t C, size_t... I, size_t... J>
+constexpr SpecTable<N, C> make_spec_table(ConfigActionSpec const (&specs)[N], cx_slots<C> const& slots, index_seq<I...>, index_seq<J...>) noexcept
+{
+    return SpecTable<N, C>{
+        specs,
+        {cx_hash(specs[I].optshort)...},
+        {cx_hash(specs[I].optlong)...},
+        {help_prefix_width(specs[I])...},
+        {slots.e[J]...},
+    };
+}
+} // namespace detail
+
+/** precompute the data derived from a spec array, including the hash
+ * table of OptionTable. Declare the result constexpr to have it
+ * computed at compile time. The spec array must outlive the table. */
+template<size_t N>
+constexpr SpecTable<N> make_spec_table(ConfigActionSpec const (&specs)[N]) noexcept
+{
+    return detail::make_spec_table(specs,
+                                   detail::cx_slots_fill(detail::cx_slots<detail::cx_table_capacity(N)>{}, specs, N),
+                                   typename detail::make_index_seq<N>::type{},
+                                   typename detail::make_index_seq<detail::cx_table_capacity(N)>::type{});
+}
 
 /** @} */
 
@@ -265,17 +1492,84 @@ enum : size_t {
 };
 
 
+/** A table of option specs, compiled once to match command line
+ * arguments in constant time. The optshort and optlong names of the
+ * specs are hashed into an open-addressing table. When a name is
+ * used by more than one spec, the first spec wins. The specs must
+ * outlive the table. */
+struct OptionTable
+{
+    OptionTable(ConfigActionSpec const* specs, size_t num_specs, yml::Callbacks const& cb=yml::get_callbacks());
+    template<size_t N>
+    explicit OptionTable(ConfigActionSpec const (&specs)[N], yml::Callbacks const& cb=yml::get_callbacks())
+        : OptionTable(specs, N, cb)
+    {
+    }
+    /** use the hash table precomputed by make_spec_table(), without
+     * allocating. The spec table must outlive this table. */
+    template<size_t N, size_t C>
+    explicit OptionTable(SpecTable<N, C> const& table) noexcept
+        : m_specs(table.specs)
+        , m_num_specs(N)
+        , m_table(table.slots)
+        , m_capacity(C)
+        , m_owns_table(false)
+        , m_callbacks(yml::get_callbacks())
+    {
+    }
+    template<size_t N, size_t C>
+    explicit OptionTable(SpecTable<N, C> const&&) = delete;
+    /** @p short_hashes and @p long_hashes are the hashes of the names
+     * of each spec, or null to compute them */
+    OptionTable(ConfigActionSpec const* specs, size_t num_specs,
+                uint64_t const* short_hashes, uint64_t const* long_hashes,
+                yml::Callbacks const& cb=yml::get_callbacks());
+    ~OptionTable();
+
+    OptionTable(OptionTable const&) = delete;
+    OptionTable& operator= (OptionTable const&) = delete;
+
+    /** @return the spec matching the argument, or null if none does */
+    ConfigActionSpec const* find(csubstr arg) const;
+
+public:
+
+    using Entry = OptionEntry;
+
+public:
+
+    ConfigActionSpec const* m_specs;
+    size_t         m_num_specs;
+    Entry const*   m_table;
+    size_t         m_capacity;   //!< the table size, a power of two
+    bool           m_owns_table; //!< false when borrowed from a SpecTable
+    yml::Callbacks m_callbacks;
+};
+
+
 /** Parse command line options into the given buffer. This will
- * extract any configuration arguments matching any of the
- * @p num_specs specifications given in @p specs. The
- * configuration arguments are written into @p parsed_opts, up to
- * the size passed in @p parsed_opts_size. All other remaining
- * arguments kept in @p argc. @p argc and @p argv are adjusted to
- * refer only to these remaining arguments.
+ * extract any configuration arguments matching any of the specs in
+ * @p table. The configuration arguments are written into @p
+ * parsed_opts, up to the size passed in @p parsed_opts_size. All
+ * other remaining arguments kept in @p argc. @p argc and @p argv
+ * are adjusted to refer only to these remaining arguments.
+ *
+ * The arguments are scanned only once. The consumed arguments are
+ * removed from @p argv only at the end, and only if there was no
+ * error and the buffer was large enough; otherwise, @p argc and @p
+ * argv are left unchanged.
  *
  * @return If there was an error while parsing the command line
  * options, return argerror. Otherwise, return the size of the buffer
  * needed to accomodate all the command line options. */
+size_t parse_opts(int *argc, char ***argv,
+                  OptionTable const& table,
+                  ParsedOpt *parsed_opts, size_t parsed_opts_size);
+
+/** Parse command line options into the given buffer. Works as (1),
+ * but matching the @p num_specs specifications given in @p specs.
+ * This builds an OptionTable for each call; prefer (1) when parsing
+ * many times with the same specs. */
 size_t parse_opts(int *argc, char ***argv,
                   ConfigActionSpec const* specs, size_t num_specs,
                   ParsedOpt *parsed_opts, size_t parsed_opts_size);
@@ -285,40 +1579,69 @@ size_t parse_opts(int *argc, char ***argv,
  * except it receives an output container, which will be resized as
  * needed to accomodate the passed arguments. The container should be
  * a linear container offering .data(), .size() and .resize() methods:
- * eg, a std::vector<ParsedOpt>.
+ * eg, a std::vector<ParsedOpt>. The arguments are scanned only once:
+ * the container is first grown by the number of arguments (each
+ * option consumes at least one), the options are parsed into that
+ * tail, and only on success are they moved to the front and the
+ * container shrunk to the options found.
  *
- * @return false if there was an error parsing the arguments */
+ * @return false if there was an error parsing the arguments. The
+ * container is then left with its previous size and contents. */
 template<class ParsedOptContainer>
 bool parse_opts(int *argc, char ***argv,
-                ConfigActionSpec const* specs, size_t num_specs,
+                OptionTable const& table,
                 ParsedOptContainer *parsed_opts)
 {
     static_assert(std::is_same<typename ParsedOptContainer::value_type, ParsedOpt>::value, "must be container of ParsedOpt");
-    size_t ret = parse_opts(argc, argv, specs, num_specs, parsed_opts->data(), parsed_opts->size());
+    const size_t prev_size = parsed_opts->size();
+    const size_t cap = (size_t)*argc;
+    // parse into scratch space past the current elements, so that
+    // they are not clobbered if there is an error
+    parsed_opts->resize(prev_size + cap);
+    ParsedOpt *scratch = parsed_opts->data() + prev_size;
+    size_t ret = parse_opts(argc, argv, table, scratch, cap);
     if(ret == argerror)
-        return false;
-    if(ret > parsed_opts->size())
     {
-        parsed_opts->resize(ret);
-        ret = parse_opts(argc, argv, specs, num_specs, parsed_opts->data(), parsed_opts->size());
-        C4_CHECK(ret == parsed_opts->size());
+        parsed_opts->resize(prev_size);
+        return false;
     }
+    C4_CHECK(ret <= cap);
+    ParsedOpt *out = parsed_opts->data();
+    for(size_t i = 0; i < ret; ++i)
+        out[i] = scratch[i];
+    parsed_opts->resize(ret);
     return true;
 }
 
+template<class ParsedOptContainer>
+bool parse_opts(int *argc, char ***argv,
+                ConfigActionSpec const* specs, size_t num_specs,
+                ParsedOptContainer *parsed_opts)
+{
+    OptionTable table(specs, num_specs);
+    return parse_opts(argc, argv, table, parsed_opts);
+}
+
 
 /** Parse command line options, and return a newly created container
  * with the result.  Calls C4_ERROR() if the arguments fail to
  * parse. */
 template<class ParsedOptContainer>
-ParsedOptContainer parse_opts(int *argc, char ***argv, ConfigActionSpec const* specs, size_t num_specs)
+ParsedOptContainer parse_opts(int *argc, char ***argv, OptionTable const& table)
 {
     ParsedOptContainer container;
-    if(!parse_opts(argc, argv, specs, num_specs, &container))
+    if(!parse_opts(argc, argv, table, &container))
         C4_ERROR("failed to parse args");
     return container;
 }
 
+template<class ParsedOptContainer>
+ParsedOptContainer parse_opts(int *argc, char ***argv, ConfigActionSpec const* specs, size_t num_specs)
+{
+    OptionTable table(specs, num_specs);
+    return parse_opts<ParsedOptContainer>(argc, argv, table);
+}
+
 /** @} */
 
 
@@ -329,12 +1652,12 @@ ParsedOptContainer parse_opts(int *argc, char ***argv, ConfigActionSpec const* s
 /** @name Facilities for printing help */
 /** @{ */
 
-/** print help for configuration command line options.
- * @p dump is a function accepting a csubstr as its single argument, which should print it. */
+namespace detail {
 template<class DumpFn>
 C4_NO_INLINE void print_help(DumpFn &&dump,
                              ConfigActionSpec const *specs, size_t num_specs,
-                             csubstr section_title={}, size_t linewidth=70)
+                             size_t const* prefix_widths,
+                             csubstr section_title, size_t linewidth)
 {
     auto print = [&dump](csubstr value) {
         dump(value);
@@ -370,25 +1693,26 @@ C4_NO_INLINE void print_help(DumpFn &&dump,
     constexpr const size_t break_pos = 22;
     for(ConfigActionSpec const* spec = specs; spec < specs + num_specs; ++spec)
     {
-        size_t pos = 0;
+        const size_t prefix_width = prefix_widths ? prefix_widths[spec - specs] : help_prefix_width(*spec);
         if(!spec->optshort.empty())
         {
-            pos += print("  ");
-            pos += print(spec->optshort);
-            pos += printdummy(spec->dummyname);
+            print("  ");
+            print(spec->optshort);
+            printdummy(spec->dummyname);
         }
         if(!spec->optlong.empty())
         {
             if(!spec->optshort.empty())
-                pos += print(", ");
+                print(", ");
             else
-                pos += print("  ");
-            pos += print(spec->optlong);
-            pos += printdummy(spec->dummyname);
+                print("  ");
+            print(spec->optlong);
+            printdummy(spec->dummyname);
         }
-        if(pos < break_pos - 2)
+        size_t pos;
+        if(prefix_width < break_pos - 2)
         {
-            pos += printw(" ", break_pos - pos);
+            pos = prefix_width + printw(" ", break_pos - prefix_width);
         }
         else
         {
@@ -411,6 +1735,26 @@ C4_NO_INLINE void print_help(DumpFn &&dump,
         pos += print("\n");
     }
 }
+} // namespace detail
+
+/** print help for configuration command line options.
+ * @p dump is a function accepting a csubstr as its single argument, which should print it. */
+template<class DumpFn>
+void print_help(DumpFn &&dump,
+                ConfigActionSpec const *specs, size_t num_specs,
+                csubstr section_title={}, size_t linewidth=70)
+{
+    detail::print_help(std::forward<DumpFn>(dump), specs, num_specs, nullptr, section_title, linewidth);
+}
+
+/** print help for configuration command line options, using the
+ * layout precomputed by make_spec_table() */
+template<class DumpFn, size_t N, size_t C>
+void print_help(DumpFn &&dump, SpecTable<N, C> const& table,
+                csubstr section_title={}, size_t linewidth=70)
+{
+    detail::print_help(std::forward<DumpFn>(dump), table.specs, N, table.prefix_widths, section_title, linewidth);
+}
 
 /** @} */
 
@@ -1,50 +1,27 @@
 #include <c4/std/string.hpp>
+#include <c4/std/vector.hpp>
 #include <c4/conf/conf.hpp>
 #include <c4/fs/fs.hpp>
 #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
 #include <doctest/doctest.h>
+#include "./test_common.hpp"
 
+#include <atomic>
+#include <cstring>
 #include <initializer_list>
+#include <thread>
 #include <vector>
 
 
 using MultipleConfsSpec = std::initializer_list<c4::csubstr>;
-using MultipleFilesSpec = std::initializer_list<c4::csubstr>;
 
 
-// from multiple strings, create corresponding multiple files
-// to allow loading from the file system
-struct MultipleFiles
-{
-    std::vector<c4::fs::ScopedTmpFile> m_files;
-    MultipleFiles(MultipleFilesSpec contents)
-        : m_files(contents.begin(), contents.end())
-    {
-        size_t i = 0;
-        for(c4::csubstr cont : contents)
-        {
-            INFO("i=", i);
-            std::string actual = c4::fs::file_get_contents<std::string>(m_files[i].name());
-            CHECK_EQ(c4::to_csubstr(actual), cont);
-            i++;
-        }
-    }
-};
-
-std::string emitstr(c4::yml::Tree const& tree)
-{
-    return c4::yml::emitrs_yaml<std::string>(tree);
-}
-
 // apply multiple files, then apply multiple confs
-void test_same(MultipleFilesSpec files, MultipleConfsSpec confs, c4::csubstr expected_yml)
+void test_same(MultipleFiles const& mf, MultipleConfsSpec confs, c4::csubstr expected_yml, uint32_t flags)
 {
-    MultipleFiles mf(files);
-    REQUIRE_EQ(mf.m_files.size(), files.size());
-
     c4::yml::Tree tree_result, tree_expected;
 
-    c4::conf::Workspace ws(&tree_result);
+    c4::conf::Workspace ws(&tree_result, nullptr, flags);
     for(const auto &file : mf.m_files)
         ws.prepare_add_file(file.name());
     for(c4::csubstr spec : confs)
@@ -52,10 +29,21 @@ void test_same(MultipleFilesSpec files, MultipleConfsSpec confs, c4::csubstr exp
     CHECK_GT(tree_result.arena_capacity(), 0u);
     CHECK_EQ(tree_result.arena_size(), 0u);
 
+    // the node buffer is reserved when the load starts, and should
+    // not need to grow afterwards
+    c4::yml::NodeData const* nodes = nullptr;
     for(const auto &file : mf.m_files)
+    {
         ws.add_file(file.name());
+        nodes = nodes ? nodes : tree_result.m_buf;
+    }
     for(c4::csubstr spec : confs)
+    {
         ws.add_conf(spec);
+        nodes = nodes ? nodes : tree_result.m_buf;
+    }
+    ws.merge_pending();
+    CHECK_EQ(tree_result.m_buf, nodes);
     c4::yml::parse_in_arena(expected_yml, &tree_expected);
 
     std::string result = emitstr(tree_result);
@@ -64,6 +52,17 @@ void test_same(MultipleFilesSpec files, MultipleConfsSpec confs, c4::csubstr exp
     CHECK_EQ(expected, result);
 }
 
+void test_same(MultipleFilesSpec files, MultipleConfsSpec confs, c4::csubstr expected_yml)
+{
+    MultipleFiles mf(files);
+    REQUIRE_EQ(mf.m_files.size(), files.size());
+    for(uint32_t flags : workspace_flags)
+    {
+        INFO("flags=", flags);
+        test_same(mf, confs, expected_yml, flags);
+    }
+}
+
 
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
@@ -310,6 +309,15 @@ TEST_CASE("nested_map_lookup.override_with_map_twice_then_val")
     );
 }
 
+TEST_CASE("nested_map_lookup.create_in_empty_tree")
+{
+    test_same(
+        {},
+        {"x.y=1", "x.z.w=2"},
+         "x: {y: 1, z: {w: 2}}"
+    );
+}
+
 
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
@@ -471,3 +479,699 @@ TEST_CASE("nested_mixed_lookup.create_maps")
         "{map: {seq: [0, {map: {seq: {foo: bar, bar: {baz: bat}}}, and: val}]}}"
     );
 }
+
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+TEST_CASE("estimate_num_nodes.is_not_lower_than_actual")
+{
+    for(c4::csubstr yml : {
+            c4::csubstr("a: 0"),
+            c4::csubstr("{a: 0, b: 1, c: 2}"),
+            c4::csubstr("{map: {seq: [0, {map: {seq: [10, 20]}, and: val}]}}"),
+            c4::csubstr("a:\n  - 0\n  - 1\n  - {b: 2, c: [3, 4]}\n"),
+            c4::csubstr("a: b\nc: d\ne: f\n"),
+            c4::csubstr("- - - x\n"),
+            c4::csubstr("- - a: b\n    c: [d, {e: f}]\n  - - g\n"),
+            c4::csubstr("--- a\n--- [b]\n---\n"),
+        })
+    {
+        c4::yml::Tree t = c4::yml::parse_in_arena(yml);
+        CHECK_GE(c4::conf::estimate_num_nodes(yml), t.size());
+    }
+}
+
+TEST_CASE("mmap_files.only_surviving_strings_are_copied")
+{
+    MultipleFiles mf({
+        "# this comment is never copied into the output arena\na: 0\nb: 1\n",
+        "# neither is this one\na: replaced\n",
+    });
+    c4::yml::Tree tree_result, tree_expected;
+    c4::conf::Workspace ws(&tree_result, nullptr, c4::conf::WS_MMAP_FILES);
+    size_t total_size = 0;
+    for(const auto &file : mf.m_files)
+    {
+        ws.prepare_add_file(file.name());
+        total_size += c4::fs::file_size(file.name());
+    }
+    for(const auto &file : mf.m_files)
+        ws.add_file(file.name());
+    c4::yml::parse_in_arena("{a: replaced, b: 1}", &tree_expected);
+    CHECK_EQ(emitstr(tree_result), emitstr(tree_expected));
+    #ifdef C4_POSIX // otherwise files are copied
+    CHECK_LT(tree_result.arena_size(), total_size);
+    #endif
+}
+
+TEST_CASE("memory_report.dead_text")
+{
+    MultipleFiles mf({
+        "# this comment is dead text\na: overridden value\nb: 1\n",
+        "a: replaced\n",
+    });
+    c4::yml::Tree tree_result;
+    c4::conf::Workspace ws(&tree_result);
+    size_t total_size = 0;
+    for(const auto &file : mf.m_files)
+    {
+        ws.prepare_add_file(file.name());
+        total_size += c4::fs::file_size(file.name());
+    }
+    for(const auto &file : mf.m_files)
+        ws.add_file(file.name());
+    const c4::conf::MemoryReport report = ws.memory_report();
+    CHECK_EQ(report.output.node_size, tree_result.size());
+    CHECK_EQ(report.output.node_capacity, tree_result.capacity());
+    CHECK_EQ(report.output.node_bytes, tree_result.capacity() * sizeof(c4::yml::NodeData));
+    CHECK_EQ(report.output.arena_size, tree_result.arena_size());
+    CHECK_EQ(report.output.arena_capacity, tree_result.arena_capacity());
+    CHECK_GE(report.output.arena_size, total_size);
+    // the surviving keys and vals: a, replaced, b, 1
+    CHECK_GE(report.output.arena_referenced, 11u);
+    CHECK_LE(report.output.arena_referenced, report.output.arena_size - total_size + 11u);
+    CHECK_EQ(report.output.total(), report.output.node_bytes + report.output.arena_capacity);
+    CHECK_GT(report.workspace.node_size, 0u);
+    CHECK_GE(report.total_workspace(), report.workspace.total());
+}
+
+TEST_CASE("compact_arena.keeps_only_referenced_strings")
+{
+    c4::yml::Tree tree = c4::yml::parse_in_arena("# a comment\n{a: 0, b: [1, 2, {c: 3}], d: &anchor value, e: *anchor}");
+    const std::string expected = emitstr(tree);
+    tree.remove(tree["b"].id());
+    const std::string expected_after_remove = emitstr(tree);
+    CHECK_NE(expected_after_remove, expected);
+    const c4::conf::TreeMemory before = c4::conf::tree_memory(tree);
+    CHECK_LT(before.arena_referenced, before.arena_size);
+    const size_t released = c4::conf::compact_arena(&tree);
+    CHECK_EQ(released, before.arena_capacity - before.arena_referenced);
+    const c4::conf::TreeMemory after = c4::conf::tree_memory(tree);
+    CHECK_EQ(after.arena_capacity, before.arena_referenced);
+    CHECK_EQ(after.arena_size, before.arena_referenced);
+    CHECK_EQ(after.arena_referenced, before.arena_referenced);
+    CHECK_EQ(emitstr(tree), expected_after_remove);
+    // the tree can still grow
+    tree["f"] << "a new val";
+    CHECK_EQ(tree["f"].val(), "a new val");
+}
+
+TEST_CASE("reorder_nodes.contiguous")
+{
+    auto make_tree = []{
+        c4::yml::Tree t = c4::yml::parse_in_arena("{a: {x: 0}, b: [0, 1], c: 2}");
+        // scatter the nodes: children added later go to the end of
+        // the node array, and removed nodes leave holes
+        t["a"]["y"] << 1;
+        t["b"].append_child() << 2;
+        t.remove(t["c"].id());
+        t["a"]["z"] << 3;
+        t["d"] << 4;
+        return t;
+    };
+    for(c4::conf::NodeOrder order : {c4::conf::NodeOrder::depth_first, c4::conf::NodeOrder::breadth_first})
+    {
+        INFO("order=", (int)order);
+        c4::yml::Tree t = make_tree();
+        const std::string expected = emitstr(t);
+        const size_t size = t.size();
+        c4::conf::reorder_nodes(&t, order);
+        CHECK_EQ(emitstr(t), expected);
+        CHECK_EQ(t.size(), size);
+        CHECK_EQ(t.root_id(), 0u);
+        // the live nodes are the first ones
+        size_t num_visited = 0, max_id = 0;
+        std::vector<size_t> stack = {t.root_id()};
+        while(!stack.empty())
+        {
+            size_t node = stack.back();
+            stack.pop_back();
+            ++num_visited;
+            max_id = node > max_id ? node : max_id;
+            size_t prev = c4::yml::NONE;
+            for(size_t ch = t.first_child(node); ch != c4::yml::NONE; ch = t.next_sibling(ch))
+            {
+                CHECK_EQ(t.parent(ch), node);
+                CHECK_EQ(t.prev_sibling(ch), prev);
+                if(order == c4::conf::NodeOrder::breadth_first && prev != c4::yml::NONE)
+                    CHECK_EQ(ch, prev + 1u); // siblings are contiguous
+                if(order == c4::conf::NodeOrder::depth_first && prev == c4::yml::NONE)
+                    CHECK_EQ(ch, node + 1u); // the first child follows its parent
+                prev = ch;
+                stack.push_back(ch);
+            }
+        }
+        CHECK_EQ(num_visited, size);
+        CHECK_EQ(max_id, size - 1u);
+        // the free nodes are still usable
+        t["e"] << 5;
+        t["f"] << 6;
+        CHECK_EQ(t["e"].val(), "5");
+        CHECK_EQ(t["f"].val(), "6");
+        CHECK_EQ(t.size(), size + 2u);
+    }
+}
+
+TEST_CASE("compact_arena.finalize_workspace")
+{
+    MultipleFiles mf({
+        "# this comment is dead text\na: overridden value\nb: 1\n",
+        "a: replaced\n",
+    });
+    c4::yml::Tree tree_result, tree_expected;
+    c4::conf::Workspace ws(&tree_result);
+    for(const auto &file : mf.m_files)
+        ws.prepare_add_file(file.name());
+    for(const auto &file : mf.m_files)
+        ws.add_file(file.name());
+    const size_t arena_size = tree_result.arena_size();
+    CHECK_GT(ws.memory_report().workspace.node_capacity, 0u);
+    const size_t released = ws.finalize();
+    CHECK_GT(released, 0u);
+    CHECK_LT(tree_result.arena_size(), arena_size);
+    c4::yml::parse_in_arena("{a: replaced, b: 1}", &tree_expected);
+    CHECK_EQ(emitstr(tree_result), emitstr(tree_expected));
+    const c4::conf::MemoryReport report = ws.memory_report();
+    CHECK_EQ(report.output.arena_capacity, report.output.arena_referenced);
+    CHECK_EQ(report.workspace.node_capacity, 0u);
+    CHECK_EQ(report.dir_scratch_bytes, 0u);
+    CHECK_EQ(report.manifest_bytes, 0u);
+    // the workspace can still be used
+    ws.prepare_add_conf("b", "2");
+    ws.add_conf("b", "2");
+    CHECK_EQ(tree_result["b"].val(), "2");
+}
+
+TEST_CASE("workspace.reset_keeps_capacity")
+{
+    MultipleFiles mf({
+        "a: 0\nb: [0, 1, 2]\nc: {d: 0}\n",
+        "a: 1\nc: {e: 1}\n",
+    });
+    // the output trees must outlive the workspace
+    c4::yml::Tree tree_result, tree_expected, others[3];
+    c4::conf::Workspace ws(&tree_result);
+    for(const auto &file : mf.m_files)
+        ws.prepare_add_file(file.name());
+    for(const auto &file : mf.m_files)
+        ws.add_file(file.name());
+    c4::yml::parse_in_arena("{a: 1, b: [0, 1, 2], c: {d: 0, e: 1}}", &tree_expected);
+    CHECK_EQ(emitstr(tree_result), emitstr(tree_expected));
+    const size_t ws_capacity = ws.m_ws->capacity();
+    CHECK_GT(ws_capacity, 0u);
+    // load the same files again, into other trees
+    for(c4::yml::Tree &other : others)
+    {
+        ws.reset(&other);
+        CHECK_EQ(ws.m_output, &other);
+        CHECK_EQ(ws.m_ws->size(), 0u);
+        CHECK_EQ(ws.m_ws->capacity(), ws_capacity);
+        CHECK_FALSE(ws.m_load_started);
+        for(const auto &file : mf.m_files)
+            ws.prepare_add_file(file.name());
+        for(const auto &file : mf.m_files)
+            ws.add_file(file.name());
+        CHECK_EQ(emitstr(other), emitstr(tree_expected));
+        CHECK_EQ(ws.m_ws->capacity(), ws_capacity);
+    }
+}
+
+TEST_CASE("add_conf_in_place.copies_only_survivors")
+{
+    for(uint32_t flags : workspace_flags)
+    {
+        INFO("flags=", flags);
+        std::string first = "a: first_value\nb: [x, y]\nc: {d: e}\n";
+        std::string second = "{a: second_value, c: {f: g}}";
+        c4::yml::Tree tree_result, tree_expected;
+        c4::conf::Workspace ws(&tree_result, nullptr, flags);
+        ws.prepare_add_conf("", c4::to_csubstr(first));
+        ws.prepare_add_conf("c", c4::to_csubstr(second));
+        ws.add_conf_in_place("", c4::to_substr(first));
+        ws.add_conf_in_place("c", c4::to_substr(second));
+        ws.merge_pending();
+        // the output no longer depends on the buffers
+        first.assign(first.size(), 'X');
+        second.assign(second.size(), 'X');
+        c4::yml::parse_in_arena("{a: first_value, b: [x, y], c: {d: e, a: second_value, c: {f: g}}}", &tree_expected);
+        CHECK_EQ(emitstr(tree_result), emitstr(tree_expected));
+        if(!(flags & c4::conf::WS_DEFERRED_MERGE))
+        {
+            // only the surviving strings were copied
+            CHECK_LT(tree_result.arena_size(), first.size() + second.size());
+        }
+    }
+}
+
+TEST_CASE("add_conf_in_place.merges_into_existing_nodes")
+{
+    std::string first = "{a: 0, b: [x, y], c: {d: e, f: {g: h}}}";
+    std::string second = "b: [zz]\nc: {f: {g: hh, i: jj}}\n---\nk: [ll]\n";
+    c4::yml::Tree tree_result, tree_expected;
+    c4::conf::Workspace ws(&tree_result);
+    ws.prepare_add_conf("", c4::to_csubstr(first));
+    ws.prepare_add_conf("", c4::to_csubstr(second));
+    ws.add_conf_in_place("", c4::to_substr(first));
+    const size_t arena_size = tree_result.arena_size();
+    ws.add_conf_in_place("", c4::to_substr(second));
+    // the strings of the second conf were copied, appended to
+    // sequences or merged into maps
+    first.assign(first.size(), 'X');
+    second.assign(second.size(), 'X');
+    c4::yml::parse_in_arena("{a: 0, b: [x, y, zz], c: {d: e, f: {g: hh, i: jj}}, k: [ll]}", &tree_expected);
+    CHECK_EQ(emitstr(tree_result), emitstr(tree_expected));
+    CHECK_LT(tree_result.arena_size() - arena_size, second.size());
+}
+
+TEST_CASE("monotonic_resource.whole_load")
+{
+    MultipleFiles mf({
+        "a: 0\nb: [0, 1, 2]\nc: {d: 0}\n",
+        "a: 1\nc: {e: 1}\n",
+        "b: [3]\n",
+    });
+    for(bool hugepages : {false, true})
+    {
+        INFO("hugepages=", hugepages);
+        // a small block size, to force several blocks
+        c4::conf::MonotonicResource res(512u, hugepages);
+        {
+            c4::yml::Tree tree_result(res.callbacks()), tree_expected;
+            c4::conf::Workspace ws(&tree_result);
+            for(const auto &file : mf.m_files)
+                ws.prepare_add_file(file.name());
+            for(const auto &file : mf.m_files)
+                ws.add_file(file.name());
+            c4::yml::parse_in_arena("{a: 1, b: [3], c: {d: 0, e: 1}}", &tree_expected);
+            CHECK_EQ(emitstr(tree_result), emitstr(tree_expected));
+            CHECK_GT(res.m_num_blocks, hugepages ? 0u : 1u);
+            CHECK_GE(res.reserved(), res.allocated());
+        }
+        // every allocation is released at once
+        res.release();
+        CHECK_EQ(res.m_num_blocks, 0u);
+        CHECK_EQ(res.reserved(), 0u);
+        // and the resource can be reused
+        void *mem = res.allocate(100u);
+        CHECK_NE(mem, nullptr);
+        CHECK_EQ((uintptr_t)mem % alignof(std::max_align_t), 0u);
+        CHECK_EQ(res.allocated(), 100u);
+    }
+}
+
+TEST_CASE("monotonic_resource.upstream_error")
+{
+    struct ErrorData
+    {
+        void *received_user_data;
+        std::string msg;
+    } data = {nullptr, {}};
+    c4::yml::Callbacks upstream = c4::yml::get_callbacks();
+    upstream.m_user_data = &data;
+    upstream.m_error = [](const char *msg, size_t len, c4::yml::Location, void *user_data) {
+        ErrorData *d = (ErrorData*)user_data;
+        d->received_user_data = user_data;
+        d->msg.assign(msg, len);
+    };
+    c4::conf::MonotonicResource res(512u, false, upstream);
+    c4::yml::Callbacks cb = res.callbacks();
+    CHECK_EQ(cb.m_user_data, (void*)&res);
+    // errors are forwarded with the upstream user data
+    cb.m_error("the error", 9u, c4::yml::Location{}, cb.m_user_data);
+    CHECK_EQ(data.received_user_data, (void*)&data);
+    CHECK_EQ(data.msg, "the error");
+}
+
+TEST_CASE("snapshot.roundtrip")
+{
+    c4::yml::Tree tree_result, tree_loaded;
+    c4::conf::Workspace ws(&tree_result);
+    ws.prepare_add_conf("{a: 0, b: [1, 2, {c: 3}], d: {e: &anchor 4, f: !!str 5}}");
+    ws.prepare_add_conf("b[2].c=replaced");
+    ws.add_conf("{a: 0, b: [1, 2, {c: 3}], d: {e: &anchor 4, f: !!str 5}}");
+    ws.add_conf("b[2].c=replaced");
+    // strings outside of the arena must also be saved
+    char outside[] = "outside";
+    tree_result.set_val(tree_result.first_child(tree_result.root_id()), c4::to_csubstr(outside));
+    std::string expected = emitstr(tree_result);
+    std::vector<char> buf;
+    size_t sz = c4::conf::save_snapshot(tree_result, {});
+    buf.resize(sz);
+    CHECK_EQ(c4::conf::save_snapshot(tree_result, c4::to_substr(buf)), sz);
+    outside[0] = 'X';
+    REQUIRE(c4::conf::load_snapshot(c4::to_csubstr(buf), &tree_loaded));
+    CHECK_EQ(emitstr(tree_loaded), expected);
+    CHECK_EQ(tree_loaded.size(), tree_result.size());
+    // the loaded tree owns all its strings
+    CHECK(tree_loaded.in_arena(tree_loaded.val(tree_loaded.first_child(tree_loaded.root_id()))));
+    // and it can still be modified
+    c4::conf::Workspace ws2(&tree_loaded);
+    ws2.prepare_add_conf("a=1");
+    ws2.add_conf("a=1");
+    CHECK_EQ(tree_loaded["a"].val(), "1");
+}
+
+TEST_CASE("snapshot.rejects_incompatible")
+{
+    c4::yml::Tree tree_result = c4::yml::parse_in_arena("{a: 0, b: [1, 2]}");
+    std::vector<char> buf(c4::conf::save_snapshot(tree_result, {}));
+    c4::conf::save_snapshot(tree_result, c4::to_substr(buf));
+    c4::yml::Tree tree_loaded;
+    REQUIRE(c4::conf::load_snapshot(c4::to_csubstr(buf), &tree_loaded));
+    const std::string expected = emitstr(tree_loaded);
+    // a rejected snapshot leaves the tree untouched
+    auto check_rejected = [&](size_t byte_pos){
+        INFO("byte_pos=", byte_pos);
+        std::vector<char> copy = buf;
+        copy[byte_pos] ^= 0x5a;
+        CHECK_FALSE(c4::conf::load_snapshot(c4::to_csubstr(copy), &tree_loaded));
+        CHECK_EQ(emitstr(tree_loaded), expected);
+    };
+    check_rejected(0);  // magic
+    check_rejected(8);  // version
+    check_rejected(12); // endianness
+    check_rejected(16); // type signature
+    check_rejected(24); // number of nodes
+    check_rejected(32); // string size
+    // the node records follow the 40-byte header, and are 112 bytes
+    // each, starting with the node type
+    auto check_type_rejected = [&](size_t node, uint64_t set, uint64_t unset){
+        INFO("node=", node);
+        std::vector<char> copy = buf;
+        const size_t pos = 40u + node * 112u;
+        uint64_t type;
+        memcpy(&type, copy.data() + pos, sizeof(type));
+        type = (type | set) & ~unset;
+        memcpy(copy.data() + pos, &type, sizeof(type));
+        CHECK_FALSE(c4::conf::load_snapshot(c4::to_csubstr(copy), &tree_loaded));
+        CHECK_EQ(emitstr(tree_loaded), expected);
+    };
+    check_type_rejected(0, uint64_t(1) << 63u, 0); // unknown type bits
+    check_type_rejected(0, 0, c4::yml::MAP|c4::yml::SEQ); // the parent of a node is not a container
+    check_type_rejected(1, 0, c4::yml::KEY); // a child of a map without a key
+    check_type_rejected(3, c4::yml::KEY, 0); // a child of a seq with a key
+    CHECK_FALSE(c4::conf::load_snapshot(c4::to_csubstr(buf).first(buf.size() - 1), &tree_loaded));
+    CHECK_FALSE(c4::conf::load_snapshot("not a snapshot", &tree_loaded));
+    CHECK_EQ(emitstr(tree_loaded), expected);
+}
+
+TEST_CASE("snapshot.deep_tree")
+{
+    // deep enough to overflow the stack if the tree was walked
+    // recursively
+    const size_t depth = 100000u;
+    c4::yml::Tree tree_result = c4::yml::parse_in_arena("[]");
+    size_t node = tree_result.root_id();
+    for(size_t i = 0; i < depth; ++i)
+    {
+        node = tree_result.append_child(node);
+        tree_result.to_seq(node);
+    }
+    std::vector<char> buf(c4::conf::save_snapshot(tree_result, {}));
+    c4::conf::save_snapshot(tree_result, c4::to_substr(buf));
+    c4::yml::Tree tree_loaded;
+    REQUIRE(c4::conf::load_snapshot(c4::to_csubstr(buf), &tree_loaded));
+    REQUIRE_EQ(tree_loaded.size(), tree_result.size());
+    size_t loaded_depth = 0;
+    for(node = tree_loaded.root_id(); tree_loaded.has_children(node); node = tree_loaded.first_child(node))
+        ++loaded_depth;
+    CHECK_EQ(loaded_depth, depth);
+}
+
+TEST_CASE("snapshot.file")
+{
+    c4::yml::Tree tree_result = c4::yml::parse_in_arena("{a: 0, b: [1, 2], c: {d: e}}");
+    c4::fs::ScopedTmpFile file;
+    REQUIRE(c4::conf::save_snapshot_file(tree_result, file.name()));
+    c4::yml::Tree tree_loaded;
+    REQUIRE(c4::conf::load_snapshot_file(file.name(), &tree_loaded));
+    CHECK_EQ(emitstr(tree_loaded), emitstr(tree_result));
+    c4::fs::file_put_contents(file.name(), c4::csubstr("a: 0"));
+    CHECK_FALSE(c4::conf::load_snapshot_file(file.name(), &tree_loaded));
+}
+
+TEST_CASE("deferred_merge.same_as_sequential")
+{
+    const MultipleConfsSpec confs = {
+        "{a: 0, b: {c: 1, d: [2, 3]}, e: [4]}",
+        "{b: {d: [5], f: {g: 6}}, e: 7, h: 8}",
+        "{b: {c: ~, f: {g: 9, i: 10}}, e: [11, 12], j: {k: 13}}",
+        "{b: {c: {l: 14}, d: [15]}, h: [16], e: [17]}",
+        "{j: ~}",
+        "{j: {m: 18}, b: {f: 19}, a: {n: 20}}",
+        "{b: {f: {o: 21}, d: 22}, h: [23, {p: 24}]}",
+        "b.d=[25, 26]",
+        "b.d=[27]",
+        "b.f.o=28",
+        "b.f.o={q: 29}",
+        "b.f.o={r: 30}",
+        "h[2].p=31",
+        "h[2].p=32",
+    };
+    auto load = [&](uint32_t flags){
+        c4::yml::Tree t;
+        c4::conf::Workspace ws(&t, nullptr, flags);
+        for(c4::csubstr conf : confs)
+        {
+            if(conf.begins_with('{'))
+                ws.prepare_add_conf("", conf);
+            else
+                ws.prepare_add_conf(conf);
+        }
+        for(c4::csubstr conf : confs)
+        {
+            if(conf.begins_with('{'))
+                ws.add_conf("", conf);
+            else
+                ws.add_conf(conf);
+        }
+        ws.merge_pending();
+        return emitstr(t);
+    };
+    CHECK_EQ(load(c4::conf::WS_DEFERRED_MERGE), load(c4::conf::WS_DEFAULT));
+}
+
+TEST_CASE("compiled_path.segments")
+{
+    c4::conf::CompiledPath path("a.b[2].c[10] ");
+    CHECK_EQ(path.path(), "a.b[2].c[10]");
+    REQUIRE_EQ(path.size(), 5u);
+    CHECK_EQ(path[0].key, "a");
+    CHECK_EQ(path[1].key, "b");
+    CHECK(path[2].is_index());
+    CHECK_EQ(path[2].index, 2u);
+    CHECK_EQ(path[3].key, "c");
+    CHECK(path[4].is_index());
+    CHECK_EQ(path[4].index, 10u);
+    CHECK_EQ(path[0].hash, c4::conf::CompiledPath("a").back().hash);
+    CHECK_NE(path[0].hash, path[1].hash);
+    path.compile("");
+    CHECK(path.empty());
+}
+
+TEST_CASE("compiled_path.lookup")
+{
+    c4::yml::Tree t = c4::yml::parse_in_arena("{a: {b: [0, 1, {c: 2}]}, d: 3}");
+    c4::conf::CompiledPath path("a.b[2].c");
+    size_t node = path.lookup(t);
+    REQUIRE_NE(node, c4::yml::NONE);
+    CHECK_EQ(t.val(node), "2");
+    path.compile("a.b.1");
+    REQUIRE_NE(path.lookup(t), c4::yml::NONE);
+    CHECK_EQ(t.val(path.lookup(t)), "1");
+    path.compile("a.b[3]");
+    CHECK_EQ(path.lookup(t), c4::yml::NONE);
+    path.compile("a.x");
+    CHECK_EQ(path.lookup(t), c4::yml::NONE);
+    // lookup from a start node
+    path.compile("b[0]");
+    CHECK_EQ(t.val(path.lookup(t, t.find_child(t.root_id(), "a"))), "0");
+    // nothing was created
+    CHECK_EQ(emitstr(t), emitstr(c4::yml::parse_in_arena("{a: {b: [0, 1, {c: 2}]}, d: 3}")));
+}
+
+TEST_CASE("compiled_path.lookup_or_modify")
+{
+    c4::yml::Tree t = c4::yml::parse_in_arena("{a: {b: [0]}, d: 3}");
+    c4::conf::CompiledPath path("a.b[2].c");
+    size_t node = path.lookup_or_modify(&t);
+    t.set_val(node, "new");
+    CHECK_EQ(path.lookup(t), node);
+    path.compile("d.e");
+    t.set_val(path.lookup_or_modify(&t), "f");
+    CHECK_EQ(emitstr(t), emitstr(c4::yml::parse_in_arena("{a: {b: [0, , {c: new}]}, d: {e: f}}")));
+}
+
+TEST_CASE("compiled_path.reused_in_workspace")
+{
+    c4::yml::Tree t;
+    c4::conf::Workspace ws(&t);
+    c4::conf::CompiledPath path("a.b[0].c");
+    const c4::csubstr vals[] = {"0", "{d: 1}", "{e: 2}", "[3, 4]"};
+    for(c4::csubstr val : vals)
+        ws.prepare_add_conf(path, val);
+    for(c4::csubstr val : vals)
+        ws.add_conf(path, val);
+    CHECK_EQ(emitstr(t), emitstr(c4::yml::parse_in_arena("{a: {b: [{c: [3, 4]}]}}")));
+}
+
+struct BoundSettings
+{
+    int num_threads = -1;
+    std::string name;
+    int first_port = -1;
+    int second_port = -1;
+    double ratio = -1.;
+    int missing = -1;
+};
+
+const c4::conf::BoundField bound_settings_fields[] = {
+    C4CONF_FIELD(BoundSettings, num_threads, "app.threads"),
+    C4CONF_FIELD(BoundSettings, name, "app.name"),
+    C4CONF_FIELD(BoundSettings, first_port, "app.ports[0]"),
+    C4CONF_FIELD(BoundSettings, second_port, "app.ports[1]"),
+    C4CONF_FIELD(BoundSettings, ratio, "ratio"),
+    C4CONF_FIELD(BoundSettings, missing, "app.missing"),
+};
+
+TEST_CASE("binding.fills_struct")
+{
+    c4::yml::Tree t = c4::yml::parse_in_arena("{ratio: 0.5, other: {threads: 1}, app: {ports: [80, 443, 8080], name: server, threads: 4}}");
+    c4::conf::Binding binding(bound_settings_fields);
+    BoundSettings settings;
+    CHECK_EQ(binding.bind(t, &settings), 5u);
+    CHECK_EQ(settings.num_threads, 4);
+    CHECK_EQ(settings.name, "server");
+    CHECK_EQ(settings.first_port, 80);
+    CHECK_EQ(settings.second_port, 443);
+    CHECK_EQ(settings.ratio, 0.5);
+    CHECK_EQ(settings.missing, -1);
+    // the trie shares the common prefixes
+    // root, app, threads, name, ports, [0], [1], ratio, missing
+    CHECK_EQ(binding.m_trie_size, 9u);
+}
+
+TEST_CASE("binding.from_start_node")
+{
+    c4::yml::Tree t = c4::yml::parse_in_arena("{outer: {app: {threads: 8}}, app: {threads: 2}}");
+    c4::conf::Binding binding(bound_settings_fields);
+    BoundSettings settings;
+    CHECK_EQ(binding.bind(t, &settings, t.find_child(t.root_id(), "outer")), 1u);
+    CHECK_EQ(settings.num_threads, 8);
+    c4::yml::Tree empty;
+    CHECK_EQ(binding.bind(empty, &settings), 0u);
+}
+
+TEST_CASE("path_index.finds_every_node")
+{
+    c4::yml::Tree t = c4::yml::parse_in_arena("{a: {b: [0, 1, {c: 2, d: [3]}]}, e: 4, f: [[5, 6], {g: 7}]}");
+    c4::conf::PathIndex index(t);
+    CHECK_EQ(index.size(), t.size());
+    c4::conf::CompiledPath compiled;
+    for(c4::csubstr path : {
+            c4::csubstr(""),
+            c4::csubstr("a"),
+            c4::csubstr("a.b"),
+            c4::csubstr("a.b[0]"),
+            c4::csubstr("a.b[2].c"),
+            c4::csubstr("a.b[2].d[0]"),
+            c4::csubstr("e"),
+            c4::csubstr("f[0][1]"),
+            c4::csubstr("f[1].g"),
+        })
+    {
+        INFO("path=", path);
+        compiled.compile(path);
+        const size_t expected = compiled.lookup(t);
+        REQUIRE_NE(expected, c4::yml::NONE);
+        CHECK_EQ(index.find(path), expected);
+        CHECK_EQ(index.find(compiled), expected);
+    }
+    for(c4::csubstr path : {
+            c4::csubstr("x"),
+            c4::csubstr("a.x"),
+            c4::csubstr("a.b[3]"),
+            c4::csubstr("a[0]"),
+            c4::csubstr("e.a"),
+            c4::csubstr("f[1].g.h"),
+            c4::csubstr("b[2].c"),
+        })
+    {
+        INFO("path=", path);
+        CHECK_EQ(index.find(path), c4::yml::NONE);
+        compiled.compile(path);
+        CHECK_EQ(index.find(compiled), c4::yml::NONE);
+    }
+}
+
+TEST_CASE("path_index.rebuild")
+{
+    c4::yml::Tree t = c4::yml::parse_in_arena("{a: {b: 0}}");
+    c4::conf::PathIndex index;
+    CHECK_EQ(index.find("a.b"), c4::yml::NONE);
+    index.build(t);
+    CHECK_EQ(t.val(index.find("a.b")), "0");
+    c4::conf::Workspace ws(&t);
+    ws.prepare_add_conf("a.c[1]=1");
+    ws.add_conf("a.c[1]=1");
+    index.build(t);
+    CHECK_EQ(t.val(index.find("a.c[1]")), "1");
+    // relative to a start node
+    index.build(t, t.find_child(t.root_id(), "a"));
+    CHECK_EQ(t.val(index.find("b")), "0");
+    CHECK_EQ(index.find("a.b"), c4::yml::NONE);
+}
+
+TEST_CASE("publisher.readers_see_whole_snapshots")
+{
+    c4::conf::ConfigPublisher publisher(4);
+    // each hazard slot is in its own cache line
+    CHECK_EQ((uintptr_t)publisher.m_slots % 64u, 0u);
+    CHECK_EQ(sizeof(c4::conf::ConfigPublisher::HazardSlot), 64u);
+    CHECK_FALSE(publisher.read());
+    CHECK_FALSE(publisher.acquire());
+    publisher.publish(c4::yml::parse_in_arena("{version: 0, a: 0, b: 0}"));
+    c4::conf::SnapshotRef first = publisher.acquire();
+    REQUIRE(first);
+    std::atomic<bool> done(false);
+    std::atomic<size_t> num_bad(0);
+    std::atomic<size_t> num_reads(0);
+    auto reader = [&]{
+        while(!done.load())
+        {
+            auto guard = publisher.read();
+            if(!guard)
+            {
+                ++num_bad;
+                continue;
+            }
+            // every field of a snapshot has the same value
+            c4::yml::Tree const& t = guard->tree();
+            c4::csubstr version = t.val(guard->find("version"));
+            if(t.val(guard->find("a")) != version || t.val(guard->find("b")) != version)
+                ++num_bad;
+            ++num_reads;
+        }
+    };
+    std::vector<std::thread> readers;
+    for(size_t i = 0; i < 6; ++i) // more threads than slots
+        readers.emplace_back(reader);
+    for(int i = 1; i < 100; ++i)
+    {
+        std::string yml = "{version: " + std::to_string(i) + ", a: " + std::to_string(i) + ", b: " + std::to_string(i) + "}";
+        publisher.publish(c4::yml::parse_in_arena(c4::to_csubstr(yml)));
+    }
+    done = true;
+    for(std::thread &t : readers)
+        t.join();
+    CHECK_EQ(num_bad.load(), 0u);
+    CHECK_GT(num_reads.load(), 0u);
+    {
+        auto guard = publisher.read();
+        CHECK_EQ(guard->tree().val(guard->find("version")), "99");
+    }
+    // the acquired snapshot is still alive and unchanged
+    CHECK_EQ(first->tree().val(first->find("version")), "0");
+}
@@ -0,0 +1,51 @@
+#ifndef C4CONF_TEST_COMMON_HPP_
+#define C4CONF_TEST_COMMON_HPP_
+
+#include <c4/std/string.hpp>
+#include <c4/conf/conf.hpp>
+#include <c4/fs/fs.hpp>
+#include <doctest/doctest.h>
+
+#include <initializer_list>
+#include <string>
+#include <vector>
+
+
+using MultipleFilesSpec = std::initializer_list<c4::csubstr>;
+
+
+// from multiple strings, create corresponding multiple files
+// to allow loading from the file system
+struct MultipleFiles
+{
+    std::vector<c4::fs::ScopedTmpFile> m_files;
+    MultipleFiles(MultipleFilesSpec contents)
+        : m_files(contents.begin(), contents.end())
+    {
+        size_t i = 0;
+        for(c4::csubstr cont : contents)
+        {
+            INFO("i=", i);
+            std::string actual = c4::fs::file_get_contents<std::string>(m_files[i].name());
+            CHECK_EQ(c4::to_csubstr(actual), cont);
+            i++;
+        }
+    }
+};
+
+inline std::string emitstr(c4::yml::Tree const& tree)
+{
+    return c4::yml::emitrs_yaml<std::string>(tree);
+}
+
+// the workspace flags with which each case is tested
+const uint32_t workspace_flags[] = {
+    c4::conf::WS_DEFAULT,
+    c4::conf::WS_MMAP_FILES,
+    c4::conf::WS_PARALLEL_DIRS,
+    c4::conf::WS_PARALLEL_DIRS|c4::conf::WS_MMAP_FILES,
+    c4::conf::WS_DEFERRED_MERGE,
+    c4::conf::WS_DEFERRED_MERGE|c4::conf::WS_PARALLEL_DIRS,
+};
+
+#endif /* C4CONF_TEST_COMMON_HPP_ */
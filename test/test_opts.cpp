@@ -4,9 +4,15 @@
 #include <c4/span.hpp>
 #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
 #include <doctest/doctest.h>
+#include "./test_common.hpp"
 
 #include <vector>
 #include <string>
+#include <stdexcept>
+
+#if defined(C4_POSIX)
+#include <unistd.h>
+#endif
 
 C4_SUPPRESS_WARNING_GCC_CLANG_PUSH
 C4_SUPPRESS_WARNING_GCC_CLANG("-Wold-style-cast")
@@ -54,7 +60,7 @@ key1:
 void action1(yml::Tree &t, csubstr) { t["key0"]["key0val0"][0].set_val("key0val0val0-action1"); }
 void action2(yml::Tree &t, csubstr) { t["key0"]["key0val0"][0].set_val("key0val0val0-action2"); }
 
-const ConfigActionSpec specs_buf[] = {
+constexpr const ConfigActionSpec specs_buf[] = {
     spec_for<ConfigAction::set_node>("-n", "--node"),
     spec_for<ConfigAction::load_file>("-f", "--file"),
     spec_for<ConfigAction::load_dir>("-d", "--dir"),
@@ -62,6 +68,7 @@ const ConfigActionSpec specs_buf[] = {
     {ConfigAction::callback, action2, csubstr("-a2"), csubstr("--action2" ), csubstr{}                 , csubstr("action 2")},
     {ConfigAction::callback, action2, csubstr("-o" ), csubstr("--optional"), csubstr("[<optionalval>]"), csubstr{}},
 };
+C4CONF_STATIC_CHECK_SPECS(specs_buf);
 
 
 //-----------------------------------------------------------------------------
@@ -103,6 +110,136 @@ TEST_CASE("opts.optional_args_are_not_mandatory")
 }
 
 
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+TEST_CASE("opts.option_table")
+{
+    const ConfigActionSpec dup_specs[] = {
+        spec_for<ConfigAction::set_node>("-n", "--node"),
+        spec_for<ConfigAction::load_file>("-n", "--file"),
+    };
+    OptionTable table(specs_buf);
+    for(ConfigActionSpec const& spec : specs_buf)
+    {
+        CHECK_EQ(table.find(spec.optshort), &spec);
+        CHECK_EQ(table.find(spec.optlong), &spec);
+    }
+    CHECK_EQ(table.find("-x"), nullptr);
+    CHECK_EQ(table.find("--nod"), nullptr);
+    CHECK_EQ(table.find(""), nullptr);
+    OptionTable dup_table(dup_specs);
+    CHECK_EQ(dup_table.find("-n"), &dup_specs[0]);
+    CHECK_EQ(dup_table.find("--file"), &dup_specs[1]);
+}
+
+constexpr const ConfigActionSpec specs_unnamed[] = {{ConfigAction::callback, action1, csubstr{}, csubstr{}, csubstr{}, csubstr{}}};
+constexpr const ConfigActionSpec specs_no_dash[] = {{ConfigAction::callback, action1, csubstr("a"), csubstr{}, csubstr{}, csubstr{}}};
+constexpr const ConfigActionSpec specs_same_names[] = {{ConfigAction::callback, action1, csubstr("-a"), csubstr("-a"), csubstr{}, csubstr{}}};
+constexpr const ConfigActionSpec specs_dup_short[] = {spec_for<ConfigAction::set_node>("-n", "--node"), spec_for<ConfigAction::load_file>("-n", "--file")};
+constexpr const ConfigActionSpec specs_dup_cross[] = {spec_for<ConfigAction::set_node>("-n", "--node"), spec_for<ConfigAction::load_file>("--node", "--file")};
+constexpr const ConfigActionSpec specs_no_callback[] = {{ConfigAction::callback, nullptr, csubstr("-a"), csubstr{}, csubstr{}, csubstr{}}};
+constexpr const ConfigActionSpec specs_unclosed[] = {{ConfigAction::callback, action1, csubstr("-a"), csubstr{}, csubstr("[<val>"), csubstr{}}};
+constexpr const ConfigActionSpec specs_unopened[] = {{ConfigAction::callback, action1, csubstr("-a"), csubstr{}, csubstr("<val>]"), csubstr{}}};
+constexpr const ConfigActionSpec specs_nested_angle[] = {{ConfigAction::callback, action1, csubstr("-a"), csubstr{}, csubstr("<<val>>"), csubstr{}}};
+static_assert(!specs_have_valid_names(specs_unnamed, C4_COUNTOF(specs_unnamed)), "");
+static_assert(!specs_have_valid_names(specs_no_dash, C4_COUNTOF(specs_no_dash)), "");
+static_assert(!specs_have_valid_names(specs_same_names, C4_COUNTOF(specs_same_names)), "");
+static_assert(!specs_are_unique(specs_dup_short, C4_COUNTOF(specs_dup_short)), "");
+static_assert(!specs_are_unique(specs_dup_cross, C4_COUNTOF(specs_dup_cross)), "");
+static_assert(!specs_have_valid_callbacks(specs_no_callback, C4_COUNTOF(specs_no_callback)), "");
+static_assert(!specs_have_valid_dummynames(specs_unclosed, C4_COUNTOF(specs_unclosed)), "");
+static_assert(!specs_have_valid_dummynames(specs_unopened, C4_COUNTOF(specs_unopened)), "");
+static_assert(!specs_have_valid_dummynames(specs_nested_angle, C4_COUNTOF(specs_nested_angle)), "");
+static_assert(help_prefix_width(spec_for<ConfigAction::set_node>("-n", "--node")) == 2u + 2u + 1u + 26u + 2u + 6u + 1u + 26u, "");
+
+constexpr const SpecTable<C4_COUNTOF(specs_buf)> specs_table = make_spec_table(specs_buf);
+static_assert(specs_table.size() == C4_COUNTOF(specs_buf), "");
+static_assert(specs_table.prefix_widths[0] == help_prefix_width(specs_buf[0]), "");
+static_assert(specs_table.capacity() >= 4u * C4_COUNTOF(specs_buf), "");
+constexpr const SpecTable<C4_COUNTOF(specs_dup_short)> dup_specs_table = make_spec_table(specs_dup_short);
+
+TEST_CASE("opts.spec_table")
+{
+    OptionTable table(specs_table);
+    CHECK_EQ(table.m_table, specs_table.slots); // borrowed, not allocated
+    for(ConfigActionSpec const& spec : specs_buf)
+    {
+        CHECK_EQ(table.find(spec.optshort), &spec);
+        CHECK_EQ(table.find(spec.optlong), &spec);
+    }
+    CHECK_EQ(table.find("-x"), nullptr);
+    // same layout as the table built at runtime
+    OptionTable runtime_table(specs_buf);
+    REQUIRE_EQ(runtime_table.m_capacity, table.m_capacity);
+    for(size_t i = 0; i < table.m_capacity; ++i)
+    {
+        INFO("i=", i);
+        CHECK_EQ(runtime_table.m_table[i].spec, table.m_table[i].spec);
+        CHECK_EQ(runtime_table.m_table[i].hash, table.m_table[i].hash);
+    }
+    OptionTable dup_table(dup_specs_table);
+    CHECK_EQ(dup_table.find("-n"), &specs_dup_short[0]);
+    CHECK_EQ(dup_table.find("--file"), &specs_dup_short[1]);
+    std::string help_from_specs, help_from_table;
+    print_help([&](csubstr s){ help_from_specs.append(s.str, s.len); }, specs_buf, C4_COUNTOF(specs_buf), "title");
+    print_help([&](csubstr s){ help_from_table.append(s.str, s.len); }, specs_table, "title");
+    CHECK_EQ(help_from_table, help_from_specs);
+    CHECK_NE(help_from_table.find("--optional [<optionalval>]"), std::string::npos);
+}
+
+TEST_CASE("opts.option_table_with_many_args")
+{
+    OptionTable table(specs_buf);
+    std::vector<std::string> args_buf;
+    std::vector<std::string> filtered_buf;
+    for(size_t i = 0; i < 2000; ++i)
+    {
+        args_buf.push_back("-n");
+        args_buf.push_back("key" + std::to_string(i) + "=val");
+        args_buf.push_back("--other" + std::to_string(i));
+        filtered_buf.push_back(args_buf.back());
+        args_buf.push_back("--optional");
+    }
+    std::vector<char*> args = to_args(args_buf);
+    int argc = (int)args.size();
+    char ** argv = args.data();
+    std::vector<ParsedOpt> opts;
+    REQUIRE(parse_opts(&argc, &argv, table, &opts));
+    REQUIRE_EQ(opts.size(), 4000u);
+    REQUIRE_EQ((size_t)argc, filtered_buf.size());
+    for(size_t i = 0; i < 2000; ++i)
+    {
+        INFO("i=", i);
+        CHECK_EQ(opts[2 * i].action, ConfigAction::set_node);
+        CHECK_EQ(opts[2 * i].target, to_csubstr(args_buf[4 * i + 1]).first(to_csubstr(args_buf[4 * i + 1]).find('=')));
+        CHECK_EQ(opts[2 * i + 1].action, ConfigAction::callback);
+        CHECK(opts[2 * i + 1].payload.empty());
+        CHECK_EQ(to_csubstr(argv[i]), to_csubstr(filtered_buf[i]));
+    }
+    // on error, the args and the container are left unchanged
+    std::vector<std::string> bad_buf = {"-n", "key=val", "--other", "-n"};
+    args = to_args(bad_buf);
+    argc = (int)args.size();
+    argv = args.data();
+    CHECK_FALSE(parse_opts(&argc, &argv, table, &opts));
+    CHECK_EQ(opts.size(), 4000u);
+    CHECK_EQ((size_t)argc, bad_buf.size());
+    CHECK_EQ(argv, args.data());
+    for(size_t i = 0; i < bad_buf.size(); ++i)
+        CHECK_EQ(to_csubstr(argv[i]), to_csubstr(bad_buf[i]));
+    for(size_t i = 0; i < 2000; ++i)
+    {
+        INFO("i=", i);
+        CHECK_EQ(opts[2 * i].action, ConfigAction::set_node);
+        CHECK_EQ(opts[2 * i].target, to_csubstr(args_buf[4 * i + 1]).first(to_csubstr(args_buf[4 * i + 1]).find('=')));
+        CHECK_EQ(opts[2 * i + 1].action, ConfigAction::callback);
+        CHECK(opts[2 * i + 1].payload.empty());
+    }
+}
+
+
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
@@ -343,6 +480,80 @@ TEST_CASE("opts.load_file_to_node")
               expected_tree);
 }
 
+TEST_CASE("opts.load_json")
+{
+    case1files setup;
+    if(fs::dir_exists("jsondir"))
+        C4_CHECK(fs::rmtree("jsondir") == 0);
+    C4_CHECK(fs::mkdir("jsondir") == 0);
+    fs::file_put_contents("jsondir/file0.json", csubstr("{\"key0\": {\"key0val0\": \"now replaced as a scalar\"}}"));
+    fs::file_put_contents("jsondir/file1.yml", csubstr("key1: {key1val0: this one too}"));
+    yml::Tree expected_tree = yml::parse_in_arena(reftree);
+    setup.transform1(&expected_tree);
+    SUBCASE("file")
+    {
+        ParsedOpt expected_args[] = {
+            {ConfigAction::load_file, {}, csubstr("jsondir/file0.json"), {}},
+            {ConfigAction::load_file, {}, csubstr("jsondir/file1.yml"), {}},
+        };
+        test_opts({"-f", "jsondir/file0.json", "-f", "jsondir/file1.yml"},
+                  {},
+                  expected_args,
+                  expected_tree);
+    }
+    SUBCASE("dir")
+    {
+        ParsedOpt expected_args[] = {
+            {ConfigAction::load_dir, {}, csubstr("jsondir"), {}},
+        };
+        test_opts({"-d", "jsondir"},
+                  {},
+                  expected_args,
+                  expected_tree);
+    }
+    C4_CHECK(fs::rmtree("jsondir") == 0);
+}
+
+TEST_CASE("opts.load_stream")
+{
+    case1files setup;
+    fs::file_put_contents("somedir_to_node/stream", csubstr(R"(---
+key0: {key0val0: first}
+---
+---
+key0: {key0val0: now replaced as a scalar}
+---
+key1: {key1val0: this one too}
+)"));
+    fs::file_put_contents("somedir_to_key1/stream", csubstr(R"(---
+key1val0: first
+--- {key1val0: this one too}
+)"));
+    yml::Tree expected_tree = yml::parse_in_arena(reftree);
+    setup.transform1(&expected_tree);
+    SUBCASE("root")
+    {
+        ParsedOpt expected_args[] = {
+            {ConfigAction::load_file, {}, csubstr("somedir_to_node/stream"), {}},
+        };
+        test_opts({"-f", "somedir_to_node/stream"},
+                  {},
+                  expected_args,
+                  expected_tree);
+    }
+    SUBCASE("node")
+    {
+        ParsedOpt expected_args[] = {
+            {ConfigAction::load_file, csubstr("key0"), csubstr("somedir_to_node/file0"), {}},
+            {ConfigAction::load_file, csubstr("key1"), csubstr("somedir_to_key1/stream"), {}},
+        };
+        test_opts({"-f", "key0=somedir_to_node/file0", "-f", "key1=somedir_to_key1/stream"},
+                  {},
+                  expected_args,
+                  expected_tree);
+    }
+}
+
 TEST_CASE("opts.load_dir")
 {
     case1files setup;
@@ -357,6 +568,380 @@ TEST_CASE("opts.load_dir")
               expected_tree);
 }
 
+TEST_CASE("opts.load_dir_lists_once")
+{
+    case1files setup;
+    yml::Tree expected_tree = yml::parse_in_arena(reftree);
+    setup.transform2(&expected_tree);
+    yml::Tree output = yml::parse_in_arena(reftree);
+    Workspace ws(&output);
+    ws.prepare_add_dir("somedir");
+    REQUIRE_EQ(ws.m_manifests.required_size, 1u);
+    CHECK_EQ(ws.m_manifests.buf[0].num_files, 4u);
+    ws.prepare_add_dir("somedir");
+    CHECK_EQ(ws.m_manifests.required_size, 1u);
+    ws.add_dir("somedir");
+    CHECK_EQ(ws.m_manifests.required_size, 1u);
+    CHECK_EQ(yml::emitrs_yaml<std::string>(output), yml::emitrs_yaml<std::string>(expected_tree));
+}
+
+TEST_CASE("opts.load_dir_recursive")
+{
+    auto mkdir = [](const char *d){
+        if(fs::dir_exists(d))
+            C4_CHECK(fs::rmtree(d) == 0);
+        C4_CHECK(fs::mkdir(d) == 0);
+    };
+    mkdir("rdir");
+    mkdir("rdir/sub");
+    mkdir("rdir/sub/deeper");
+    mkdir("rdir/skipped");
+    fs::file_put_contents("rdir/a.yml", csubstr("{a: 0, last: a}"));
+    fs::file_put_contents("rdir/notes.txt", csubstr("{notes: 0, last: notes}"));
+    fs::file_put_contents("rdir/sub/b.yml", csubstr("{b: 1, last: b}"));
+    fs::file_put_contents("rdir/sub/deeper/c.yaml", csubstr("{c: 2, last: c}"));
+    fs::file_put_contents("rdir/skipped/d.yml", csubstr("{d: 3, last: d}"));
+    auto load = [](ConfigAction action, csubstr include, csubstr exclude){
+        const ParsedOpt args[] = {{action, {}, csubstr("rdir"), {}}};
+        yml::Tree output = yml::parse_in_arena("{}");
+        Workspace ws(&output);
+        ws.m_dir_include = include;
+        ws.m_dir_exclude = exclude;
+        ws.apply_opts(args, C4_COUNTOF(args));
+        return yml::emitrs_yaml<std::string>(output);
+    };
+    SUBCASE("flat")
+    {
+        CHECK_EQ(load(ConfigAction::load_dir, {}, {}), "a: 0\nlast: notes\nnotes: 0\n");
+    }
+    SUBCASE("recursive")
+    {
+        CHECK_EQ(load(ConfigAction::load_dir_recursive, {}, {}), "a: 0\nlast: c\nnotes: 0\nd: 3\nb: 1\nc: 2\n");
+    }
+    SUBCASE("include")
+    {
+        CHECK_EQ(load(ConfigAction::load_dir_recursive, "*.yml, *.yaml", {}), "a: 0\nlast: c\nd: 3\nb: 1\nc: 2\n");
+        CHECK_EQ(load(ConfigAction::load_dir_recursive, "?.yml", {}), "a: 0\nlast: b\nd: 3\nb: 1\n");
+    }
+    SUBCASE("exclude")
+    {
+        CHECK_EQ(load(ConfigAction::load_dir_recursive, "*.y*ml", "skipped,deeper"), "a: 0\nlast: b\nb: 1\n");
+        CHECK_EQ(load(ConfigAction::load_dir_recursive, {}, "*.txt,skip*"), "a: 0\nlast: c\nb: 1\nc: 2\n");
+    }
+    SUBCASE("listed once")
+    {
+        yml::Tree output = yml::parse_in_arena("{}");
+        Workspace ws(&output);
+        ws.prepare_add_dir_recursive("rdir");
+        ws.prepare_add_dir("rdir");
+        REQUIRE_EQ(ws.m_manifests.required_size, 2u);
+        CHECK_EQ(ws.m_manifests.buf[0].num_files, 5u);
+        CHECK_EQ(ws.m_manifests.buf[1].num_files, 2u);
+        ws.add_dir_recursive("rdir");
+        CHECK_EQ(ws.m_manifests.required_size, 2u);
+    }
+    #if defined(C4_POSIX)
+    SUBCASE("symlink loop")
+    {
+        // symlinks to directories are followed, except when they
+        // lead to a directory which is already being listed
+        REQUIRE_EQ(::symlink("..", "rdir/sub/loop"), 0);
+        REQUIRE_EQ(::symlink("deeper", "rdir/sub/link"), 0);
+        CHECK_EQ(load(ConfigAction::load_dir_recursive, {}, {}), "a: 0\nlast: c\nnotes: 0\nd: 3\nb: 1\nc: 2\n");
+        yml::Tree output = yml::parse_in_arena("{}");
+        Workspace ws(&output);
+        ws.prepare_add_dir_recursive("rdir");
+        REQUIRE_EQ(ws.m_manifests.required_size, 1u);
+        CHECK_EQ(ws.m_manifests.buf[0].num_files, 6u); // c.yaml is also listed through the link
+        CHECK_EQ(ws.m_dir_ancestors.required_size, 0u);
+        ::unlink("rdir/sub/loop");
+        ::unlink("rdir/sub/link");
+    }
+    #endif
+    C4_CHECK(fs::rmtree("rdir") == 0);
+}
+
+TEST_CASE("opts.cache")
+{
+    case1files setup;
+    const char cache_dir[] = "c4conf_cache";
+    fs::rmtree(cache_dir);
+    REQUIRE_EQ(fs::mkdir(cache_dir), 0);
+    const ParsedOpt args[] = {
+        {ConfigAction::load_dir, {}, csubstr("somedir"), {}},
+        {ConfigAction::set_node, csubstr("key1.key1val1[1]"), csubstr("set"), {}},
+        {ConfigAction::callback, {}, {}, action1},
+        {ConfigAction::set_node, csubstr("key1.key1val1[2]"), csubstr("set after callback"), {}},
+    };
+    yml::Tree expected_tree = yml::parse_in_arena(reftree);
+    setup.transform2(&expected_tree);
+    expected_tree["key1"]["key1val1"][1].set_val("set");
+    action1(expected_tree, {});
+    expected_tree["key1"]["key1val1"][2].set_val("set after callback");
+    const std::string expected = yml::emitrs_yaml<std::string>(expected_tree);
+    auto apply = [&](bool expect_hit){
+        yml::Tree output = yml::parse_in_arena(reftree);
+        Workspace ws(&output);
+        ws.m_cache_dir = cache_dir;
+        ws.apply_opts(args, C4_COUNTOF(args));
+        CHECK_EQ(ws.m_cache_hit, expect_hit);
+        CHECK_EQ(yml::emitrs_yaml<std::string>(output), expected);
+    };
+    apply(false);
+    apply(true);
+    apply(true);
+    SUBCASE("a changed file is a miss")
+    {
+        fs::file_put_contents("somedir/file1", csubstr("{key1: {key1val0: this one too, and more}}"));
+        apply(false);
+        apply(true);
+    }
+    SUBCASE("a changed initial tree is a miss")
+    {
+        yml::Tree output = yml::parse_in_arena("{key0: 0, key1: {key1val1: [0, 1]}}");
+        Workspace ws(&output);
+        ws.m_cache_dir = cache_dir;
+        ws.apply_opts(args, 2u);
+        CHECK_FALSE(ws.m_cache_hit);
+    }
+    SUBCASE("a corrupted cache is a miss")
+    {
+        fs::EntryList entries = {};
+        fs::maybe_buf<char> scratch = {};
+        std::vector<char> namebuf(4096);
+        std::vector<char*> names(16);
+        entries.arena.buf = namebuf.data(); entries.arena.size = namebuf.size();
+        entries.names.buf = names.data(); entries.names.size = names.size();
+        std::vector<char> scratchbuf(4096);
+        scratch.buf = scratchbuf.data(); scratch.size = scratchbuf.size();
+        REQUIRE(fs::list_entries(cache_dir, &entries, &scratch));
+        for(const char *name : entries)
+            fs::file_put_contents(name, csubstr("corrupted"));
+        apply(false);
+        apply(true);
+    }
+    fs::rmtree(cache_dir);
+}
+
+struct TraceLog
+{
+    std::vector<TraceEvent> events;
+    std::vector<std::string> names;
+    static void record(TraceEvent const& ev, void *log_)
+    {
+        TraceLog *log = (TraceLog*) log_;
+        log->events.push_back(ev);
+        log->names.emplace_back(ev.name.str, ev.name.len);
+    }
+    size_t count(TracePhase phase) const
+    {
+        size_t num = 0;
+        for(TraceEvent const& ev : events)
+            num += (ev.phase == phase && ev.begin);
+        return num;
+    }
+};
+
+TEST_CASE("opts.trace")
+{
+    case1files setup;
+    const ParsedOpt args[] = {
+        {ConfigAction::load_file, {}, csubstr("somedir/file0"), {}},
+        {ConfigAction::load_dir, csubstr("key1"), csubstr("somedir_to_key1"), {}},
+        {ConfigAction::set_node, csubstr("key1.key1val1[1]"), csubstr("set"), {}},
+    };
+    for(uint32_t flags : workspace_flags)
+    {
+        INFO("flags=", flags);
+        TraceLog log;
+        yml::Tree output = yml::parse_in_arena(reftree);
+        Workspace ws(&output, nullptr, flags);
+        ws.m_trace = &TraceLog::record;
+        ws.m_trace_data = &log;
+        ws.apply_opts(args, C4_COUNTOF(args));
+        // the events are properly nested, and the time does not go back
+        std::vector<TracePhase> stack;
+        for(size_t i = 0; i < log.events.size(); ++i)
+        {
+            TraceEvent const& ev = log.events[i];
+            INFO("i=", i, " phase=", trace_phase_str(ev.phase), " name=", log.names[i]);
+            if(i)
+                CHECK_GE(ev.time_ns, log.events[i - 1].time_ns);
+            if(ev.begin)
+            {
+                stack.push_back(ev.phase);
+            }
+            else
+            {
+                REQUIRE(!stack.empty());
+                CHECK(stack.back() == ev.phase);
+                stack.pop_back();
+            }
+        }
+        CHECK(stack.empty());
+        CHECK_EQ(log.count(TracePhase::prepare), 1u);
+        CHECK_EQ(log.count(TracePhase::layer), 3u);
+        CHECK_EQ(log.count(TracePhase::list), 1u);
+        CHECK_EQ(log.count(TracePhase::read), 3u);
+        CHECK_GE(log.count(TracePhase::parse), 2u);
+        CHECK_GE(log.count(TracePhase::merge), 2u);
+        CHECK_EQ(log.count(TracePhase::cache), 0u);
+        CHECK_EQ(log.names[0], "");
+        CHECK_EQ(log.names[1], "somedir/file0"); // the stat of the first file
+    }
+    SUBCASE("chrome")
+    {
+        const char filename[] = "c4conf_trace.json";
+        {
+            yml::Tree output = yml::parse_in_arena(reftree);
+            Workspace ws(&output);
+            ChromeTraceSink sink(filename);
+            REQUIRE(sink.valid());
+            sink.attach(&ws);
+            ws.apply_opts(args, C4_COUNTOF(args));
+            CHECK_GT(sink.m_num_events, 0u);
+        }
+        std::string json = fs::file_get_contents<std::string>(filename);
+        fs::rmfile(filename);
+        yml::Tree trace = yml::parse_json_in_arena(to_csubstr(json));
+        REQUIRE(trace.rootref().is_seq());
+        REQUIRE_GT(trace.rootref().num_children(), 0u);
+        CHECK_EQ(trace.rootref()[0]["name"].val(), "prepare");
+        CHECK_EQ(trace.rootref()[0]["ph"].val(), "B");
+        CHECK_EQ(trace.rootref()[1]["name"].val(), "stat");
+        CHECK_EQ(trace.rootref()[1]["args"]["name"].val(), "somedir/file0");
+    }
+}
+
+TEST_CASE("opts.reload")
+{
+    case1files setup;
+    const ParsedOpt args[] = {
+        {ConfigAction::set_node, csubstr("key1.key1val1[0]"), csubstr("before the layers"), {}},
+        {ConfigAction::load_file, {}, csubstr("somedir/file0"), {}},
+        {ConfigAction::set_node, csubstr("key1.key1val1[1]"), csubstr("in the first layer"), {}},
+        {ConfigAction::load_dir, csubstr("key1"), csubstr("somedir_to_key1"), {}},
+        {ConfigAction::callback, {}, {}, action1},
+    };
+    auto expected = [&](csubstr key0val0, csubstr key1val0){
+        yml::Tree t = yml::parse_in_arena(reftree);
+        t["key1"]["key1val1"][0].set_val("before the layers");
+        t["key0"]["key0val0"].clear_children();
+        t["key0"]["key0val0"].set_type(yml::KEYVAL);
+        t["key0"]["key0val0"].set_val(key0val0);
+        t["key1"]["key1val1"][1].set_val("in the first layer");
+        t["key1"]["key1val0"].clear_children();
+        t["key1"]["key1val0"].set_type(yml::KEYVAL);
+        t["key1"]["key1val0"].set_val(key1val0);
+        action1(t, {});
+        return yml::emitrs_yaml<std::string>(t);
+    };
+    yml::Tree output = yml::parse_in_arena(reftree);
+    ReloadableConf conf(&output);
+    conf.load(args, C4_COUNTOF(args));
+    REQUIRE_EQ(conf.m_num_layers, 2u);
+    CHECK_EQ(yml::emitrs_yaml<std::string>(output), expected("now replaced as a scalar", "THIS one too v2"));
+    {
+        // the checkpoints are snapshots without dead text
+        yml::Tree checkpoint = yml::parse_in_arena(reftree);
+        checkpoint["key1"]["key1val1"][0].set_val("before the layers");
+        const std::string before_layers = yml::emitrs_yaml<std::string>(checkpoint);
+        for(size_t i = 0; i < conf.m_num_layers; ++i)
+        {
+            INFO("layer=", i);
+            REQUIRE(load_snapshot(conf.m_layers[i].checkpoint, &checkpoint));
+            if(i == 0)
+                CHECK_EQ(yml::emitrs_yaml<std::string>(checkpoint), before_layers);
+            compact_arena(&checkpoint);
+            CHECK_EQ(save_snapshot(checkpoint, {}), conf.m_layers[i].checkpoint.len);
+        }
+    }
+    CHECK_FALSE(conf.reload());
+    // change the last layer
+    fs::file_put_contents("somedir_to_key1/file4", csubstr("{key1val0: a new file}"));
+    CHECK(conf.reload());
+    CHECK_EQ(yml::emitrs_yaml<std::string>(output), expected("now replaced as a scalar", "a new file"));
+    CHECK_FALSE(conf.reload());
+    // change the first layer
+    fs::file_put_contents("somedir/file0", csubstr("{key0: {key0val0: changed in the first layer}}"));
+    CHECK(conf.reload());
+    CHECK_EQ(yml::emitrs_yaml<std::string>(output), expected("changed in the first layer", "a new file"));
+    CHECK_FALSE(conf.reload());
+    // a missing file defers the reload
+    fs::rmfile("somedir/file0");
+    CHECK_FALSE(conf.reload());
+    CHECK_EQ(yml::emitrs_yaml<std::string>(output), expected("changed in the first layer", "a new file"));
+    fs::file_put_contents("somedir/file0", csubstr("{key0: {key0val0: replaced}}"));
+    CHECK(conf.reload());
+    CHECK_EQ(yml::emitrs_yaml<std::string>(output), expected("replaced", "a new file"));
+}
+
+TEST_CASE("opts.load_dir_file_changed_after_prepare")
+{
+    for(uint32_t flags : workspace_flags)
+    {
+        INFO("flags=", flags);
+        case1files setup;
+        yml::Tree output = yml::parse_in_arena(reftree);
+        Workspace ws(&output, nullptr, flags);
+        ws.prepare_add_dir("somedir");
+        // the files are rewritten and removed after being stat'ed
+        fs::file_put_contents("somedir/file3", csubstr("{key1: {key1val0: rewritten, and longer than before}}"));
+        fs::rmfile("somedir/file1");
+        ws.add_dir("somedir");
+        ws.merge_pending();
+        CHECK(ws.m_inputs_changed);
+        // the changed files are skipped, unless they are mapped,
+        // which does not depend on the size from the prepare phase
+        const bool mapped = (flags & WS_MMAP_FILES) && !(flags & WS_DEFERRED_MERGE);
+        yml::Tree expected_tree = yml::parse_in_arena(reftree);
+        expected_tree["key0"]["key0val0"].clear_children();
+        expected_tree["key0"]["key0val0"].set_type(yml::KEYVAL);
+        expected_tree["key0"]["key0val0"].set_val("NOW replaced as a scalar v2");
+        if(mapped)
+        {
+            expected_tree["key1"]["key1val0"].clear_children();
+            expected_tree["key1"]["key1val0"].set_type(yml::KEYVAL);
+            expected_tree["key1"]["key1val0"].set_val("rewritten, and longer than before");
+        }
+        CHECK_EQ(yml::emitrs_yaml<std::string>(output), yml::emitrs_yaml<std::string>(expected_tree));
+        ws.reset();
+        CHECK_FALSE(ws.m_inputs_changed);
+    }
+}
+
+TEST_CASE("opts.load_dir_parse_error_in_thread")
+{
+    // a parse error in any of the threads is reported in the calling
+    // thread, once all the threads were joined
+    struct ThrowingCallbacks
+    {
+        yml::Callbacks prev = yml::get_callbacks();
+        yml::Callbacks cb = yml::get_callbacks();
+        ThrowingCallbacks()
+        {
+            cb.m_error = [](const char *msg, size_t len, yml::Location, void *) {
+                throw std::runtime_error(std::string(msg, len));
+            };
+            yml::set_callbacks(cb);
+        }
+        ~ThrowingCallbacks() { yml::set_callbacks(prev); }
+    } callbacks;
+    for(uint32_t flags : workspace_flags)
+    {
+        if(!(flags & WS_PARALLEL_DIRS))
+            continue;
+        INFO("flags=", flags);
+        case1files setup;
+        fs::file_put_contents("somedir/file2", csubstr("{key0: \"unclosed quote"));
+        yml::Tree output(callbacks.cb);
+        Workspace ws(&output, nullptr, flags);
+        ws.m_num_threads = 4;
+        ws.prepare_add_dir("somedir");
+        CHECK_THROWS_AS(ws.add_dir("somedir"), std::runtime_error);
+    }
+}
+
 TEST_CASE("opts.load_dir_to_node")
 {
     case1files setup;
@@ -541,10 +1126,14 @@ void test_opts(std::vector<std::string> const& input_args,
     //
     if(expected_args.size())
     {
-        yml::Tree output = reftree_ ? *reftree_ : yml::parse_in_arena(reftree);
-        Workspace ws(&output);
-        ws.apply_opts(buf_out.data(), buf_out.size());
-        CHECK_EQ(yml::emitrs_yaml<std::string>(output), yml::emitrs_yaml<std::string>(expected_tree));
+        for(uint32_t flags : workspace_flags)
+        {
+            INFO("flags=", flags);
+            yml::Tree output = reftree_ ? *reftree_ : yml::parse_in_arena(reftree);
+            Workspace ws(&output, nullptr, flags);
+            ws.apply_opts(buf_out.data(), buf_out.size());
+            CHECK_EQ(yml::emitrs_yaml<std::string>(output), yml::emitrs_yaml<std::string>(expected_tree));
+        }
     }
 }
 